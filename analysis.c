@@ -0,0 +1,2010 @@
+/**
+ * @file
+ *
+ * Contains packet train analysis functions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "analysis.h"
+#include "sockets.h"
+#include "util.h"
+#include "logger.h"
+
+/**
+ * Creates a train record with room for size arrivals
+ *
+ * size: number of arrivals to make room for
+ *
+ * returns: pointer to train_record struct if successful, NULL otherwise
+ */
+struct train_record* create_train_record(int size)
+{
+    struct train_record *record = malloc(sizeof(struct train_record));
+    if (record == NULL) {
+        perror("Error mallocing train record");
+        return NULL;
+    }
+
+    record->arrivals = malloc(size * sizeof(struct arrival));
+    if (record->arrivals == NULL) {
+        perror("Error mallocing arrivals");
+        free(record);
+        return NULL;
+    }
+    record->count = 0;
+    record->size = size;
+    record->drops = 0;
+
+    return record;
+}
+
+/**
+ * Frees a train record and its arrivals
+ *
+ * record: pointer to train_record struct
+ */
+void free_train_record(struct train_record *record)
+{
+    if (record == NULL) {
+        return;
+    }
+    free(record->arrivals);
+    free(record);
+}
+
+/**
+ * Timestamps and records a packet arrival. A packet coalesced with an
+ * earlier one by UDP GRO was read along with it, so it gets the time
+ * of the previous arrival.
+ *
+ * record: pointer to train_record struct
+ * id: packet id
+ * bytes: payload bytes received
+ * coalesced: the packet came after the first one of a UDP GRO read
+ * wake: us from the kernel's arrival stamp to the read, -1 if unknown
+ *
+ * returns: 1 if recorded, -1 if the record is full
+ */
+int record_arrival(struct train_record *record, uint16_t id, int bytes, bool coalesced, double wake)
+{
+    if (record->count >= record->size) {
+        return -1;
+    }
+
+    struct arrival *a = &record->arrivals[record->count];
+    if (coalesced && record->count > 0) {
+        a->time = record->arrivals[record->count - 1].time;
+    } else {
+        gettimeofday(&a->time, NULL);
+    }
+    a->id = id;
+    a->bytes = bytes;
+    a->coalesced = coalesced;
+    a->wake = wake;
+    record->count++;
+
+    return 1;
+}
+
+/**
+ * Time between the first and last recorded arrival
+ *
+ * record: pointer to train_record struct
+ *
+ * returns: duration in milliseconds, 0 if fewer than two arrivals
+ */
+double train_duration_milli(struct train_record *record)
+{
+    if (record->count < 2) {
+        return 0;
+    }
+    return time_diff_micro(record->arrivals[record->count - 1].time,
+                            record->arrivals[0].time) / 1000;
+}
+
+/**
+ * Total payload bytes recorded
+ *
+ * record: pointer to train_record struct
+ *
+ * returns: number of bytes
+ */
+long train_bytes(struct train_record *record)
+{
+    long total = 0;
+    for (int i = 0; i < record->count; i++) {
+        total += record->arrivals[i].bytes;
+    }
+    return total;
+}
+
+/**
+ * Compares two doubles for qsort
+ */
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *) a;
+    double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Finds the median of an array, sorting it in place
+ *
+ * values: array of doubles
+ * count: number of values
+ *
+ * returns: median, 0 if the array is empty
+ */
+double median(double *values, int count)
+{
+    if (count == 0) {
+        return 0;
+    }
+    qsort(values, count, sizeof(double), compare_doubles);
+    if (count % 2 == 1) {
+        return values[count / 2];
+    }
+    return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ * Gets a percentile of sorted values
+ *
+ * values: values in ascending order
+ * count: number of values, at least 1
+ * percent: percentile to get
+ *
+ * returns: the value below which percent of the values fall
+ */
+static double percentile(double *values, int count, double percent)
+{
+    int index = (int) ceil(percent / 100 * count) - 1;
+    return values[index < 0 ? 0 : index];
+}
+
+/**
+ * Summarizes how long the receiver took to read packets once the
+ * kernel had them, which a sleeping receiver spends on its wakeup
+ *
+ * wakes: us from each kernel arrival stamp to the read, sorted in place
+ * count: number of wakes
+ * result: pointer to compression_result struct, wake percentiles get filled
+ */
+void summarize_wake(double *wakes, int count, struct compression_result *result)
+{
+    if (count == 0) {
+        return;
+    }
+    result->wake_p50 = median(wakes, count);
+    result->wake_p99 = percentile(wakes, count, 99);
+}
+
+/**
+ * Estimates the bottleneck capacity from packet pair dispersion. Two
+ * packets with consecutive ids were sent back to back, so the gap
+ * between their arrivals is the time the bottleneck needed to serve
+ * the second one. The median over all pairs filters out pairs that
+ * were spread by cross traffic or squeezed together by the receiver.
+ * If the sender is slower than the bottleneck this measures the
+ * sending rate, so the result is a lower bound on the capacity.
+ * Packets coalesced by UDP GRO were not timed on their own, so pairs
+ * that touch one are left out.
+ *
+ * record: pointer to train_record struct
+ *
+ * returns: capacity in payload bytes per second, -1 if there are no usable pairs
+ */
+double estimate_capacity(struct train_record *record)
+{
+    if (record->count < 2) {
+        return -1;
+    }
+
+    double *rates = malloc((record->count - 1) * sizeof(double));
+    if (rates == NULL) {
+        perror("Error mallocing rates");
+        return -1;
+    }
+
+    int pairs = 0;
+    for (int i = 1; i < record->count; i++) {
+        struct arrival *prev = &record->arrivals[i - 1];
+        struct arrival *curr = &record->arrivals[i];
+        if ((uint16_t) (prev->id + 1) != curr->id) {
+            continue;   // loss or reordering between the two
+        }
+        if (prev->coalesced || curr->coalesced
+                || (i + 1 < record->count && record->arrivals[i + 1].coalesced)) {
+            continue;   // a GRO read, only timed as a whole
+        }
+        double dispersion = time_diff_micro(curr->time, prev->time);
+        if (dispersion <= 0) {
+            continue;   // below timestamp resolution
+        }
+        rates[pairs++] = curr->bytes / (dispersion / 1000000);
+    }
+
+    double capacity = pairs > 0 ? median(rates, pairs) : -1;
+    LOG("Capacity estimate from %d pairs: %.0f bytes/s\n", pairs, capacity);
+
+    free(rates);
+    return capacity;
+}
+
+/**
+ * Rate of a slice of arrivals, the first packet only marks the start
+ *
+ * record: pointer to train_record struct
+ * from: index of first arrival
+ * to: index past the last arrival
+ *
+ * returns: rate in bytes per second, -1 if the slice has no duration
+ */
+static double slice_rate(struct train_record *record, int from, int to)
+{
+    if (to - from < 2) {
+        return -1;
+    }
+    double elapsed = time_diff_micro(record->arrivals[to - 1].time,
+                                        record->arrivals[from].time) / 1000000;
+    if (elapsed <= 0) {
+        return -1;
+    }
+
+    long bytes = 0;
+    for (int i = from + 1; i < to; i++) {
+        bytes += record->arrivals[i].bytes;
+    }
+    return bytes / elapsed;
+}
+
+/**
+ * Standard error of a train's rate, from the spread of the rates of
+ * RATIO_SEGMENTS equal slices of the train
+ *
+ * record: pointer to train_record struct
+ *
+ * returns: standard error in bytes per second, -1 if the train is too short
+ */
+static double rate_error(struct train_record *record)
+{
+    int per_segment = record->count / RATIO_SEGMENTS;
+    if (per_segment < 2) {
+        return -1;
+    }
+
+    double rates[RATIO_SEGMENTS];
+    double mean = 0;
+    for (int k = 0; k < RATIO_SEGMENTS; k++) {
+        rates[k] = slice_rate(record, k * per_segment, (k + 1) * per_segment);
+        if (rates[k] < 0) {
+            return -1;
+        }
+        mean += rates[k] / RATIO_SEGMENTS;
+    }
+
+    double var = 0;
+    for (int k = 0; k < RATIO_SEGMENTS; k++) {
+        var += (rates[k] - mean) * (rates[k] - mean) / (RATIO_SEGMENTS - 1);
+    }
+    return sqrt(var / RATIO_SEGMENTS);
+}
+
+/**
+ * Standard error of the ratio of two train rates, combining the
+ * relative standard errors of both rates
+ *
+ * top: pointer to train_record struct of the numerator
+ * top_rate: rate of the numerator train
+ * bottom: pointer to train_record struct of the denominator
+ * bottom_rate: rate of the denominator train
+ *
+ * returns: standard error of top_rate / bottom_rate, -1 if unknown
+ */
+static double ratio_error(struct train_record *top, double top_rate,
+                            struct train_record *bottom, double bottom_rate)
+{
+    double top_error = rate_error(top);
+    double bottom_error = rate_error(bottom);
+    if (top_error < 0 || bottom_error < 0) {
+        return -1;
+    }
+    return (top_rate / bottom_rate) * sqrt(pow(top_error / top_rate, 2)
+                                            + pow(bottom_error / bottom_rate, 2));
+}
+
+/**
+ * Estimates the effective compression ratio as the low entropy rate
+ * over the high entropy rate. Both trains cross the same bottleneck,
+ * so without compression the ratio is around 1. The error bar combines
+ * the relative standard errors of the two rates.
+ *
+ * low: pointer to low entropy train_record struct
+ * high: pointer to high entropy train_record struct
+ * result: pointer to compression_result struct to fill
+ */
+void estimate_ratio(struct train_record *low, struct train_record *high,
+                    struct compression_result *result)
+{
+    result->low_delta = train_duration_milli(low);
+    result->high_delta = train_duration_milli(high);
+    result->low_bytes = train_bytes(low);
+    result->high_bytes = train_bytes(high);
+    result->low_packets = low->count;
+    result->high_packets = high->count;
+    result->valid = low->count >= 2 && high->count >= 2;
+
+    double low_rate = slice_rate(low, 0, low->count);
+    double high_rate = slice_rate(high, 0, high->count);
+    if (low_rate < 0 || high_rate < 0) {
+        return;
+    }
+    result->ratio = low_rate / high_rate;
+
+    result->ratio_error = ratio_error(low, low_rate, high, high_rate);
+
+    LOG("Effective compression ratio: %.3f +/- %.3f\n", result->ratio, result->ratio_error);
+}
+
+/**
+ * Normalizes the high entropy delta by the bottleneck capacity. At the
+ * capacity the low entropy pairs saw, the high entropy train would take
+ * its payload bytes over the capacity. Without compression it takes
+ * about that long, with compression the low entropy pairs were served
+ * faster, so the measured delta is that many times the expected one.
+ *
+ * high: pointer to high entropy train_record struct
+ * result: pointer to compression_result struct with the capacity to fill
+ */
+static void normalize_delta(struct train_record *high, struct compression_result *result)
+{
+    double high_rate = slice_rate(high, 0, high->count);
+    if (result->capacity <= 0 || high_rate <= 0) {
+        return;
+    }
+    // expected delta over measured delta, each leaving out the first packet
+    result->capacity_ratio = result->capacity / high_rate;
+    LOG("Capacity normalized ratio: %.3f\n", result->capacity_ratio);
+}
+
+/**
+ * Gives a compression result its verdict, from the ratio if there is
+ * a ratio threshold and the ratio is known, from the delta otherwise.
+ * If the capacity normalized ratio is known too it has to exceed the
+ * threshold as well, since pairs squeezed together by the receiver and
+ * trains stretched by cross traffic mislead one of the two but rarely
+ * both.
+ *
+ * result: pointer to compression_result struct with the deltas and ratio
+ * threshold: ms the high entropy train must take longer than the low one
+ * ratio_threshold: ratio above which the path compresses, 0 to use threshold
+ */
+static void judge_result(struct compression_result *result, int threshold, double ratio_threshold)
+{
+    double difference = result->high_delta - result->low_delta;
+
+    LOG("Low entropy: %.0fms\n", result->low_delta);
+    LOG("High entropy: %.0fms\n", result->high_delta);
+    LOG("Delta: %.0fms\n", difference);
+
+    if (ratio_threshold > 0 && result->ratio > 0) {
+        result->compressed = result->ratio > ratio_threshold
+                                && (result->capacity_ratio < 0
+                                    || result->capacity_ratio > ratio_threshold);
+    } else {
+        result->compressed = difference > threshold;
+    }
+}
+
+/**
+ * Turns a received low and high entropy train into a compression
+ * result with its verdict
+ *
+ * low: pointer to low entropy train_record struct
+ * high: pointer to high entropy train_record struct
+ * threshold: ms the high entropy train must take longer than the low one
+ * ratio_threshold: ratio above which the path compresses, 0 to use threshold
+ * result: pointer to compression_result struct to fill
+ */
+void analyze_trains(struct train_record *low, struct train_record *high, int threshold,
+                    double ratio_threshold, struct compression_result *result)
+{
+    init_result(result);
+    estimate_ratio(low, high, result);
+    result->capacity = estimate_capacity(low);
+    normalize_delta(high, result);
+    result->local_drops = low->drops + high->drops;
+    double *wakes = malloc((low->count + high->count + 1) * sizeof(double));
+    if (wakes == NULL) {
+        perror("Error mallocing wake latencies");
+    }
+    int wake_count = 0;
+    struct train_record *records[2] = { low, high };
+    for (int k = 0; k < 2; k++) {
+        for (int i = 0; i < records[k]->count; i++) {
+            struct arrival *a = &records[k]->arrivals[i];
+            result->coalesced += a->coalesced;
+            if (wakes != NULL && a->wake >= 0) {
+                wakes[wake_count++] = a->wake;
+            }
+        }
+    }
+    summarize_wake(wakes, wake_count, result);
+    free(wakes);
+    judge_result(result, threshold, ratio_threshold);
+}
+
+/**
+ * Turns the aggregates of a low and high entropy train into a
+ * compression result with its verdict. The rates leave out the first
+ * packet, like slice_rate(). Without the arrivals themselves there is
+ * no capacity estimate and no error bar on the ratio.
+ *
+ * low: pointer to train_summary struct of the low entropy train
+ * high: pointer to train_summary struct of the high entropy train
+ * threshold: ms the high entropy train must take longer than the low one
+ * ratio_threshold: ratio above which the path compresses, 0 to use threshold
+ * result: pointer to compression_result struct to fill
+ */
+void analyze_summaries(struct train_summary *low, struct train_summary *high, int threshold,
+                        double ratio_threshold, struct compression_result *result)
+{
+    init_result(result);
+    result->aggregated = true;
+    result->low_delta = low->duration;
+    result->high_delta = high->duration;
+    result->low_bytes = low->bytes;
+    result->high_bytes = high->bytes;
+    result->low_packets = low->packets;
+    result->high_packets = high->packets;
+    result->valid = low->packets >= 2 && high->packets >= 2;
+
+    if (low->duration > 0 && high->duration > 0) {
+        double low_rate = (low->bytes - low->first_bytes) / low->duration;
+        double high_rate = (high->bytes - high->first_bytes) / high->duration;
+        if (high_rate > 0) {
+            result->ratio = low_rate / high_rate;
+            LOG("Effective compression ratio: %.3f\n", result->ratio);
+        }
+    }
+    judge_result(result, threshold, ratio_threshold);
+}
+
+/**
+ * Receives count pipelined trains, the sender numbers the ids on from
+ * one train to the next, so packets are sorted into trains by id.
+ * Waiting for the start of a train uses wait_ms, once a train is
+ * running silence of timeout_ms ends it. With several flows, every
+ * flow sends its trains at the same time and tags its packets, so
+ * train k of flow f goes to record f * count + k. Socket drops go to
+ * the train of the datagram that reveals them, see add_drop_count_opt,
+ * and datagrams a full record cannot hold count as its drops.
+ * A UDP GRO read is split back into its datagrams, see record_arrival.
+ *
+ * sockfd: bound udp socket file descriptor
+ * records: array of flows * count train_record pointers to fill
+ * count: number of trains per flow
+ * train_size: packets per train
+ * wait_ms: ms to wait for the start of a train
+ * timeout_ms: ms of silence that ends a running train
+ * flows: number of flows, 1 if the packets are not tagged
+ * busy: spin on the socket rather than sleep on it, see receive_datagram_batch
+ *
+ * returns: number of packets received if successful, -1 otherwise
+ */
+int receive_trains(int sockfd, struct train_record **records, int count, int train_size,
+                    int wait_ms, int timeout_ms, int flows, bool busy)
+{
+    if (add_timeout_opt_milli(sockfd, wait_ms) < 0) {
+        return -1;
+    }
+
+    struct datagram_batch batch;
+    if (init_datagram_batch(&batch) < 0) {
+        return -1;
+    }
+    int received = 0;
+    int current = -1;       // latest train seen
+    bool waiting = true;    // waiting for the start of a train
+    int64_t last_drops = -1;    // drops before the trains are not theirs
+    int total = flows * count * train_size;
+    while (received < total) {
+        if (receive_datagram_batch(sockfd, &batch, busy) < 0) {
+            if (errno != EAGAIN) {
+                free_datagram_batch(&batch);
+                return -1;
+            }
+            if (waiting || current == count - 1) {
+                LOGP("Trains timeout.\n");
+                break;
+            }
+            // train is over, wait for the next one to start
+            if (add_timeout_opt_milli(sockfd, wait_ms) < 0) {
+                free_datagram_batch(&batch);
+                return -1;
+            }
+            waiting = true;
+            continue;
+        }
+
+        for (int d = 0; d < batch.count; d++) {
+            char *buf = batch.bufs + (size_t) d * GRO_BUFFER;
+            int bytes = batch.lengths[d];
+            struct datagram_meta *meta = &batch.metas[d];
+            long dropped = last_drops < 0 ? 0 : meta->drops - last_drops;
+            last_drops = meta->drops;
+            double wake = meta->stamped ? time_diff_micro(meta->read, meta->stamp) : -1;
+            bool matched = false;
+            for (int offset = 0; offset < bytes; offset += meta->segment_size) {
+                char *payload = buf + offset;
+                int length = bytes - offset < meta->segment_size ? bytes - offset : meta->segment_size;
+                uint16_t id = (uint8_t) payload[0] << 8 | (uint8_t) payload[1];
+                int k = id / train_size;
+                int flow = flows > 1 ? get_flow_tag(payload) : 0;
+                if (k >= count || flow >= flows) {
+                    continue;   // not part of the trains
+                }
+                struct train_record *record = records[flow * count + k];
+                record->drops += dropped;
+                dropped = 0;
+                matched = true;
+                // a train that is already full got duplicates or stray ids
+                if (record_arrival(record, id, length, offset > 0, offset > 0 ? -1 : wake) < 0) {
+                    record->drops++;
+                    continue;
+                }
+                received++;
+                if (k > current) {
+                    current = k;
+                }
+            }
+
+            if (matched && waiting) {
+                if (add_timeout_opt_milli(sockfd, timeout_ms) < 0) {
+                    free_datagram_batch(&batch);
+                    return -1;
+                }
+                waiting = false;
+            }
+        }
+    }
+
+    free_datagram_batch(&batch);
+    return received;
+}
+
+/**
+ * Sets a compression result to hold no information
+ *
+ * result: pointer to compression_result struct
+ */
+void init_result(struct compression_result *result)
+{
+    memset(result, 0, sizeof(struct compression_result));
+    result->capacity = -1;
+    result->capacity_ratio = -1;
+    result->ratio = -1;
+    result->ratio_error = -1;
+    result->rtt = -1;
+    result->jitter = -1;
+    result->local_drops = -1;
+    result->in_errors = -1;
+    result->rcvbuf_errors = -1;
+    result->wake_p50 = -1;
+    result->wake_p99 = -1;
+}
+
+/**
+ * Verdict line of a compression result
+ *
+ * result: pointer to compression_result struct
+ *
+ * returns: message string
+ */
+const char* result_message(struct compression_result *result)
+{
+    if (!result->valid) {
+        return "Failed to detect due to insufficient information.";
+    }
+    if (result->compressed) {
+        return "Compression detected.";
+    }
+    return "No compression detected.";
+}
+
+/**
+ * Builds the json object of a compression result
+ */
+static cJSON* result_to_object(struct compression_result *result)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "result", result_message(result));
+    cJSON_AddBoolToObject(root, "valid", result->valid);
+    cJSON_AddBoolToObject(root, "compressed", result->compressed);
+    cJSON_AddNumberToObject(root, "low_delta_ms", result->low_delta);
+    cJSON_AddNumberToObject(root, "high_delta_ms", result->high_delta);
+    cJSON_AddNumberToObject(root, "low_bytes", result->low_bytes);
+    cJSON_AddNumberToObject(root, "high_bytes", result->high_bytes);
+    cJSON_AddNumberToObject(root, "low_packets", result->low_packets);
+    cJSON_AddNumberToObject(root, "high_packets", result->high_packets);
+    cJSON_AddNumberToObject(root, "capacity", result->capacity);
+    cJSON_AddNumberToObject(root, "capacity_ratio", result->capacity_ratio);
+    cJSON_AddNumberToObject(root, "ratio", result->ratio);
+    cJSON_AddNumberToObject(root, "ratio_error", result->ratio_error);
+    cJSON_AddNumberToObject(root, "rtt_ms", result->rtt);
+    cJSON_AddNumberToObject(root, "jitter_ms", result->jitter);
+    cJSON_AddNumberToObject(root, "local_drops", result->local_drops);
+    cJSON_AddNumberToObject(root, "udp_in_errors", result->in_errors);
+    cJSON_AddNumberToObject(root, "udp_rcvbuf_errors", result->rcvbuf_errors);
+    cJSON_AddNumberToObject(root, "coalesced", result->coalesced);
+    cJSON_AddNumberToObject(root, "wake_p50_us", result->wake_p50);
+    cJSON_AddNumberToObject(root, "wake_p99_us", result->wake_p99);
+    cJSON_AddBoolToObject(root, "busy_poll", result->busy_poll);
+    cJSON_AddBoolToObject(root, "kernel_aggregated", result->aggregated);
+    return root;
+}
+
+/**
+ * Serializes a compression result
+ *
+ * result: pointer to compression_result struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* result_to_json(struct compression_result *result)
+{
+    cJSON *root = result_to_object(result);
+    if (root == NULL) {
+        return NULL;
+    }
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Reads a number from a json object
+ */
+static double json_number(cJSON *root, char *key, double default_value)
+{
+    cJSON *item = cJSON_GetObjectItem(root, key);
+    if (item == NULL || !cJSON_IsNumber(item)) {
+        return default_value;
+    }
+    return item->valuedouble;
+}
+
+/**
+ * Parses a compression result from a json object
+ *
+ * result: pointer to compression_result struct to fill
+ * root: json object
+ */
+static void result_from_object(struct compression_result *result, cJSON *root)
+{
+    init_result(result);
+    result->valid = cJSON_IsTrue(cJSON_GetObjectItem(root, "valid"));
+    result->compressed = cJSON_IsTrue(cJSON_GetObjectItem(root, "compressed"));
+    result->low_delta = json_number(root, "low_delta_ms", 0);
+    result->high_delta = json_number(root, "high_delta_ms", 0);
+    result->low_bytes = json_number(root, "low_bytes", 0);
+    result->high_bytes = json_number(root, "high_bytes", 0);
+    result->low_packets = json_number(root, "low_packets", 0);
+    result->high_packets = json_number(root, "high_packets", 0);
+    result->capacity = json_number(root, "capacity", -1);
+    result->capacity_ratio = json_number(root, "capacity_ratio", -1);
+    result->ratio = json_number(root, "ratio", -1);
+    result->ratio_error = json_number(root, "ratio_error", -1);
+    result->rtt = json_number(root, "rtt_ms", -1);
+    result->jitter = json_number(root, "jitter_ms", -1);
+    result->local_drops = json_number(root, "local_drops", -1);
+    result->in_errors = json_number(root, "udp_in_errors", -1);
+    result->rcvbuf_errors = json_number(root, "udp_rcvbuf_errors", -1);
+    result->coalesced = json_number(root, "coalesced", 0);
+    result->wake_p50 = json_number(root, "wake_p50_us", -1);
+    result->wake_p99 = json_number(root, "wake_p99_us", -1);
+    result->busy_poll = cJSON_IsTrue(cJSON_GetObjectItem(root, "busy_poll"));
+    result->aggregated = cJSON_IsTrue(cJSON_GetObjectItem(root, "kernel_aggregated"));
+}
+
+/**
+ * Parses a serialized compression result
+ *
+ * result: pointer to compression_result struct to fill
+ * text: json text
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int result_from_json(struct compression_result *result, char *text)
+{
+    cJSON *root = cJSON_Parse(text);
+    if (root == NULL) {
+        init_result(result);
+        fprintf(stderr, "Error parsing result\n");
+        return -1;
+    }
+    result_from_object(result, root);
+    cJSON_Delete(root);
+
+    return 1;
+}
+
+/**
+ * Prints a ratio with its error bar if known
+ */
+static void print_ratio(const char *name, double ratio, double error)
+{
+    if (ratio < 0) {
+        return;
+    }
+    if (error >= 0) {
+        printf("%s: %.3f +/- %.3f\n", name, ratio, error);
+    } else {
+        printf("%s: %.3f\n", name, ratio);
+    }
+}
+
+/**
+ * Prints what the receiver dropped, if anything, so local drops can be
+ * told apart from loss on the path
+ *
+ * local_drops: datagrams the receiving socket dropped, -1 if unknown
+ * in_errors: udp receive errors in the receiver's namespace, -1 if unknown
+ * rcvbuf_errors: of those, errors on full receive buffers
+ */
+static void print_drops(long local_drops, long in_errors, long rcvbuf_errors)
+{
+    if (local_drops <= 0 && in_errors <= 0) {
+        return;
+    }
+    printf("Dropped at the receiver: %ld by the socket", local_drops);
+    if (in_errors >= 0) {
+        printf(", %ld udp receive errors (%ld on full buffers) in its namespace",
+               in_errors, rcvbuf_errors);
+    }
+    printf("\n");
+}
+
+/**
+ * Prints a compression result, either as text or as json
+ *
+ * result: pointer to compression_result struct
+ * json: print as json
+ */
+void print_result(struct compression_result *result, bool json)
+{
+    if (json) {
+        char *text = result_to_json(result);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    printf("%s\n", result_message(result));
+    // drops at the receiver may be why a result is invalid
+    print_drops(result->local_drops, result->in_errors, result->rcvbuf_errors);
+    if (!result->valid) {
+        return;
+    }
+    printf("Low entropy: %.3fms, high entropy: %.3fms\n", result->low_delta, result->high_delta);
+    if (result->jitter >= 0) {
+        printf("Delta: %.3fms, of which rtt jitter +/- %.3fms (baseline rtt %.3fms)\n",
+                result->high_delta - result->low_delta, result->jitter, result->rtt);
+    }
+    print_ratio("Effective compression ratio", result->ratio, result->ratio_error);
+    if (result->capacity > 0) {
+        printf("Bottleneck capacity: %.2f Mbit/s\n", result->capacity * 8 / 1000000);
+    }
+    print_ratio("Capacity normalized ratio", result->capacity_ratio, -1);
+    if (result->coalesced > 0) {
+        printf("UDP GRO coalesced %d packets, timed per read rather than per packet\n",
+               result->coalesced);
+    }
+    if (result->wake_p50 >= 0) {
+        printf("Wake latency (%s): p50 %.1fus, p99 %.1fus\n",
+               result->busy_poll ? "busy polling" : "blocking receive",
+               result->wake_p50, result->wake_p99);
+    }
+    if (result->aggregated) {
+        printf("Timed in the kernel by the xdp program, from the first and last arrival only\n");
+    }
+}
+
+/**
+ * Prints the results of both directions of a bidirectional session,
+ * either as text or as one json object
+ *
+ * forward: pointer to compression_result struct of client to server
+ * reverse: pointer to compression_result struct of server to client
+ * json: print as json
+ */
+void print_directions(struct compression_result *forward, struct compression_result *reverse, bool json)
+{
+    if (json) {
+        cJSON *root = cJSON_CreateObject();
+        if (root == NULL) {
+            return;
+        }
+        cJSON_AddItemToObject(root, "client_to_server", result_to_object(forward));
+        cJSON_AddItemToObject(root, "server_to_client", result_to_object(reverse));
+        char *text = cJSON_PrintUnformatted(root);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        cJSON_Delete(root);
+        return;
+    }
+
+    printf("Client to server: ");
+    print_result(forward, false);
+    printf("Server to client: ");
+    print_result(reverse, false);
+}
+
+/**
+ * Combines the results of flows that took different paths. A
+ * compressor on only some of the parallel paths only shows on the
+ * flows hashed onto them, so a single compressed flow is enough.
+ *
+ * result: pointer to flow_result struct with the flows filled in
+ */
+void combine_flows(struct flow_result *result)
+{
+    result->valid = false;
+    result->compressed = false;
+    result->compressed_flows = 0;
+    for (int i = 0; i < result->count; i++) {
+        struct compression_result *flow = &result->flows[i];
+        if (!flow->valid) {
+            continue;
+        }
+        result->valid = true;
+        if (flow->compressed) {
+            result->compressed = true;
+            result->compressed_flows++;
+        }
+    }
+}
+
+/**
+ * Serializes a multi-flow result
+ *
+ * result: pointer to flow_result struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* flows_to_json(struct flow_result *result)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "mode", "flows");
+    cJSON_AddBoolToObject(root, "valid", result->valid);
+    cJSON_AddBoolToObject(root, "compressed", result->compressed);
+    cJSON_AddNumberToObject(root, "compressed_flows", result->compressed_flows);
+    cJSON_AddNumberToObject(root, "local_drops", result->local_drops);
+    cJSON_AddNumberToObject(root, "udp_in_errors", result->in_errors);
+    cJSON_AddNumberToObject(root, "udp_rcvbuf_errors", result->rcvbuf_errors);
+    cJSON *flows = cJSON_AddArrayToObject(root, "flows");
+    for (int i = 0; i < result->count; i++) {
+        cJSON_AddItemToArray(flows, result_to_object(&result->flows[i]));
+    }
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Parses a serialized multi-flow result
+ *
+ * result: pointer to flow_result struct to fill
+ * text: json text
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int flows_from_json(struct flow_result *result, char *text)
+{
+    memset(result, 0, sizeof(struct flow_result));
+
+    cJSON *root = cJSON_Parse(text);
+    if (root == NULL) {
+        fprintf(stderr, "Error parsing flow result\n");
+        return -1;
+    }
+    result->local_drops = json_number(root, "local_drops", -1);
+    result->in_errors = json_number(root, "udp_in_errors", -1);
+    result->rcvbuf_errors = json_number(root, "udp_rcvbuf_errors", -1);
+    cJSON *flow;
+    cJSON_ArrayForEach(flow, cJSON_GetObjectItem(root, "flows")) {
+        if (result->count == MAX_FLOWS) {
+            break;
+        }
+        result_from_object(&result->flows[result->count++], flow);
+    }
+    cJSON_Delete(root);
+
+    combine_flows(result);
+    return 1;
+}
+
+/**
+ * Prints a multi-flow result, either as text or as json
+ *
+ * result: pointer to flow_result struct
+ * json: print as json
+ */
+void print_flows(struct flow_result *result, bool json)
+{
+    if (json) {
+        char *text = flows_to_json(result);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    if (!result->valid) {
+        printf("Failed to detect due to insufficient information.\n");
+    } else if (result->compressed) {
+        printf("Compression detected on %d of %d flows.\n", result->compressed_flows, result->count);
+    } else {
+        printf("No compression detected on %d flows.\n", result->count);
+    }
+    print_drops(result->local_drops, result->in_errors, result->rcvbuf_errors);
+    for (int i = 0; i < result->count; i++) {
+        printf("Flow %d: ", i);
+        print_result(&result->flows[i], false);
+    }
+}
+
+/**
+ * Guesses the class of compression from the throughput vs entropy
+ * curve. Without compression every level gets the same rate. If only
+ * the all zero level speeds up the path only squeezes trivial data
+ * (run length or zero suppression). An entropy coder speeds up each
+ * level by about 8 / bits, a dictionary coder gains less on random
+ * data from a small alphabet since it only finds short matches.
+ *
+ * result: pointer to sweep_result struct
+ *
+ * returns: name of the compression class
+ */
+static const char* classify_sweep(struct sweep_result *result)
+{
+    bool compressed = false;
+    bool mid_compressed = false;
+    double fit = 0;
+    int mid = 0;
+    for (int i = 0; i < result->count; i++) {
+        struct sweep_point *p = &result->points[i];
+        if (p->ratio < 0) {
+            return "unknown";
+        }
+        if (p->ratio <= 1 + SWEEP_TOLERANCE) {
+            continue;
+        }
+        compressed = true;
+        if (p->entropy > 0 && p->entropy < 8) {
+            mid_compressed = true;
+            // share of the gain an ideal entropy coder would get
+            fit += (p->ratio - 1) / (8.0 / p->entropy - 1);
+            mid++;
+        }
+    }
+
+    if (!compressed) {
+        return "none";
+    }
+    if (!mid_compressed) {
+        return "run-length";
+    }
+    return fit / mid > 0.5 ? "entropy coding" : "dictionary";
+}
+
+/**
+ * Builds the throughput vs entropy curve of a sweep, relative to the
+ * rate of the highest entropy level
+ *
+ * records: array of train_record pointers, one per level
+ * levels: entropy of each level in bits per byte
+ * count: number of levels
+ * result: pointer to sweep_result struct to fill
+ */
+void estimate_sweep(struct train_record **records, int *levels, int count,
+                    struct sweep_result *result)
+{
+    memset(result, 0, sizeof(struct sweep_result));
+    result->count = count;
+    result->local_drops = -1;
+    result->in_errors = -1;
+    result->rcvbuf_errors = -1;
+
+    int top = 0;
+    for (int i = 0; i < count; i++) {
+        struct sweep_point *p = &result->points[i];
+        p->entropy = levels[i];
+        p->packets = records[i]->count;
+        p->bytes = train_bytes(records[i]);
+        p->duration = train_duration_milli(records[i]);
+        p->rate = slice_rate(records[i], 0, records[i]->count);
+        if (levels[i] > levels[top]) {
+            top = i;
+        }
+    }
+
+    double top_rate = result->points[top].rate;
+    for (int i = 0; i < count; i++) {
+        struct sweep_point *p = &result->points[i];
+        p->ratio = (p->rate > 0 && top_rate > 0) ? p->rate / top_rate : -1;
+        LOG("Entropy %d: %.0f bytes/s, ratio %.3f\n", p->entropy, p->rate, p->ratio);
+    }
+
+    result->compressor = classify_sweep(result);
+}
+
+/**
+ * Serializes a sweep result
+ *
+ * result: pointer to sweep_result struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* sweep_to_json(struct sweep_result *result)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "mode", "sweep");
+    cJSON_AddStringToObject(root, "compressor", result->compressor);
+    cJSON_AddNumberToObject(root, "local_drops", result->local_drops);
+    cJSON_AddNumberToObject(root, "udp_in_errors", result->in_errors);
+    cJSON_AddNumberToObject(root, "udp_rcvbuf_errors", result->rcvbuf_errors);
+    cJSON *levels = cJSON_AddArrayToObject(root, "levels");
+    for (int i = 0; i < result->count; i++) {
+        struct sweep_point *p = &result->points[i];
+        cJSON *level = cJSON_CreateObject();
+        cJSON_AddNumberToObject(level, "entropy", p->entropy);
+        cJSON_AddNumberToObject(level, "packets", p->packets);
+        cJSON_AddNumberToObject(level, "bytes", p->bytes);
+        cJSON_AddNumberToObject(level, "duration_ms", p->duration);
+        cJSON_AddNumberToObject(level, "rate", p->rate);
+        cJSON_AddNumberToObject(level, "ratio", p->ratio);
+        cJSON_AddItemToArray(levels, level);
+    }
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Parses a serialized sweep result
+ *
+ * result: pointer to sweep_result struct to fill
+ * text: json text
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int sweep_from_json(struct sweep_result *result, char *text)
+{
+    memset(result, 0, sizeof(struct sweep_result));
+
+    cJSON *root = cJSON_Parse(text);
+    if (root == NULL) {
+        fprintf(stderr, "Error parsing sweep result\n");
+        return -1;
+    }
+    result->local_drops = json_number(root, "local_drops", -1);
+    result->in_errors = json_number(root, "udp_in_errors", -1);
+    result->rcvbuf_errors = json_number(root, "udp_rcvbuf_errors", -1);
+
+    // compressor points into the json, keep a static copy of the known names
+    static const char *classes[] = {"none", "run-length", "dictionary", "entropy coding"};
+    result->compressor = "unknown";
+    cJSON *compressor = cJSON_GetObjectItem(root, "compressor");
+    for (int i = 0; compressor != NULL && i < 4; i++) {
+        if (cJSON_IsString(compressor) && strcmp(compressor->valuestring, classes[i]) == 0) {
+            result->compressor = classes[i];
+        }
+    }
+
+    cJSON *level;
+    cJSON_ArrayForEach(level, cJSON_GetObjectItem(root, "levels")) {
+        if (result->count == MAX_SWEEP_LEVELS) {
+            break;
+        }
+        struct sweep_point *p = &result->points[result->count++];
+        p->entropy = json_number(level, "entropy", 0);
+        p->packets = json_number(level, "packets", 0);
+        p->bytes = json_number(level, "bytes", 0);
+        p->duration = json_number(level, "duration_ms", 0);
+        p->rate = json_number(level, "rate", -1);
+        p->ratio = json_number(level, "ratio", -1);
+    }
+    cJSON_Delete(root);
+
+    return 1;
+}
+
+/**
+ * Prints the throughput vs entropy curve, either as a table or as json
+ *
+ * result: pointer to sweep_result struct
+ * json: print as json
+ */
+void print_sweep(struct sweep_result *result, bool json)
+{
+    if (json) {
+        char *text = sweep_to_json(result);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    printf("%8s %8s %12s %14s %8s\n", "entropy", "packets", "duration_ms", "rate_mbit_s", "ratio");
+    for (int i = 0; i < result->count; i++) {
+        struct sweep_point *p = &result->points[i];
+        printf("%8d %8d %12.3f %14.2f %8.3f\n", p->entropy, p->packets, p->duration,
+                p->rate > 0 ? p->rate * 8 / 1000000 : -1, p->ratio);
+    }
+    printf("Likely compression: %s\n", result->compressor);
+    print_drops(result->local_drops, result->in_errors, result->rcvbuf_errors);
+}
+
+/**
+ * Separates compression from deduplication. Random payloads do not
+ * compress, so a path that only compresses gets the same rate for
+ * unique and repeated random payloads. A deduplicating optimizer
+ * replaces the repeated payload with a reference to its cache and
+ * speeds up the repeated train only.
+ *
+ * unique: pointer to train_record struct of unique random payloads
+ * repeated: pointer to train_record struct of the repeated random payload
+ * low: pointer to train_record struct of low entropy payloads
+ * result: pointer to dedup_result struct to fill
+ */
+void estimate_dedup(struct train_record *unique, struct train_record *repeated,
+                    struct train_record *low, struct dedup_result *result)
+{
+    memset(result, 0, sizeof(struct dedup_result));
+    result->compression_ratio = -1;
+    result->compression_error = -1;
+    result->dedup_ratio = -1;
+    result->dedup_error = -1;
+    result->local_drops = -1;
+    result->in_errors = -1;
+    result->rcvbuf_errors = -1;
+
+    result->unique_rate = slice_rate(unique, 0, unique->count);
+    result->repeated_rate = slice_rate(repeated, 0, repeated->count);
+    result->low_rate = slice_rate(low, 0, low->count);
+    result->valid = result->unique_rate > 0 && result->repeated_rate > 0 && result->low_rate > 0;
+    if (!result->valid) {
+        return;
+    }
+
+    result->compression_ratio = result->low_rate / result->unique_rate;
+    result->compression_error = ratio_error(low, result->low_rate, unique, result->unique_rate);
+    result->dedup_ratio = result->repeated_rate / result->unique_rate;
+    result->dedup_error = ratio_error(repeated, result->repeated_rate, unique, result->unique_rate);
+
+    LOG("Compression ratio: %.3f, deduplication ratio: %.3f\n",
+            result->compression_ratio, result->dedup_ratio);
+}
+
+/**
+ * Serializes a deduplication result
+ *
+ * result: pointer to dedup_result struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* dedup_to_json(struct dedup_result *result)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "mode", "dedup");
+    cJSON_AddBoolToObject(root, "valid", result->valid);
+    cJSON_AddBoolToObject(root, "compressed", result->compressed);
+    cJSON_AddBoolToObject(root, "deduplicated", result->deduplicated);
+    cJSON_AddNumberToObject(root, "unique_rate", result->unique_rate);
+    cJSON_AddNumberToObject(root, "repeated_rate", result->repeated_rate);
+    cJSON_AddNumberToObject(root, "low_rate", result->low_rate);
+    cJSON_AddNumberToObject(root, "compression_ratio", result->compression_ratio);
+    cJSON_AddNumberToObject(root, "compression_error", result->compression_error);
+    cJSON_AddNumberToObject(root, "dedup_ratio", result->dedup_ratio);
+    cJSON_AddNumberToObject(root, "dedup_error", result->dedup_error);
+    cJSON_AddNumberToObject(root, "local_drops", result->local_drops);
+    cJSON_AddNumberToObject(root, "udp_in_errors", result->in_errors);
+    cJSON_AddNumberToObject(root, "udp_rcvbuf_errors", result->rcvbuf_errors);
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Parses a serialized deduplication result
+ *
+ * result: pointer to dedup_result struct to fill
+ * text: json text
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int dedup_from_json(struct dedup_result *result, char *text)
+{
+    memset(result, 0, sizeof(struct dedup_result));
+
+    cJSON *root = cJSON_Parse(text);
+    if (root == NULL) {
+        fprintf(stderr, "Error parsing deduplication result\n");
+        return -1;
+    }
+    result->valid = cJSON_IsTrue(cJSON_GetObjectItem(root, "valid"));
+    result->compressed = cJSON_IsTrue(cJSON_GetObjectItem(root, "compressed"));
+    result->deduplicated = cJSON_IsTrue(cJSON_GetObjectItem(root, "deduplicated"));
+    result->unique_rate = json_number(root, "unique_rate", 0);
+    result->repeated_rate = json_number(root, "repeated_rate", 0);
+    result->low_rate = json_number(root, "low_rate", 0);
+    result->compression_ratio = json_number(root, "compression_ratio", -1);
+    result->compression_error = json_number(root, "compression_error", -1);
+    result->dedup_ratio = json_number(root, "dedup_ratio", -1);
+    result->dedup_error = json_number(root, "dedup_error", -1);
+    result->local_drops = json_number(root, "local_drops", -1);
+    result->in_errors = json_number(root, "udp_in_errors", -1);
+    result->rcvbuf_errors = json_number(root, "udp_rcvbuf_errors", -1);
+    cJSON_Delete(root);
+
+    return 1;
+}
+
+/**
+ * Prints a deduplication result, either as text or as json
+ *
+ * result: pointer to dedup_result struct
+ * json: print as json
+ */
+void print_dedup(struct dedup_result *result, bool json)
+{
+    if (json) {
+        char *text = dedup_to_json(result);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    if (!result->valid) {
+        printf("Failed to detect due to insufficient information.\n");
+        print_drops(result->local_drops, result->in_errors, result->rcvbuf_errors);
+        return;
+    }
+    printf("%s\n", result->compressed ? "Compression detected." : "No compression detected.");
+    print_drops(result->local_drops, result->in_errors, result->rcvbuf_errors);
+    printf("%s\n", result->deduplicated ? "Deduplication detected." : "No deduplication detected.");
+    print_ratio("Effective compression ratio", result->compression_ratio, result->compression_error);
+    print_ratio("Deduplication ratio", result->dedup_ratio, result->dedup_error);
+}
+
+/**
+ * Prepares a report on how the trains left the sender. The send
+ * stamps are allocated here, so that taking them while sending
+ * costs no more than reading the clock.
+ *
+ * report: pointer to sender_report struct
+ * count: number of trains that will be sent, at most MAX_SENT_TRAINS
+ * stamps: sends to time per train, further sends are counted but not timed
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int init_sender_report(struct sender_report *report, int count, int stamps)
+{
+    report->count = count < MAX_SENT_TRAINS ? count : MAX_SENT_TRAINS;
+    report->stalled = false;
+    report->buffer = NULL;
+    if (report->count > 0 && stamps > 0) {
+        report->buffer = calloc((size_t) report->count * stamps, sizeof(struct timespec));
+        if (report->buffer == NULL) {
+            perror("Error mallocing send stamps");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < MAX_SENT_TRAINS; i++) {
+        struct sent_train *train = &report->trains[i];
+        train->start_switches = -1;
+        train->switches = -1;
+        train->stamps = report->buffer != NULL && i < report->count
+                        ? report->buffer + (size_t) i * stamps : NULL;
+        train->capacity = train->stamps != NULL ? stamps : 0;
+        train->stamped = 0;
+        train->bytes = 0;
+        train->rate = -1;
+        train->gap_p50 = -1;
+        train->gap_p90 = -1;
+        train->gap_p99 = -1;
+        train->max_gap = -1;
+        train->stall = 0;
+    }
+    return 1;
+}
+
+/**
+ * Frees the send stamps of a report
+ *
+ * report: pointer to sender_report struct
+ */
+void free_sender_report(struct sender_report *report)
+{
+    free(report->buffer);
+    report->buffer = NULL;
+    for (int i = 0; i < MAX_SENT_TRAINS; i++) {
+        report->trains[i].stamps = NULL;
+        report->trains[i].capacity = 0;
+    }
+}
+
+/**
+ * Calculates the difference in microseconds between two clock readings
+ *
+ * ts1: first reading
+ * ts2: second reading
+ *
+ * returns: ts1 - ts2 (us)
+ */
+static double timespec_diff_micro(struct timespec ts1, struct timespec ts2)
+{
+    return (ts1.tv_sec - ts2.tv_sec) * 1000000.0 + (ts1.tv_nsec - ts2.tv_nsec) / 1000.0;
+}
+
+/**
+ * Marks the start of a train on the sending thread. Threads sending
+ * trains side by side each report on their own trains.
+ *
+ * report: pointer to sender_report struct
+ * train: index of the train
+ */
+void start_sent_train(struct sender_report *report, int train)
+{
+    if (train < report->count) {
+        report->trains[train].start_switches = involuntary_switches();
+        clock_gettime(CLOCK_MONOTONIC, &report->trains[train].start);
+    }
+}
+
+/**
+ * Stamps a send of a train, on the thread sending it
+ *
+ * report: pointer to sender_report struct
+ * train: index of the train
+ * bytes: bytes the send put out
+ */
+void stamp_sent(struct sender_report *report, int train, long bytes)
+{
+    if (train >= report->count) {
+        return;
+    }
+    struct sent_train *sent = &report->trains[train];
+    sent->bytes += bytes;
+    if (sent->stamped < sent->capacity) {
+        clock_gettime(CLOCK_MONOTONIC, &sent->stamps[sent->stamped++]);
+    }
+}
+
+/**
+ * Marks the end of a train, on the thread that started it
+ *
+ * report: pointer to sender_report struct
+ * train: index of the train
+ */
+void end_sent_train(struct sender_report *report, int train)
+{
+    if (train >= report->count || report->trains[train].start_switches < 0) {
+        return;
+    }
+    struct sent_train *sent = &report->trains[train];
+    long switches = involuntary_switches();
+    if (switches >= 0) {
+        sent->switches = switches - sent->start_switches;
+    }
+    if (sent->stamped == 0) {
+        return;
+    }
+
+    // the train starts at start_sent_train, so every send has a gap
+    double elapsed = timespec_diff_micro(sent->stamps[sent->stamped - 1], sent->start);
+    if (elapsed > 0) {
+        sent->rate = sent->bytes / elapsed * 1000000;
+    }
+    double *gaps = malloc(sent->stamped * sizeof(double));
+    if (gaps == NULL) {
+        perror("Error mallocing send gaps");
+        return;
+    }
+    struct timespec prev = sent->start;
+    for (int i = 0; i < sent->stamped; i++) {
+        gaps[i] = timespec_diff_micro(sent->stamps[i], prev);
+        prev = sent->stamps[i];
+    }
+    // median sorts the gaps for the percentiles
+    sent->gap_p50 = median(gaps, sent->stamped);
+    sent->gap_p90 = percentile(gaps, sent->stamped, 90);
+    sent->gap_p99 = percentile(gaps, sent->stamped, 99);
+    sent->max_gap = gaps[sent->stamped - 1];
+    for (int i = sent->stamped - 1; i >= 0 && gaps[i] > STALL_FACTOR * sent->gap_p50; i--) {
+        sent->stall += gaps[i] / 1000;
+    }
+    free(gaps);
+}
+
+/**
+ * Flags the report if the sender stalled for long enough, within any
+ * train, to account for a good share of the measured delta. Stalls
+ * the bottleneck queue absorbs do no harm, so this errs on the side
+ * of flagging.
+ *
+ * report: pointer to sender_report struct
+ * result: pointer to compression_result struct, NULL if there is none
+ * threshold: smallest delta difference taken as compression (ms)
+ */
+void check_stalls(struct sender_report *report, struct compression_result *result, int threshold)
+{
+    double delta = threshold;
+    if (result != NULL && result->valid && fabs(result->high_delta - result->low_delta) > delta) {
+        delta = fabs(result->high_delta - result->low_delta);
+    }
+    for (int i = 0; i < report->count; i++) {
+        if (report->trains[i].stall > STALL_SHARE * delta) {
+            report->stalled = true;
+        }
+    }
+}
+
+/**
+ * Prints how the trains left the sender, either as text or as json
+ *
+ * report: pointer to sender_report struct
+ * json: print as json
+ */
+void print_sender(struct sender_report *report, bool json)
+{
+    if (report->count == 0) {
+        return;
+    }
+
+    if (json) {
+        cJSON *root = cJSON_CreateObject();
+        if (root == NULL) {
+            return;
+        }
+        cJSON *trains = cJSON_AddArrayToObject(root, "sender");
+        for (int i = 0; i < report->count; i++) {
+            struct sent_train *sent = &report->trains[i];
+            cJSON *train = cJSON_CreateObject();
+            cJSON_AddNumberToObject(train, "switches", sent->switches);
+            cJSON_AddNumberToObject(train, "sends", sent->stamped);
+            cJSON_AddNumberToObject(train, "rate", sent->rate);
+            cJSON_AddNumberToObject(train, "gap_p50", sent->gap_p50);
+            cJSON_AddNumberToObject(train, "gap_p90", sent->gap_p90);
+            cJSON_AddNumberToObject(train, "gap_p99", sent->gap_p99);
+            cJSON_AddNumberToObject(train, "max_gap", sent->max_gap);
+            cJSON_AddNumberToObject(train, "stall", sent->stall);
+            cJSON_AddItemToArray(trains, train);
+        }
+        cJSON_AddBoolToObject(root, "sender_stalled", report->stalled);
+        char *text = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    for (int i = 0; i < report->count; i++) {
+        struct sent_train *sent = &report->trains[i];
+        printf("Sent train %d: %ld involuntary context switches", i, sent->switches);
+        if (sent->rate >= 0) {
+            printf(", %d sends at %.2f Mbit/s, gaps p50 %.1fus p90 %.1fus p99 %.1fus, "
+                   "longest stall %.1fus, %.3fms stalled",
+                   sent->stamped, sent->rate * 8 / 1000000, sent->gap_p50, sent->gap_p90,
+                   sent->gap_p99, sent->max_gap, sent->stall);
+        }
+        printf("\n");
+    }
+    if (report->stalled) {
+        printf("Warning: sender stalls are large compared with the measured delta.\n");
+    }
+}
+
+/**
+ * Sets tcp transfer stats to hold no information
+ *
+ * stats: pointer to tcp_stats struct
+ */
+void init_tcp_stats(struct tcp_stats *stats)
+{
+    stats->bytes = 0;
+    stats->duration = 0;
+    stats->goodput = -1;
+    stats->delivery_rate = -1;
+    stats->rtt = -1;
+    stats->retransmits = -1;
+}
+
+/**
+ * Prepares sampling the tcp_info of a connection
+ *
+ * sampler: pointer to tcp_sampler struct to fill
+ * sockfd: connected tcp socket file descriptor
+ * sender: whether the socket sends the data
+ */
+void init_tcp_sampler(struct tcp_sampler *sampler, int sockfd, bool sender)
+{
+    sampler->sockfd = sockfd;
+    sampler->sender = sender;
+    sampler->count = 0;
+    gettimeofday(&sampler->last, NULL);
+}
+
+/**
+ * Samples the delivery rate of a connection, at most every
+ * TCP_SAMPLE_INTERVAL ms so it can be called after every send or
+ * receive. Samples the kernel has not taken yet are skipped.
+ *
+ * sampler: pointer to tcp_sampler struct
+ * force: sample regardless of the interval
+ */
+void sample_tcp(struct tcp_sampler *sampler, bool force)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (!force && time_diff_milli(now, sampler->last) < TCP_SAMPLE_INTERVAL) {
+        return;
+    }
+    sampler->last = now;
+
+    struct tcp_sample sample;
+    if (!sampler->sender || sampler->count >= MAX_TCP_SAMPLES
+            || get_tcp_sample(sampler->sockfd, &sample) < 0) {
+        return;
+    }
+    if (sample.delivery_rate > 0) {
+        sampler->rates[sampler->count++] = sample.delivery_rate;
+    }
+}
+
+/**
+ * Fills in what the kernel knows about a finished transfer. The
+ * sender reports its delivery rate, rtt and retransmissions, the
+ * receiver only has an rtt estimate of its own. bytes and duration
+ * are left to the caller.
+ *
+ * sampler: pointer to tcp_sampler struct, rates get reordered
+ * stats: pointer to tcp_stats struct to fill in
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int finish_tcp_stats(struct tcp_sampler *sampler, struct tcp_stats *stats)
+{
+    struct tcp_sample sample;
+    if (get_tcp_sample(sampler->sockfd, &sample) < 0) {
+        return -1;
+    }
+
+    if (stats->duration > 0) {
+        stats->goodput = stats->bytes / (stats->duration / 1000);
+    }
+    if (sampler->sender) {
+        if (sampler->count > 0) {
+            stats->delivery_rate = median(sampler->rates, sampler->count);
+        }
+        stats->rtt = sample.rtt;
+        stats->retransmits = sample.retransmits;
+    } else if (sample.rcv_rtt > 0) {
+        stats->rtt = sample.rcv_rtt;
+    }
+
+    return 1;
+}
+
+/**
+ * Judges a pair of bulk transfers by the goodput the receiver saw.
+ * Like a train, a transfer that crosses a compressing hop gets
+ * through faster at low entropy.
+ *
+ * result: pointer to tcp_result struct with the receiver stats filled in
+ * threshold: ms the high entropy transfer must take longer by
+ * ratio_threshold: goodput ratio that counts as compressed, 0 to use threshold
+ */
+void analyze_tcp(struct tcp_result *result, int threshold, double ratio_threshold)
+{
+    result->ratio = -1;
+    result->valid = result->low.goodput > 0 && result->high.goodput > 0;
+    if (!result->valid) {
+        result->compressed = false;
+        return;
+    }
+
+    result->ratio = result->low.goodput / result->high.goodput;
+    if (ratio_threshold > 0) {
+        result->compressed = result->ratio > ratio_threshold;
+    } else {
+        result->compressed = result->high.duration - result->low.duration > threshold;
+    }
+
+    LOG("Low entropy goodput: %.0f B/s, high entropy goodput: %.0f B/s\n",
+            result->low.goodput, result->high.goodput);
+}
+
+/**
+ * Serializes tcp transfer stats into a json object
+ *
+ * stats: pointer to tcp_stats struct
+ *
+ * returns: json object, NULL otherwise
+ */
+static cJSON* tcp_stats_to_object(struct tcp_stats *stats)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddNumberToObject(root, "bytes", stats->bytes);
+    cJSON_AddNumberToObject(root, "duration_ms", stats->duration);
+    cJSON_AddNumberToObject(root, "goodput", stats->goodput);
+    cJSON_AddNumberToObject(root, "delivery_rate", stats->delivery_rate);
+    cJSON_AddNumberToObject(root, "rtt_ms", stats->rtt);
+    cJSON_AddNumberToObject(root, "retransmits", stats->retransmits);
+    return root;
+}
+
+/**
+ * Parses tcp transfer stats from a json object
+ *
+ * stats: pointer to tcp_stats struct to fill
+ * root: json object, may be NULL
+ */
+static void tcp_stats_from_object(struct tcp_stats *stats, cJSON *root)
+{
+    init_tcp_stats(stats);
+    if (root == NULL) {
+        return;
+    }
+    stats->bytes = (long) json_number(root, "bytes", 0);
+    stats->duration = json_number(root, "duration_ms", 0);
+    stats->goodput = json_number(root, "goodput", -1);
+    stats->delivery_rate = json_number(root, "delivery_rate", -1);
+    stats->rtt = json_number(root, "rtt_ms", -1);
+    stats->retransmits = (int) json_number(root, "retransmits", -1);
+}
+
+/**
+ * Serializes a tcp bulk transfer result
+ *
+ * result: pointer to tcp_result struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* tcp_to_json(struct tcp_result *result)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddStringToObject(root, "mode", "tcp");
+    cJSON_AddBoolToObject(root, "valid", result->valid);
+    cJSON_AddBoolToObject(root, "compressed", result->compressed);
+    cJSON_AddNumberToObject(root, "ratio", result->ratio);
+    cJSON_AddItemToObject(root, "low", tcp_stats_to_object(&result->low));
+    cJSON_AddItemToObject(root, "high", tcp_stats_to_object(&result->high));
+    cJSON_AddItemToObject(root, "low_sender", tcp_stats_to_object(&result->low_sender));
+    cJSON_AddItemToObject(root, "high_sender", tcp_stats_to_object(&result->high_sender));
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Parses a serialized tcp bulk transfer result
+ *
+ * result: pointer to tcp_result struct to fill
+ * text: json text
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int tcp_from_json(struct tcp_result *result, char *text)
+{
+    memset(result, 0, sizeof(struct tcp_result));
+
+    cJSON *root = cJSON_Parse(text);
+    if (root == NULL) {
+        fprintf(stderr, "Error parsing tcp result\n");
+        return -1;
+    }
+    result->valid = cJSON_IsTrue(cJSON_GetObjectItem(root, "valid"));
+    result->compressed = cJSON_IsTrue(cJSON_GetObjectItem(root, "compressed"));
+    result->ratio = json_number(root, "ratio", -1);
+    tcp_stats_from_object(&result->low, cJSON_GetObjectItem(root, "low"));
+    tcp_stats_from_object(&result->high, cJSON_GetObjectItem(root, "high"));
+    tcp_stats_from_object(&result->low_sender, cJSON_GetObjectItem(root, "low_sender"));
+    tcp_stats_from_object(&result->high_sender, cJSON_GetObjectItem(root, "high_sender"));
+    cJSON_Delete(root);
+
+    return 1;
+}
+
+/**
+ * Prints one side of a bulk transfer
+ *
+ * name: label of the transfer
+ * stats: pointer to tcp_stats struct
+ */
+static void print_tcp_stats(const char *name, struct tcp_stats *stats)
+{
+    const char *sep = " ";
+    printf("%s:", name);
+    if (stats->goodput > 0) {
+        printf("%s%ld bytes in %.3fms, goodput %.2f Mbit/s", sep, stats->bytes, stats->duration,
+                stats->goodput * 8 / 1e6);
+        sep = ", ";
+    }
+    if (stats->delivery_rate > 0) {
+        printf("%sdelivery rate %.2f Mbit/s", sep, stats->delivery_rate * 8 / 1e6);
+        sep = ", ";
+    }
+    if (stats->rtt >= 0) {
+        printf("%srtt %.3fms", sep, stats->rtt);
+        sep = ", ";
+    }
+    if (stats->retransmits >= 0) {
+        printf("%s%d retransmits", sep, stats->retransmits);
+    }
+    printf("\n");
+}
+
+/**
+ * Prints a tcp bulk transfer result, either as text or as json
+ *
+ * result: pointer to tcp_result struct
+ * json: print as json
+ */
+void print_tcp(struct tcp_result *result, bool json)
+{
+    if (json) {
+        char *text = tcp_to_json(result);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    if (!result->valid) {
+        printf("Failed to detect due to insufficient information.\n");
+        return;
+    }
+    printf("%s\n", result->compressed ? "Compression detected." : "No compression detected.");
+    print_tcp_stats("Low entropy", &result->low);
+    print_tcp_stats("High entropy", &result->high);
+    printf("Goodput ratio: %.3f\n", result->ratio);
+    print_tcp_stats("Low entropy sender", &result->low_sender);
+    print_tcp_stats("High entropy sender", &result->high_sender);
+}
+
+/**
+ * Estimates how much rtt jitter alone moves the difference of two
+ * head to tail deltas, from rtts sampled while the path was idle.
+ * Each delta is the sending gap plus the rtt change between its head
+ * and tail, so the difference of the deltas carries four rtt terms.
+ * The spread is the median absolute deviation, which ignores the odd
+ * probe caught behind a burst of cross traffic.
+ *
+ * rtts: baseline rtts (ms), reordered
+ * count: number of rtts
+ * probes_per_slot: redundant probes whose median makes each head and tail
+ * result: pointer to compression_result struct to fill in
+ */
+void estimate_jitter(double *rtts, int count, int probes_per_slot,
+                        struct compression_result *result)
+{
+    if (count < MIN_RTT_SAMPLES) {
+        return;
+    }
+
+    double rtt = median(rtts, count);
+    for (int i = 0; i < count; i++) {
+        rtts[i] = fabs(rtts[i] - rtt);
+    }
+    // scaled to a standard deviation for normal jitter
+    double sigma = 1.4826 * median(rtts, count);
+
+    // the median of n probes has about pi / 2n the variance of one
+    if (probes_per_slot > 1) {
+        sigma *= sqrt(M_PI / (2 * probes_per_slot));
+    }
+
+    result->rtt = rtt;
+    result->jitter = 2 * sigma;
+}
+
+/**
+ * Fills in the ratio and the verdict of a result from the train
+ * durations, for measurements that only see the head and tail of
+ * each train. Both trains carry the same bytes, so the ratio of the
+ * rates is the inverse ratio of the durations. If the rtt jitter is
+ * known the difference must clear the threshold by JITTER_SIGMAS
+ * jitter, and the ratio gets the error bar the jitter gives it.
+ *
+ * result: pointer to compression_result struct with valid deltas
+ * threshold: ms the high entropy delta must exceed the low one by
+ * ratio_threshold: ratio above which the path compresses, 0 to use threshold
+ */
+void judge_deltas(struct compression_result *result, int threshold, double ratio_threshold)
+{
+    bool jittered = result->jitter >= 0;
+    if (result->low_delta > 0) {
+        result->ratio = result->high_delta / result->low_delta;
+        if (jittered && result->high_delta > 0) {
+            // each delta carries half the variance of the difference
+            double sigma = result->jitter / M_SQRT2;
+            result->ratio_error = result->ratio
+                    * sqrt(pow(sigma / result->low_delta, 2) + pow(sigma / result->high_delta, 2));
+        }
+    }
+
+    double delta = result->high_delta - result->low_delta;
+    double margin = jittered ? JITTER_SIGMAS * result->jitter : 0;
+    LOG("Delta result: %.0fms, jitter margin %.3fms\n", delta, margin);
+    if (ratio_threshold > 0 && result->ratio > 0) {
+        double ratio_margin = jittered && result->ratio_error > 0 ? JITTER_SIGMAS * result->ratio_error : 0;
+        result->compressed = result->ratio - ratio_margin > ratio_threshold;
+    } else {
+        result->compressed = delta - margin > threshold;
+    }
+}
+
+/**
+ * Adds a measured ttl to the hop profile
+ *
+ * profile: pointer to hop_profile struct
+ * ttl: ttl of the probes
+ * result: pointer to compression_result struct of the ttl
+ * router: address that answered the probes
+ */
+void add_hop(struct hop_profile *profile, int ttl, struct compression_result *result,
+                struct in_addr router)
+{
+    if (profile->count == MAX_HOPS) {
+        return;
+    }
+    struct hop_point *p = &profile->points[profile->count++];
+    p->ttl = ttl;
+    p->valid = result->valid;
+    p->compressed = result->compressed;
+    p->low_delta = result->low_delta;
+    p->high_delta = result->high_delta;
+    p->router[0] = '\0';
+    if (result->valid) {
+        inet_ntop(AF_INET, &router, p->router, ROUTER_LEN);
+    }
+}
+
+/**
+ * Locates the compressing hop in a full hop profile, sorted by ttl.
+ * The delta shows at every hop after the compressing link, so the hop
+ * is the first ttl from which every measured ttl is compressed.
+ *
+ * profile: pointer to hop_profile struct, hop and router get filled
+ */
+void locate_hop(struct hop_profile *profile)
+{
+    profile->hop = -1;
+    profile->router[0] = '\0';
+    for (int i = profile->count - 1; i >= 0; i--) {
+        struct hop_point *p = &profile->points[i];
+        if (!p->valid) {
+            continue;
+        }
+        if (!p->compressed) {
+            break;
+        }
+        profile->hop = p->ttl;
+        strcpy(profile->router, p->router);
+    }
+}
+
+/**
+ * Serializes a hop profile
+ *
+ * profile: pointer to hop_profile struct
+ *
+ * returns: json text to be freed by the caller, NULL otherwise
+ */
+char* hops_to_json(struct hop_profile *profile)
+{
+    cJSON *root = cJSON_CreateObject();
+    if (root == NULL) {
+        return NULL;
+    }
+    cJSON_AddNumberToObject(root, "hop", profile->hop);
+    cJSON_AddStringToObject(root, "router", profile->router);
+    cJSON *hops = cJSON_AddArrayToObject(root, "hops");
+    for (int i = 0; i < profile->count; i++) {
+        struct hop_point *p = &profile->points[i];
+        cJSON *hop = cJSON_CreateObject();
+        cJSON_AddNumberToObject(hop, "ttl", p->ttl);
+        cJSON_AddStringToObject(hop, "router", p->router);
+        cJSON_AddBoolToObject(hop, "valid", p->valid);
+        cJSON_AddBoolToObject(hop, "compressed", p->compressed);
+        cJSON_AddNumberToObject(hop, "low_delta_ms", p->low_delta);
+        cJSON_AddNumberToObject(hop, "high_delta_ms", p->high_delta);
+        cJSON_AddItemToArray(hops, hop);
+    }
+
+    char *text = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return text;
+}
+
+/**
+ * Prints a hop profile, either as a table or as json
+ *
+ * profile: pointer to hop_profile struct
+ * json: print as json
+ */
+void print_hops(struct hop_profile *profile, bool json)
+{
+    if (json) {
+        char *text = hops_to_json(profile);
+        if (text != NULL) {
+            printf("%s\n", text);
+            free(text);
+        }
+        return;
+    }
+
+    printf("%4s %-16s %12s %12s %s\n", "ttl", "router", "low_ms", "high_ms", "compressed");
+    for (int i = 0; i < profile->count; i++) {
+        struct hop_point *p = &profile->points[i];
+        if (!p->valid) {
+            printf("%4d %-16s %12s %12s %s\n", p->ttl, "*", "-", "-", "-");
+            continue;
+        }
+        printf("%4d %-16s %12.3f %12.3f %s\n", p->ttl, p->router,
+                p->low_delta, p->high_delta, p->compressed ? "yes" : "no");
+    }
+    if (profile->hop < 0) {
+        printf("Could not localize compression.\n");
+    } else {
+        printf("Compression shows from hop %d (%s).\n", profile->hop,
+                profile->router[0] != '\0' ? profile->router : "unknown");
+    }
+}
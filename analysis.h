@@ -0,0 +1,250 @@
+/**
+ * @file
+ *
+ * Defines packet train analysis functions.
+ */
+
+#ifndef _ANALYSIS_H_
+#define _ANALYSIS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+
+#include "cJSON.h"
+
+#define RATIO_SEGMENTS 8    // train segments used for the ratio error bar
+#define MAX_SWEEP_LEVELS 9  // 0 to 8 bits per byte
+#define SWEEP_TOLERANCE 0.1 // ratios within this of 1 count as uncompressed
+#define MAX_HOPS 64         // hops measured when localizing compression
+#define ROUTER_LEN 16       // dotted decimal IPv4 address
+#define MIN_RTT_SAMPLES 3   // baseline rtts needed to estimate the jitter
+#define JITTER_SIGMAS 2     // jitter standard deviations a delta must clear
+#define MAX_TCP_SAMPLES 1024    // tcp_info samples kept per transfer
+#define TCP_SAMPLE_INTERVAL 10  // ms between tcp_info samples
+#define MAX_FLOWS 16        // concurrent flows of a multi-flow run
+#define MAX_SENT_TRAINS (2 * MAX_FLOWS)     // trains a sender reports on
+#define STALL_FACTOR 10     // median gaps a gap must exceed to count as a stall
+#define STALL_SHARE 0.25    // share of the measured delta stalls may take before a run is flagged
+
+struct arrival {
+    uint16_t id;            // packet id (first two payload bytes)
+    int bytes;              // udp payload bytes received
+    struct timeval time;    // arrival time
+    bool coalesced;         // came after the first datagram of a UDP GRO read, which timed them all
+    double wake;            // us from the kernel's arrival stamp to the read, -1 if unknown
+};
+
+struct train_record {
+    struct arrival *arrivals;
+    int count;      // arrivals recorded
+    int size;       // arrivals the record has room for
+    long drops;     // datagrams the receiving socket dropped during the train
+};
+
+struct train_summary {
+    int packets;            // distinct ids received
+    long bytes;             // udp payload bytes received
+    long first_bytes;       // udp payload bytes of the first packet
+    double duration;        // ms from the first to the last arrival
+};
+
+struct compression_result {
+    bool valid;             // false if there was not enough information
+    bool compressed;
+    double low_delta;       // low entropy train duration (ms)
+    double high_delta;      // high entropy train duration (ms)
+    long low_bytes;
+    long high_bytes;
+    int low_packets;
+    int high_packets;
+    double capacity;        // bottleneck capacity (bytes/s), -1 if unknown
+    double capacity_ratio;  // high entropy delta over its delta at the capacity, -1 if unknown
+    double ratio;           // effective compression ratio, -1 if unknown
+    double ratio_error;     // standard error of the ratio, -1 if unknown
+    double rtt;             // median baseline rtt (ms), -1 if unknown
+    double jitter;          // standard deviation rtt jitter adds to the delta difference (ms), -1 if unknown
+    long local_drops;       // datagrams the receiving socket dropped, -1 if unknown
+    long in_errors;         // udp datagrams the receiver's namespace failed to deliver during the trains, -1 if unknown
+    long rcvbuf_errors;     // of those, datagrams dropped on full receive buffers, -1 if unknown
+    int coalesced;          // packets that shared the arrival time of an earlier one through UDP GRO
+    double wake_p50;        // us from the kernel's arrival stamps to the reads, -1 if unknown
+    double wake_p99;
+    bool busy_poll;         // the receiver spun on its socket rather than sleeping on it
+    bool aggregated;        // timed in the kernel by the xdp program, without per packet arrivals
+};
+
+struct sweep_point {
+    int entropy;        // bits per byte
+    int packets;
+    long bytes;
+    double duration;    // ms
+    double rate;        // bytes/s, -1 if unknown
+    double ratio;       // rate over the rate of the highest entropy level, -1 if unknown
+};
+
+struct sweep_result {
+    int count;
+    struct sweep_point points[MAX_SWEEP_LEVELS];
+    const char *compressor;     // likely compression class
+    long local_drops;           // datagrams the receiving socket dropped, -1 if unknown
+    long in_errors;             // udp datagrams the receiver's namespace failed to deliver during the trains, -1 if unknown
+    long rcvbuf_errors;         // of those, datagrams dropped on full receive buffers, -1 if unknown
+};
+
+struct dedup_result {
+    bool valid;                 // false if a train had too few packets
+    bool compressed;
+    bool deduplicated;
+    double unique_rate;         // unique random payloads (bytes/s)
+    double repeated_rate;       // one repeated random payload (bytes/s)
+    double low_rate;            // low entropy payloads (bytes/s)
+    double compression_ratio;   // low entropy rate over unique rate, -1 if unknown
+    double compression_error;   // standard error, -1 if unknown
+    double dedup_ratio;         // repeated rate over unique rate, -1 if unknown
+    double dedup_error;         // standard error, -1 if unknown
+    long local_drops;           // datagrams the receiving socket dropped, -1 if unknown
+    long in_errors;             // udp datagrams the receiver's namespace failed to deliver during the trains, -1 if unknown
+    long rcvbuf_errors;         // of those, datagrams dropped on full receive buffers, -1 if unknown
+};
+
+struct flow_result {
+    int count;
+    struct compression_result flows[MAX_FLOWS];     // flow i is sent from udp_source_port + i
+    bool valid;             // false if no flow could be judged
+    bool compressed;        // true if any flow shows compression
+    int compressed_flows;
+    long local_drops;       // datagrams the receiving socket dropped over all flows, -1 if unknown
+    long in_errors;         // udp datagrams the receiver's namespace failed to deliver during the trains, -1 if unknown
+    long rcvbuf_errors;     // of those, datagrams dropped on full receive buffers, -1 if unknown
+};
+
+struct sent_train {
+    long start_switches;    // involuntary context switches before the train
+    long switches;          // involuntary context switches of the sending thread during the train, -1 if unknown
+    struct timespec start;
+    struct timespec *stamps;    // send time of each packet or batch, preallocated
+    int capacity;           // stamps the buffer holds
+    int stamped;            // stamps taken
+    long bytes;             // bytes sent
+    double rate;            // emitted rate (bytes/s), -1 if unknown
+    double gap_p50;         // gaps between sends (us), -1 if unknown
+    double gap_p90;
+    double gap_p99;
+    double max_gap;         // longest stall (us), -1 if unknown
+    double stall;           // time spent in gaps of over STALL_FACTOR median gaps (ms)
+};
+
+struct sender_report {
+    int count;
+    bool stalled;           // sender stalls are large compared with the measured delta
+    struct timespec *buffer;    // stamps of all trains
+    struct sent_train trains[MAX_SENT_TRAINS];
+};
+
+struct tcp_stats {
+    long bytes;             // payload bytes transferred
+    double duration;        // ms from the first to the last byte
+    double goodput;         // bytes/s, -1 if unknown
+    double delivery_rate;   // median of the kernel's delivery rate samples (bytes/s), -1 if unknown
+    double rtt;             // smoothed rtt at the end of the transfer (ms), -1 if unknown
+    int retransmits;        // segments retransmitted, -1 if unknown
+};
+
+struct tcp_result {
+    bool valid;                 // false if a transfer did not complete
+    bool compressed;
+    struct tcp_stats low;       // receiver side of the low entropy transfer
+    struct tcp_stats high;      // receiver side of the high entropy transfer
+    struct tcp_stats low_sender;
+    struct tcp_stats high_sender;
+    double ratio;               // low entropy goodput over high entropy goodput, -1 if unknown
+};
+
+struct tcp_sampler {
+    int sockfd;
+    bool sender;                // which end of the connection the socket is
+    double rates[MAX_TCP_SAMPLES];  // delivery rate samples (bytes/s)
+    int count;
+    struct timeval last;        // time of the latest sample
+};
+
+struct hop_point {
+    int ttl;
+    char router[ROUTER_LEN];    // address that answered the probes, "" if unknown
+    bool valid;                 // false if the probes were not answered
+    bool compressed;
+    double low_delta;           // ms
+    double high_delta;          // ms
+};
+
+struct hop_profile {
+    int count;
+    struct hop_point points[MAX_HOPS];
+    int hop;                    // first ttl at which compression shows, -1 if unknown
+    char router[ROUTER_LEN];    // address of that hop, "" if unknown
+};
+
+struct train_record* create_train_record(int size);
+void free_train_record(struct train_record *record);
+int record_arrival(struct train_record *record, uint16_t id, int bytes, bool coalesced, double wake);
+double train_duration_milli(struct train_record *record);
+long train_bytes(struct train_record *record);
+double median(double *values, int count);
+void summarize_wake(double *wakes, int count, struct compression_result *result);
+double estimate_capacity(struct train_record *record);
+void estimate_ratio(struct train_record *low, struct train_record *high,
+                    struct compression_result *result);
+void analyze_trains(struct train_record *low, struct train_record *high, int threshold,
+                    double ratio_threshold, struct compression_result *result);
+void analyze_summaries(struct train_summary *low, struct train_summary *high, int threshold,
+                        double ratio_threshold, struct compression_result *result);
+int receive_trains(int sockfd, struct train_record **records, int count, int train_size,
+                    int wait_ms, int timeout_ms, int flows, bool busy);
+void init_result(struct compression_result *result);
+const char* result_message(struct compression_result *result);
+char* result_to_json(struct compression_result *result);
+int result_from_json(struct compression_result *result, char *text);
+void print_result(struct compression_result *result, bool json);
+void print_directions(struct compression_result *forward, struct compression_result *reverse, bool json);
+void combine_flows(struct flow_result *result);
+char* flows_to_json(struct flow_result *result);
+int flows_from_json(struct flow_result *result, char *text);
+void print_flows(struct flow_result *result, bool json);
+void estimate_sweep(struct train_record **records, int *levels, int count,
+                    struct sweep_result *result);
+char* sweep_to_json(struct sweep_result *result);
+int sweep_from_json(struct sweep_result *result, char *text);
+void print_sweep(struct sweep_result *result, bool json);
+void estimate_dedup(struct train_record *unique, struct train_record *repeated,
+                    struct train_record *low, struct dedup_result *result);
+char* dedup_to_json(struct dedup_result *result);
+int dedup_from_json(struct dedup_result *result, char *text);
+void print_dedup(struct dedup_result *result, bool json);
+int init_sender_report(struct sender_report *report, int count, int stamps);
+void free_sender_report(struct sender_report *report);
+void start_sent_train(struct sender_report *report, int train);
+void stamp_sent(struct sender_report *report, int train, long bytes);
+void end_sent_train(struct sender_report *report, int train);
+void check_stalls(struct sender_report *report, struct compression_result *result, int threshold);
+void print_sender(struct sender_report *report, bool json);
+void init_tcp_stats(struct tcp_stats *stats);
+void init_tcp_sampler(struct tcp_sampler *sampler, int sockfd, bool sender);
+void sample_tcp(struct tcp_sampler *sampler, bool force);
+int finish_tcp_stats(struct tcp_sampler *sampler, struct tcp_stats *stats);
+void analyze_tcp(struct tcp_result *result, int threshold, double ratio_threshold);
+char* tcp_to_json(struct tcp_result *result);
+int tcp_from_json(struct tcp_result *result, char *text);
+void print_tcp(struct tcp_result *result, bool json);
+void estimate_jitter(double *rtts, int count, int probes_per_slot,
+                        struct compression_result *result);
+void judge_deltas(struct compression_result *result, int threshold, double ratio_threshold);
+void add_hop(struct hop_profile *profile, int ttl, struct compression_result *result,
+                struct in_addr router);
+void locate_hop(struct hop_profile *profile);
+char* hops_to_json(struct hop_profile *profile);
+void print_hops(struct hop_profile *profile, bool json);
+
+#endif
@@ -0,0 +1,239 @@
+/**
+ * @file
+ *
+ * Contains internet checksum (RFC 1071) kernels. The one's complement
+ * sum can be taken over words wider than 16 bits and folded at the end,
+ * so the kernels add 32 bit words into 64 bit accumulators. The SSE2
+ * and AVX2 kernels are picked at runtime from what the CPU supports.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86_KERNELS
+#endif
+
+#include "checksum.h"
+#include "logger.h"
+
+#define SELF_CHECK_LEN 1501     // odd, to cover the trailing byte
+
+static uint16_t (*selected)(const char *buf, uint32_t size) = NULL;
+static const char *selected_name = NULL;
+static pthread_once_t selection = PTHREAD_ONCE_INIT;
+
+/**
+ * Folds a partial sum to 16 bits with end around carries
+ *
+ * sum: partial one's complement sum
+ *
+ * returns: checksum, the complement of the folded sum
+ */
+static uint16_t fold(uint64_t sum)
+{
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return ~sum;
+}
+
+/**
+ * Sums bytes 32 bits at a time, without alignment requirements
+ *
+ * buf: bytes to sum
+ * size: number of bytes
+ *
+ * returns: partial sum, to be folded
+ */
+static uint64_t sum_scalar(const char *buf, uint32_t size)
+{
+    uint64_t sum = 0;
+    uint32_t i = 0;
+
+    for (; i + 4 <= size; i += 4) {
+        uint32_t word32;
+        memcpy(&word32, buf + i, sizeof(word32));
+        sum += word32;
+    }
+    if (i + 2 <= size) {
+        uint16_t word16;
+        memcpy(&word16, buf + i, sizeof(word16));
+        sum += word16;
+        i += 2;
+    }
+
+    // handle odd-sized case
+    if (i < size) {
+        sum += (unsigned char) buf[i];
+    }
+
+    return sum;
+}
+
+/**
+ * Calculates IP/TCP header checksums with portable C
+ *
+ * buf: bytes to checksum
+ * size: size of bytes to checksum
+ *
+ * returns: header checksum
+ */
+uint16_t checksum_scalar(const char *buf, uint32_t size)
+{
+    return fold(sum_scalar(buf, size));
+}
+
+#ifdef X86_KERNELS
+/**
+ * Calculates IP/TCP header checksums 16 bytes at a time
+ *
+ * buf: bytes to checksum
+ * size: size of bytes to checksum
+ *
+ * returns: header checksum
+ */
+__attribute__((target("sse2")))
+static uint16_t checksum_sse2(const char *buf, uint32_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    uint32_t blocks = size / 16;
+
+    // widen the 32 bit words to 64 bit lanes so the sum cannot overflow
+    for (uint32_t b = 0; b < blocks; b++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (buf + b * 16));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(v, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(v, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    uint32_t done = blocks * 16;
+    return fold(lanes[0] + lanes[1] + sum_scalar(buf + done, size - done));
+}
+
+/**
+ * Calculates IP/TCP header checksums 32 bytes at a time
+ *
+ * buf: bytes to checksum
+ * size: size of bytes to checksum
+ *
+ * returns: header checksum
+ */
+__attribute__((target("avx2")))
+static uint16_t checksum_avx2(const char *buf, uint32_t size)
+{
+    // headers are mostly tail, which the 16 byte kernel handles better
+    if (size < 64) {
+        return checksum_sse2(buf, size);
+    }
+
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero;
+    __m256i acc1 = zero;
+    uint32_t blocks = size / 32;
+
+    // two accumulators to keep both add ports busy
+    for (uint32_t b = 0; b < blocks; b++) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (buf + b * 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(v, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(v, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(acc0, acc1));
+    uint32_t done = blocks * 32;
+    return fold(lanes[0] + lanes[1] + lanes[2] + lanes[3]
+                + sum_scalar(buf + done, size - done));
+}
+#endif
+
+/**
+ * Lists the checksum kernels the CPU supports, the scalar one first
+ *
+ * kernels: array of MAX_CHECKSUM_KERNELS checksum_kernel structs to fill
+ *
+ * returns: number of kernels
+ */
+int get_checksum_kernels(struct checksum_kernel *kernels)
+{
+    int count = 0;
+    kernels[count].name = "scalar";
+    kernels[count++].sum = checksum_scalar;
+
+#ifdef X86_KERNELS
+    // cpuid feature bits
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        kernels[count].name = "sse2";
+        kernels[count++].sum = checksum_sse2;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        kernels[count].name = "avx2";
+        kernels[count++].sum = checksum_avx2;
+    }
+#endif
+
+    return count;
+}
+
+/**
+ * Selects the widest supported kernel that agrees with the scalar
+ * kernel on a test pattern. Runs once through pthread_once, since the
+ * scan and flow threads may make their first checksum at the same time.
+ */
+static void select_kernel()
+{
+    struct checksum_kernel kernels[MAX_CHECKSUM_KERNELS];
+    int count = get_checksum_kernels(kernels);
+
+    char pattern[SELF_CHECK_LEN];
+    for (int i = 0; i < SELF_CHECK_LEN; i++) {
+        pattern[i] = (char) (i * 131 + 7);
+    }
+
+    selected = checksum_scalar;
+    selected_name = "scalar";
+    for (int k = count - 1; k > 0; k--) {
+        if (kernels[k].sum(pattern, SELF_CHECK_LEN) == checksum_scalar(pattern, SELF_CHECK_LEN)
+                && kernels[k].sum(pattern + 1, SELF_CHECK_LEN - 1)
+                    == checksum_scalar(pattern + 1, SELF_CHECK_LEN - 1)) {
+            selected = kernels[k].sum;
+            selected_name = kernels[k].name;
+            break;
+        }
+        LOG("Checksum kernel %s failed its self check.\n", kernels[k].name);
+    }
+    LOG("Using %s checksum kernel.\n", selected_name);
+}
+
+/**
+ * Calculates IP/TCP header checksums with the selected kernel
+ *
+ * buf: bytes to checksum
+ * size: size of bytes to checksum
+ *
+ * returns: header checksum
+ */
+uint16_t checksum(const char *buf, uint32_t size)
+{
+    pthread_once(&selection, select_kernel);
+    return selected(buf, size);
+}
+
+/**
+ * Gets the name of the kernel checksum() uses
+ *
+ * returns: kernel name
+ */
+const char* checksum_kernel_name()
+{
+    pthread_once(&selection, select_kernel);
+    return selected_name;
+}
@@ -0,0 +1,24 @@
+/**
+ * @file
+ *
+ * Defines internet checksum functions.
+ */
+
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stdint.h>
+
+#define MAX_CHECKSUM_KERNELS 3
+
+struct checksum_kernel {
+    const char *name;
+    uint16_t (*sum)(const char *buf, uint32_t size);
+};
+
+uint16_t checksum(const char *buf, uint32_t size);
+uint16_t checksum_scalar(const char *buf, uint32_t size);
+const char* checksum_kernel_name();
+int get_checksum_kernels(struct checksum_kernel *kernels);
+
+#endif
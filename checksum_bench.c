@@ -0,0 +1,210 @@
+/**
+ * @file
+ *
+ * Microbenchmark for the internet checksum kernels. Verifies every
+ * kernel the CPU supports against the scalar kernel, then reports its
+ * throughput for typical packet sizes. Also verifies the incremental
+ * checksum updates of the stamped SYN, RST and UDP frames against a
+ * full recompute.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+
+#include "checksum.h"
+#include "headers.h"
+
+#define BUFFER_LEN (9000 + 64)  // largest size plus room for misaligned starts
+#define VERIFY_ROUNDS 10000     // random buffers checked per kernel and size
+#define BENCH_BYTES (1L << 30)  // bytes summed per kernel and size
+#define HEADER_ROUNDS 1000000   // random stamped frames checked per kind
+#define MAX_UDP_PAYLOAD 1472    // largest payload of a stamped udp frame
+
+static const uint32_t sizes[] = { 20, 40, 64, 576, 1000, 1500, 9000 };
+
+/**
+ * Gets the time since an arbitrary point in seconds
+ *
+ * returns: monotonic time in seconds
+ */
+double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Checks a kernel against the scalar kernel on random buffers of every
+ * length up to the size, at random offsets
+ *
+ * kernel: pointer to checksum_kernel struct
+ * buf: BUFFER_LEN bytes of scratch space
+ * size: largest length to check
+ *
+ * returns: number of mismatches
+ */
+int verify(struct checksum_kernel *kernel, char *buf, uint32_t size)
+{
+    int mismatches = 0;
+    for (int r = 0; r < VERIFY_ROUNDS; r++) {
+        for (int i = 0; i < BUFFER_LEN; i += 64) {
+            buf[i] = rand();
+        }
+        // all ones words exercise the carries
+        if (r % 2 == 0) {
+            memset(buf, 0xFF, BUFFER_LEN / 2);
+        }
+        uint32_t offset = rand() % 32;
+        uint32_t len = rand() % (size + 1);
+        if (kernel->sum(buf + offset, len) != checksum_scalar(buf + offset, len)) {
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+/**
+ * Checks the transport checksum of a frame by summing the pseudo
+ * header and the segment, which adds up to zero when it is right
+ *
+ * frame: IPv4 frame without options
+ * len: length of the frame
+ *
+ * returns: true if the checksum is right
+ */
+bool transport_ok(char *frame, int len)
+{
+    char buf[12 + UDP_HDRLEN + MAX_UDP_PAYLOAD];
+    struct ip *iphdr = (struct ip*) frame;
+    uint16_t segment_len = htons(len - IP4_HDRLEN);
+    memcpy(buf, &iphdr->ip_src, 4);
+    memcpy(buf + 4, &iphdr->ip_dst, 4);
+    buf[8] = 0;
+    buf[9] = iphdr->ip_p;
+    memcpy(buf + 10, &segment_len, 2);
+    memcpy(buf + 12, frame + IP4_HDRLEN, len - IP4_HDRLEN);
+    return checksum_scalar(buf, 12 + len - IP4_HDRLEN) == 0;
+}
+
+/**
+ * Checks the incremental checksum updates of stamp_syn(),
+ * set_syn_source_port(), stamp_rst() and stamp_udp() against a full
+ * recompute, over random addresses, ports, sequence numbers, ttls,
+ * ip ids and payloads
+ *
+ * returns: number of frames with a wrong IP or transport checksum
+ */
+int verify_headers()
+{
+    int mismatches = 0;
+    char syn[SYN_LEN], rst[SYN_LEN];
+    char frame[UDP_FRAME_HDRLEN + MAX_UDP_PAYLOAD];
+    char payload[MAX_UDP_PAYLOAD];
+    struct sockaddr_in src, dst;
+    memset(&src, 0, sizeof(src));
+    memset(&dst, 0, sizeof(dst));
+    src.sin_family = AF_INET;
+    dst.sin_family = AF_INET;
+
+    for (int r = 0; r < HEADER_ROUNDS; r++) {
+        src.sin_addr.s_addr = rand();
+        dst.sin_addr.s_addr = rand();
+        src.sin_port = rand();
+        dst.sin_port = rand();
+
+        struct syn_template syn_tmpl;
+        init_syn_template(&syn_tmpl, &src, &dst);
+        stamp_syn(&syn_tmpl, syn, rand(), (uint32_t) rand() << 1 ^ rand(), rand() % 256);
+        if (r % 2 == 0) {
+            set_syn_source_port(syn, rand());
+        }
+        stamp_rst(syn, rst);
+        mismatches += checksum_scalar(syn, IP4_HDRLEN) != 0 || !transport_ok(syn, SYN_LEN);
+        mismatches += checksum_scalar(rst, IP4_HDRLEN) != 0 || !transport_ok(rst, SYN_LEN);
+
+        int payload_len = rand() % (MAX_UDP_PAYLOAD + 1);
+        for (int i = 0; i < payload_len; i++) {
+            payload[i] = rand();
+        }
+        // all ones payloads exercise the carries
+        if (r % 4 == 0) {
+            memset(payload, 0xFF, payload_len);
+        }
+        struct udp_template udp_tmpl;
+        init_udp_template(&udp_tmpl, &src, &dst, payload_len, 1 + rand() % 255);
+        stamp_udp(&udp_tmpl, frame, payload, rand());
+        mismatches += checksum_scalar(frame, IP4_HDRLEN) != 0
+                        || !transport_ok(frame, UDP_FRAME_HDRLEN + payload_len);
+    }
+    return mismatches;
+}
+
+/**
+ * Measures the throughput of a kernel on packets of one size
+ *
+ * kernel: pointer to checksum_kernel struct
+ * buf: packet to sum
+ * size: packet size
+ *
+ * returns: throughput in GB/s
+ */
+double bench(struct checksum_kernel *kernel, char *buf, uint32_t size)
+{
+    long iterations = BENCH_BYTES / size;
+    volatile uint16_t sink = 0;
+
+    double start = now_sec();
+    for (long i = 0; i < iterations; i++) {
+        sink += kernel->sum(buf, size);
+    }
+    double elapsed = now_sec() - start;
+    (void) sink;
+
+    return iterations * (double) size / elapsed / 1e9;
+}
+
+int main()
+{
+    char *buf = malloc(BUFFER_LEN);
+    if (buf == NULL) {
+        perror("Error mallocing buffer");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < BUFFER_LEN; i++) {
+        buf[i] = rand();
+    }
+
+    struct checksum_kernel kernels[MAX_CHECKSUM_KERNELS];
+    int count = get_checksum_kernels(kernels);
+    printf("checksum() uses the %s kernel.\n", checksum_kernel_name());
+
+    int failures = 0;
+    printf("%-8s %6s %10s %s\n", "kernel", "bytes", "GB/s", "verified");
+    for (int k = 0; k < count; k++) {
+        for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            int mismatches = verify(&kernels[k], buf, sizes[s]);
+            failures += mismatches;
+            double rate = bench(&kernels[k], buf, sizes[s]);
+            printf("%-8s %6u %10.2f %s\n", kernels[k].name, sizes[s], rate,
+                    mismatches == 0 ? "yes" : "NO");
+        }
+    }
+
+    int header_failures = verify_headers();
+    printf("Stamped SYN, RST and UDP frames: %d of %d rounds verified\n",
+            HEADER_ROUNDS - header_failures, HEADER_ROUNDS);
+    failures += header_failures;
+
+    free(buf);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -10,20 +10,45 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
 
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
 
 #include "cJSON.h"
+#include "analysis.h"
 #include "headers.h"
+#include "scan.h"
 #include "sockets.h"
 #include "util.h"
 #include "logger.h"
 
 #define RECV_BUFFER 1024
+#define POLL_INTERVAL 100   // ms between rst timeout checks
+#define MAX_PARALLEL_TTLS 8 // ttls probed by one pair of trains
+#define MAX_SYN_PROBES 16   // redundant SYNs per head or tail
+#define RST_GRACE 500       // ms to wait for stragglers once every slot is answered
+#define PREFLIGHT_TIMEOUT 800   // ms the server ports get to answer the pre-flight SYNs
+#define PREFLIGHT_SYNS 2        // pre-flight SYNs per head and tail port
+#define MAX_RTT_SAMPLES 64      // baseline rtt probes per idle period
+#define RTT_SAMPLE_GAP 10       // ms between baseline rtt probes
+#define ICMP_BURST 6            // replies a Linux host sends back to back before rate limiting
+#define MAX_PROBES (MAX_PARALLEL_TTLS * PROBE_SLOTS * MAX_SYN_PROBES)
+
+// probes bracketing the trains, per ttl
+enum probe_slot {
+    LOW_HEAD,
+    LOW_TAIL,
+    HIGH_HEAD,
+    HIGH_TAIL,
+    PROBE_SLOTS
+};
 
 struct config {
     char* client_ip;
@@ -40,14 +65,75 @@ struct config {
     int rst_timeout;
     int udp_ttl;
     int threshold;
+    double ratio_threshold;
+    int mode;
+    int max_ttl;
+    int parallel_ttls;
+    int syn_probes;
+    int raw_train;
+    int rtt_samples;
+    char *targets;
+    int scan_parallel;
+    double scan_rate;
+    int synack_port;
+    int udp_bracket;
+    int icmp_ratelimit;
+    int sender_cpu;             // cpu the sending main thread is pinned to, -1 for none
+    int receiver_cpu;           // cpu the receive thread is pinned to, -1 for none
+    int sched_fifo;             // run sender and receive thread as SCHED_FIFO
+    int mlock;
+    int busy_poll;              // us the raw sockets busy poll the device for, 0 to sleep on them
+};
+
+struct probe {
+    char *packet;               // SYN frame, stamped from the session template
+    struct sockaddr_in *addr;   // address the packet is sent to
+    uint16_t port;              // destination port
+    uint16_t local_port;        // source port
+    uint32_t seq;               // sequence number, tells probes to the same port apart
+    int group;                  // ttl and slot of the probe, ttl index * PROBE_SLOTS + slot, -1 for rtt probes
+    struct timeval sent_time;   // departure of an rtt probe
+    bool answered;
+    struct timeval reply_time;  // arrival of the RST or ICMP reply
+    double wake;                // us from the kernel's arrival stamp of the reply to its read, -1 if unknown
+    struct in_addr from;        // address that replied
 };
 
 struct thread_data {
     int sockfd;
-    int rst_timeout;
-    int threshold;
-    struct sockaddr_in *recv_addr;
-    char* result;
+    int icmp_sockfd;
+    int timeout_ms;             // ms without a reply that ends receiving
+    struct probe *probes;
+    int probe_count;
+    int group_count;            // ttls * PROBE_SLOTS
+    int protocol;               // IPPROTO_TCP or IPPROTO_UDP probes
+    int cpu;                    // cpu to pin the receive thread to, -1 to leave it
+    bool fifo;                  // run the receive thread as SCHED_FIFO
+    bool busy;                  // spin on the sockets rather than poll them
+    volatile bool stop;         // set by the sender to end receiving early
+};
+
+// the probed hosts' ICMP rate limit, modeled after the Linux limiter
+struct icmp_budget {
+    double tokens;              // ms worth of replies the hosts may still send
+    struct timeval last;        // last refill
+};
+
+struct session {
+    struct config *configs;
+    int raw_sock;
+    int icmp_sock;
+    int udp_sock;
+    struct sockaddr_in *my_tcp_addr;
+    struct sockaddr_in syn_addrs[2 * MAX_SYN_PROBES];   // head then tail SYN ports
+    struct syn_template syn_template;
+    char frames[MAX_PROBES + 2 * MAX_RTT_SAMPLES][SYN_LEN];    // preallocated SYN or UDP probe frames
+    int probe_len;              // SYN_LEN, or UDP_FRAME_HDRLEN with udp_bracket
+    struct icmp_budget budget;
+    bool expiring;              // head and tail probes expire at routers, which answer with ICMP
+    struct sockaddr_in *udp_serv_addr;
+    char *train_frames[2];      // low and high entropy IPv4+UDP frames, NULL unless raw_train
+    int frame_len;
 };
 
 /**
@@ -60,7 +146,9 @@ void parse_config(struct config *configs, char *contents)
 {
     cJSON *root = cJSON_Parse(contents);
     configs->client_ip = cJSON_GetObjectItem(root, "client_ip")->valuestring;
-    configs->server_ip = cJSON_GetObjectItem(root, "server_ip")->valuestring;
+    // scans read their targets from a list instead
+    cJSON *server_ip = cJSON_GetObjectItem(root, "server_ip");
+    configs->server_ip = server_ip != NULL ? server_ip->valuestring : NULL;
     configs->tcp_port = atoi(cJSON_GetObjectItem(root, "tcp_port")->valuestring);
     configs->tcp_head_dest = atoi(cJSON_GetObjectItem(root, "tcp_head_dest")->valuestring);
     configs->tcp_tail_dest = atoi(cJSON_GetObjectItem(root, "tcp_tail_dest")->valuestring);
@@ -73,12 +161,63 @@ void parse_config(struct config *configs, char *contents)
     configs->rst_timeout = atoi(cJSON_GetObjectItem(root, "rst_timeout")->valuestring);
     configs->udp_ttl = atoi(cJSON_GetObjectItem(root, "udp_ttl")->valuestring);
     configs->threshold = atoi(cJSON_GetObjectItem(root, "threshold")->valuestring);
+    configs->ratio_threshold = get_config_double(root, "ratio_threshold", 0);
+    configs->mode = get_config_mode(root);
+    configs->max_ttl = get_config_int(root, "max_ttl", 30);
+    configs->parallel_ttls = get_config_int(root, "parallel_ttls", 1);
+    configs->syn_probes = get_config_int(root, "syn_probes", 1);
+    configs->raw_train = get_config_int(root, "raw_train", 0);
+    configs->rtt_samples = get_config_int(root, "rtt_samples", 0);
+    cJSON *targets = cJSON_GetObjectItem(root, "targets");
+    configs->targets = targets != NULL ? targets->valuestring : NULL;
+    configs->scan_parallel = get_config_int(root, "scan_parallel", 8);
+    configs->scan_rate = get_config_double(root, "scan_rate", 100);
+    configs->synack_port = get_config_int(root, "synack_port", 0);
+    configs->udp_bracket = get_config_int(root, "udp_bracket", 0);
+    configs->icmp_ratelimit = get_config_int(root, "icmp_ratelimit", 1000);
+    configs->sender_cpu = get_config_int(root, "sender_cpu", -1);
+    configs->receiver_cpu = get_config_int(root, "receiver_cpu", -1);
+    configs->sched_fifo = get_config_int(root, "sched_fifo", 0);
+    configs->mlock = get_config_int(root, "mlock", 0);
+    configs->busy_poll = get_config_int(root, "busy_poll", 0);
+}
+
+/**
+ * Matches a reply against the probes and records its arrival
+ *
+ * tdata: pointer to thread_data struct
+ * reply: pointer to parsed probe_reply struct
+ * now: arrival time of the reply
+ *
+ * returns: the answered probe, NULL if the reply answered none
+ */
+struct probe* match_reply(struct thread_data *tdata, struct probe_reply *reply, struct timeval now)
+{
+    if (reply->kind == REPLY_NONE || reply->protocol != tdata->protocol) {
+        return NULL;
+    }
+
+    for (int i = 0; i < tdata->probe_count; i++) {
+        struct probe *p = &tdata->probes[i];
+        if (!p->answered && p->port == reply->port && p->local_port == reply->local_port
+                && p->seq == reply->seq) {
+            p->answered = true;
+            p->reply_time = now;
+            p->from = reply->from;
+            return p;
+        }
+    }
+    return NULL;
 }
 
 /**
- * Thread process for recieving packets through a raw socket, calculates
- * compression when all 4 SYN pakcets arrive (or it times out) and
- * updates thread_data struct with the results
+ * Thread process for recieving packets through the raw sockets. Matches
+ * RST, SYN-ACK and ICMP time exceeded replies to the probes by ports and
+ * sequence number, until all probes are answered or no reply arrived for
+ * timeout_ms. A SYN-ACK is answered with a RST right away, so the
+ * server drops the half-open connection. Once every head and tail has
+ * at least one answer, lost redundant and rtt probes are only waited
+ * for RST_GRACE ms.
  *
  * arg: void pointer (preferably pointer tp thread_data struct)
  */
@@ -86,165 +225,792 @@ void* receive_routine(void *arg)
 {
     // thread data to fill in or use
     struct thread_data *tdata = (struct thread_data *) arg;
+    if ((tdata->cpu >= 0 || tdata->fifo) && set_thread_realtime(tdata->cpu, tdata->fifo) < 0) {
+        return NULL;
+    }
 
-    // time difference
-    struct timeval low_e_head, low_e_tail, high_e_head, high_e_tail;
-    bool tail = false;
-    bool high_e_train = false;
-    char* buf;
+    struct pollfd fds[2];
+    int nfds = 1;
+    fds[0].fd = tdata->sockfd;
+    fds[0].events = POLLIN;
+    if (tdata->icmp_sockfd >= 0) {
+        fds[1].fd = tdata->icmp_sockfd;
+        fds[1].events = POLLIN;
+        nfds = 2;
+    }
+
+    char buf[RECV_BUFFER];
+    struct sockaddr_in recv_addr;
+    struct datagram_meta meta;
+    struct probe_reply reply;
+    int answered = 0;
+
+    // answers per ttl and slot
+    int *group_answers = calloc(tdata->group_count, sizeof(int));
+    if (group_answers == NULL) {
+        perror("Error mallocing answer counts");
+        return NULL;
+    }
+    int groups_answered = 0;
 
     struct timeval beg, curr;
     gettimeofday(&beg, NULL);
     gettimeofday(&curr, NULL);
 
-    while(time_diff_sec(curr, beg) <= tdata->rst_timeout) {
-        buf = receive_packet(tdata->sockfd, tdata->recv_addr);
-        if (buf == NULL) {
+    while (!tdata->stop && answered < tdata->probe_count
+            && time_diff_milli(curr, beg) <= tdata->timeout_ms
+            && (groups_answered < tdata->group_count
+                || time_diff_milli(curr, beg) <= RST_GRACE)) {
+        // busy polling spins on non-blocking reads of both sockets instead
+        if (!tdata->busy && poll(fds, nfds, POLL_INTERVAL) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error polling raw sockets");
+            free(group_answers);
             return NULL;
         }
 
-        // check if we received RST packet
-        char tcp_flags = buf[33];
-        if (tcp_flags & (1 << 2)) {
-            LOGP("RST packet received.\n");
-            if (!tail) {
-                if (!high_e_train) {
-                    gettimeofday(&low_e_head, NULL);
-                } else {
-                    gettimeofday(&high_e_head, NULL);
+        for (int i = 0; i < nfds; i++) {
+            if (!tdata->busy && !(fds[i].revents & POLLIN)) {
+                continue;
+            }
+            int len = receive_datagram_meta(fds[i].fd, buf, RECV_BUFFER, &recv_addr,
+                                            &meta, MSG_DONTWAIT);
+            if (len < 0) {
+                continue;
+            }
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            parse_reply(buf, len, &reply);
+            struct probe *p = match_reply(tdata, &reply, now);
+            if (p != NULL) {
+                p->wake = meta.stamped ? time_diff_micro(now, meta.stamp) : -1;
+                LOG("%s for port %d received.\n", reply.kind == REPLY_RST ? "RST"
+                        : reply.kind == REPLY_SYNACK ? "SYN-ACK"
+                        : reply.kind == REPLY_UNREACHABLE ? "Port unreachable" : "Time exceeded", reply.port);
+                if (reply.kind == REPLY_SYNACK) {
+                    char rst[SYN_LEN];
+                    stamp_rst(p->packet, rst);
+                    send_packet(tdata->sockfd, rst, SYN_LEN, p->addr);
                 }
-                tail = true;
-            } else {
-                if (!high_e_train) {
-                    gettimeofday(&low_e_tail, NULL);
-                    high_e_train = true;
-                    tail = false;
-                } else {
-                    gettimeofday(&high_e_tail, NULL);
-                    break;
+                answered++;
+                if (p->group >= 0 && group_answers[p->group]++ == 0) {
+                    groups_answered++;
                 }
+                // reset timeout clock
+                beg = now;
             }
-            // reset timeout clock
-            gettimeofday(&beg, NULL);
         }
         // set curr time
         gettimeofday(&curr, NULL);
     }
 
-    // check if loop timed out
-    if (time_diff_sec(curr, beg) > tdata->rst_timeout) {
+    if (groups_answered < tdata->group_count) {
         LOGP("Receive timed out.\n");
-        tdata->result = "Failed to detect due to insufficient information.";
-    } else {
-        double low_delta = time_diff_milli(low_e_tail, low_e_head);
-        double high_delta = time_diff_milli(high_e_tail, high_e_head);
-        double delta = high_delta - low_delta;
-
-        LOG("Delta result: %.0fms\n", delta);
-        if (delta > tdata->threshold) {
-            tdata->result = "Compression detected.";
-        } else {
-            tdata->result = "No compression detected.";
-        }
+    } else if (answered < tdata->probe_count) {
+        LOG("%d of %d probes answered.\n", answered, tdata->probe_count);
     }
 
-    free(buf);
-
+    free(group_answers);
     return NULL;
 }
 
 /**
- * Sends head SYN packet, low entropy train, and then tail SYN packet
+ * Stamps the SYN of a probe to the head or tail port. With synack_port
+ * set every probe goes to that open port, so each one gets a source
+ * port of its own, since a second SYN on the 4-tuple of a half-open
+ * connection is not answered with a SYN-ACK. UDP probes have no
+ * sequence number, so they always get their own source port.
  *
- * configs: pointer to config struct
- * raw_sock: raw socket file descriptor
- * head_syn_packet: pointer to head tcp syn packet
- * head_serv_addr: pointer to sockaddr_in struct for head tcp port
- * udp_sock: udp socket file descriptor
- * udp_server_addr: pointer to sockaddr_in struct for udp port
- * tail_syn_packet: pointer to tail tcp syn packet
- * tail_serv_addr: sockaddr_in struct for tail tcp port
+ * s: pointer to session struct
+ * p: pointer to probe struct to fill
+ * frame: SYN_LEN bytes for the packet
+ * head: probe the head port instead of the tail port
+ * k: index of the redundant probe
+ * index: distinct index of the probe in its measurement, picks the source port
+ * ttl: time to live
+ */
+void stamp_probe(struct session *s, struct probe *p, char *frame, bool head, int k, int index, int ttl)
+{
+    struct config *configs = s->configs;
+    p->addr = &s->syn_addrs[(head ? 0 : 1) * MAX_SYN_PROBES + k];
+    p->port = ntohs(p->addr->sin_port);
+    p->local_port = configs->tcp_port;
+    p->packet = frame;
+    if (configs->udp_bracket) {
+        p->local_port = configs->tcp_port + index;
+        p->seq = 0;
+        struct sockaddr_in src_addr = *s->my_tcp_addr;
+        src_addr.sin_port = htons(p->local_port);
+        struct udp_template tmpl;
+        char payload[1];
+        init_udp_template(&tmpl, &src_addr, p->addr, 0, ttl);
+        stamp_udp(&tmpl, p->packet, payload, index + 1);
+        return;
+    }
+    p->seq = rand();
+    stamp_syn(&s->syn_template, p->packet, p->port, p->seq, ttl);
+    if (configs->synack_port > 0) {
+        p->local_port = configs->tcp_port + index;
+        set_syn_source_port(p->packet, p->local_port);
+    }
+}
+
+/**
+ * Waits until the probed hosts' ICMP rate limit lets count more
+ * replies through, then charges them. Linux keeps a token bucket per
+ * peer that fills at one reply per icmp_ratelimit ms and holds
+ * ICMP_BURST replies, and silently drops the replies it has no tokens
+ * for. Every ttl is answered by a different host, so count is the
+ * replies any one host sends. Port unreachable bracketing needs this,
+ * and so do probes expiring at routers, whose time exceeded replies
+ * are limited the same way. RSTs and SYN-ACKs are not rate limited.
+ *
+ * s: pointer to session struct
+ * count: replies the next probes ask any one host for
+ * expiring: the probes expire at routers
+ */
+void take_icmp_budget(struct session *s, int count, bool expiring)
+{
+    struct config *configs = s->configs;
+    if ((!configs->udp_bracket && !expiring) || configs->icmp_ratelimit <= 0) {
+        return;
+    }
+    double cost = (double) count * configs->icmp_ratelimit;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    s->budget.tokens += time_diff_micro(now, s->budget.last) / 1000;
+    if (s->budget.tokens > ICMP_BURST * configs->icmp_ratelimit) {
+        s->budget.tokens = ICMP_BURST * configs->icmp_ratelimit;
+    }
+    if (s->budget.tokens < cost) {
+        LOG("Waiting %.0fms for the icmp rate limit.\n", cost - s->budget.tokens);
+        sleep_milli(cost - s->budget.tokens);
+        s->budget.tokens = cost;
+        gettimeofday(&now, NULL);
+    }
+    s->budget.tokens -= cost;
+    s->budget.last = now;
+}
+
+/**
+ * Sends the head SYN packets, a low or high entropy train, and then
+ * the tail SYN packets
+ *
+ * s: pointer to session struct
+ * probes: probes of all ttls, syn_probes per slot and PROBE_SLOTS slots per ttl
+ * ttl_count: number of ttls
+ * high_entropy: send the high entropy train instead of the low entropy one
+ * report: pointer to sender_report struct, the train's index is high_entropy
  *
  * returns: 1 if successful, -1 otherwise
  */
-int send_low_entropy_train(struct config *configs, int raw_sock, char *head_syn_packet,
-                            struct sockaddr_in *head_serv_addr, int udp_sock,
-                            struct sockaddr_in *udp_serv_addr, char *tail_syn_packet,
-                            struct sockaddr_in *tail_serv_addr)
+int send_bracketed_train(struct session *s, struct probe *probes, int ttl_count, bool high_entropy,
+                         struct sender_report *report)
 {
-    // send head SYN packet
-    // print_packet(head_syn_packet, IP4_HDRLEN + TCP_HDRLEN);
-    send_packet(raw_sock, head_syn_packet, IP4_HDRLEN + TCP_HDRLEN, head_serv_addr);
-    LOGP("Low entropy head syn sent.\n");
+    struct config *configs = s->configs;
+    int head = high_entropy ? HIGH_HEAD : LOW_HEAD;
+    int tail = high_entropy ? HIGH_TAIL : LOW_TAIL;
+    const char *name = high_entropy ? "High" : "Low";
+    int n = configs->syn_probes;
+    take_icmp_budget(s, 2 * n, s->expiring);
+
+    // send head SYN packets
+    for (int t = 0; t < ttl_count; t++) {
+        for (int k = 0; k < n; k++) {
+            struct probe *p = &probes[(t * PROBE_SLOTS + head) * n + k];
+            send_packet(s->raw_sock, p->packet, s->probe_len, p->addr);
+        }
+    }
+    LOG("%s entropy head syn sent.\n", name);
 
-    // send low entropy UDP packet train
-    char *payload;
+    // send UDP packet train
+    char *frames = s->train_frames[high_entropy ? 1 : 0];
     for (int i = 0; i < configs->udp_train_size; i++) {
-        payload = create_low_entropy_payload(i, configs->udp_payload_size);
+        if (frames != NULL) {
+            // prebuilt frame on the SYNs' queue, no udp stack work
+            char *frame = frames + (size_t) i * s->frame_len;
+            if (send_packet(s->raw_sock, frame, s->frame_len, s->udp_serv_addr) < 0) {
+                return -1;
+            }
+            stamp_sent(report, high_entropy, configs->udp_payload_size);
+            continue;
+        }
+
+        char *payload;
+        if (high_entropy) {
+            payload = create_high_entropy_payload(i, configs->udp_payload_size);
+        } else {
+            payload = create_low_entropy_payload(i, configs->udp_payload_size);
+        }
         if (payload == NULL) {
             return -1;
         }
-        // send low entropy packets
-        if (send_packet(udp_sock, payload, configs->udp_payload_size, udp_serv_addr) < 0) {
+        if (send_packet(s->udp_sock, payload, configs->udp_payload_size, s->udp_serv_addr) < 0) {
+            return -1;
+        }
+        stamp_sent(report, high_entropy, configs->udp_payload_size);
+        free(payload);
+    }
+    LOG("%s entropy train sent.\n", name);
+
+    // send tail SYN packets
+    for (int t = 0; t < ttl_count; t++) {
+        for (int k = 0; k < n; k++) {
+            struct probe *p = &probes[(t * PROBE_SLOTS + tail) * n + k];
+            send_packet(s->raw_sock, p->packet, s->probe_len, p->addr);
+        }
+    }
+    LOG("%s entropy tail syn sent.\n", name);
+
+    return 1;
+}
+
+/**
+ * Sends light SYN probes to the head port, RTT_SAMPLE_GAP ms apart,
+ * to sample the rtt while no train is in flight
+ *
+ * s: pointer to session struct
+ * probes: the rtt probes to send
+ * count: number of probes
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_rtt_samples(struct session *s, struct probe *probes, int count)
+{
+    take_icmp_budget(s, count, false);
+    for (int i = 0; i < count; i++) {
+        if (i > 0) {
+            sleep_milli(RTT_SAMPLE_GAP);
+        }
+        gettimeofday(&probes[i].sent_time, NULL);
+        if (send_packet(s->raw_sock, probes[i].packet, s->probe_len, probes[i].addr) < 0) {
             return -1;
         }
     }
+    return 1;
+}
 
-    LOGP("Low entropy train sent.\n");
-    free(payload);
+/**
+ * Builds the IPv4+UDP frames of both trains up front from a template,
+ * so the raw socket can send the trains without any per packet work.
+ * With udp_bracket the UDP checksums are made wrong on purpose. The
+ * server then drops the train without a port unreachable for each
+ * datagram, which would use up its ICMP rate limit before the tail
+ * probe arrives.
+ *
+ * s: pointer to session struct
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int build_train_frames(struct session *s)
+{
+    struct config *configs = s->configs;
+    struct sockaddr_in *src_addr;
+    if ((src_addr = set_addr_struct(configs->client_ip, configs->udp_source_port)) == NULL) {
+        return -1;
+    }
+    struct udp_template tmpl;
+    init_udp_template(&tmpl, src_addr, s->udp_serv_addr, configs->udp_payload_size, configs->udp_ttl);
+    free(src_addr);
 
-    // send tail SYN packet
-    // print_packet(tail_syn_packet, IP4_HDRLEN + TCP_HDRLEN);
-    send_packet(raw_sock, tail_syn_packet, IP4_HDRLEN + TCP_HDRLEN, tail_serv_addr);
-    LOGP("Low entropy tail syn sent.\n");
+    s->frame_len = UDP_FRAME_HDRLEN + configs->udp_payload_size;
+    for (int e = 0; e < 2; e++) {
+        s->train_frames[e] = malloc((size_t) configs->udp_train_size * s->frame_len);
+        if (s->train_frames[e] == NULL) {
+            perror("Error mallocing train frames");
+            return -1;
+        }
+
+        for (int i = 0; i < configs->udp_train_size; i++) {
+            char *payload;
+            if (e == 1) {
+                payload = create_high_entropy_payload(i, configs->udp_payload_size);
+            } else {
+                payload = create_low_entropy_payload(i, configs->udp_payload_size);
+            }
+            if (payload == NULL) {
+                return -1;
+            }
+            char *frame = s->train_frames[e] + (size_t) i * s->frame_len;
+            stamp_udp(&tmpl, frame, payload, e * configs->udp_train_size + i + 1);
+            free(payload);
+            if (configs->udp_bracket) {
+                struct udphdr *udphdr = (struct udphdr*) (frame + IP4_HDRLEN);
+                // 0 would mean no checksum, which the server accepts
+                uint16_t bad = ~udphdr->uh_sum;
+                udphdr->uh_sum = bad == 0 ? 1 : bad;
+            }
+        }
+    }
 
+    LOGP("Train frames built.\n");
     return 1;
 }
 
 /**
- * Sends head SYN packet, high entropy train, and then tail SYN packet
+ * Finds the median reply time of a slot's redundant probes, relative
+ * to a reference time
+ *
+ * probes: the syn_probes probes of the slot
+ * n: number of probes
+ * ref: reference time
+ * offset: filled with the median offset from ref (ms)
+ *
+ * returns: number of answered probes
+ */
+int median_reply(struct probe *probes, int n, struct timeval ref, double *offset)
+{
+    double offsets[MAX_SYN_PROBES];
+    int count = 0;
+    for (int k = 0; k < n; k++) {
+        if (probes[k].answered) {
+            offsets[count++] = time_diff_micro(probes[k].reply_time, ref) / 1000;
+        }
+    }
+    *offset = median(offsets, count);
+    return count;
+}
+
+/**
+ * Turns the reply times of one ttl's probes into a compression result.
+ * The head and tail of each train are the medians over their answered
+ * probes, so lost or delayed replies neither fail nor skew the result
+ * as long as every head and tail has one answer.
  *
  * configs: pointer to config struct
- * raw_sock: raw socket file descriptor
- * head_syn_packet: pointer to head tcp syn packet
- * head_serv_addr: pointer to sockaddr_in struct for head tcp port
- * udp_sock: udp socket file descriptor
- * udp_server_addr: pointer to sockaddr_in struct for udp port
- * tail_syn_packet: pointer to tail tcp syn packet
- * tail_serv_addr: sockaddr_in struct for tail tcp port
+ * probes: the PROBE_SLOTS * syn_probes probes of the ttl
+ * rtts: baseline rtts (ms), reordered
+ * rtt_count: number of baseline rtts
+ * result: pointer to compression_result struct to fill
+ * router: filled with the address that answered, if any
+ */
+void analyze_probes(struct config *configs, struct probe *probes, double *rtts, int rtt_count,
+                    struct compression_result *result, struct in_addr *router)
+{
+    init_result(result);
+    int n = configs->syn_probes;
+
+    // any reply works as reference, only differences are used
+    struct timeval ref;
+    bool found = false;
+    for (int i = 0; i < PROBE_SLOTS * n && !found; i++) {
+        if (probes[i].answered) {
+            ref = probes[i].reply_time;
+            *router = probes[i].from;
+            found = true;
+        }
+    }
+    if (!found) {
+        return;
+    }
+
+    double times[PROBE_SLOTS];
+    for (int slot = 0; slot < PROBE_SLOTS; slot++) {
+        int count = median_reply(&probes[slot * n], n, ref, &times[slot]);
+        if (count == 0) {
+            return;
+        }
+        if (count < n) {
+            LOG("Slot %d: %d of %d probes answered.\n", slot, count, n);
+        }
+    }
+
+    result->valid = true;
+    result->low_delta = times[LOW_TAIL] - times[LOW_HEAD];
+    result->high_delta = times[HIGH_TAIL] - times[HIGH_HEAD];
+    result->low_bytes = (long) configs->udp_train_size * configs->udp_payload_size;
+    result->high_bytes = result->low_bytes;
+    estimate_jitter(rtts, rtt_count, n, result);
+
+    double wakes[PROBE_SLOTS * MAX_SYN_PROBES];
+    int wake_count = 0;
+    for (int i = 0; i < PROBE_SLOTS * n; i++) {
+        if (probes[i].answered && probes[i].wake >= 0) {
+            wakes[wake_count++] = probes[i].wake;
+        }
+    }
+    summarize_wake(wakes, wake_count, result);
+    result->busy_poll = configs->busy_poll > 0;
+    judge_deltas(result, configs->threshold, configs->ratio_threshold);
+}
+
+/**
+ * Pre-flight check of the path. Sends a couple of SYNs to the head
+ * and tail ports and fails fast if either port does not answer with
+ * a RST, or a SYN-ACK for synack_port, rather than running full trains
+ * and waiting out rst_timeout. Port unreachable bracketing sends one
+ * datagram per port, to spare the server's ICMP rate limit.
  *
- * returns: 1 if successful, -1 otherwise
+ * s: pointer to session struct
+ *
+ * returns: 1 if both ports answered, -1 otherwise
  */
-int send_high_entropy_train(struct config *configs, int raw_sock, char *head_syn_packet,
-                            struct sockaddr_in *head_serv_addr, int udp_sock,
-                            struct sockaddr_in *udp_serv_addr, char *tail_syn_packet,
-                            struct sockaddr_in *tail_serv_addr)
+int preflight(struct session *s)
 {
-    // send head SYN packet
-    // print_packet(head_syn_packet, IP4_HDRLEN + TCP_HDRLEN);
-    send_packet(raw_sock, head_syn_packet, IP4_HDRLEN + TCP_HDRLEN, head_serv_addr);
-    LOGP("High entropy head syn sent.\n");
+    struct config *configs = s->configs;
+    int per_port = configs->udp_bracket ? 1 : PREFLIGHT_SYNS;
+    struct probe probes[2 * PREFLIGHT_SYNS];
+    char frames[2 * PREFLIGHT_SYNS][SYN_LEN];
+    memset(probes, 0, sizeof(probes));
 
-    // send high UDP packet train
-    char *payload;
-    for (int i = 0; i < configs->udp_train_size; i++) {
-        payload = create_high_entropy_payload(i, configs->udp_payload_size);
-        if (payload == NULL) {
+    for (int i = 0; i < 2 * per_port; i++) {
+        bool head = i < per_port;
+        probes[i].group = head ? 0 : 1;
+        stamp_probe(s, &probes[i], frames[i], head, 0, i, 255);
+    }
+
+    struct thread_data tdata;
+    tdata.sockfd = s->raw_sock;
+    tdata.icmp_sockfd = configs->udp_bracket ? s->icmp_sock : -1;
+    tdata.timeout_ms = PREFLIGHT_TIMEOUT;
+    tdata.probes = probes;
+    tdata.probe_count = 2 * per_port;
+    tdata.group_count = 2;
+    tdata.protocol = configs->udp_bracket ? IPPROTO_UDP : IPPROTO_TCP;
+    tdata.cpu = -1;     // read on the calling thread
+    tdata.fifo = false;
+    tdata.busy = false;
+
+    // replies queue on the raw sockets, so they can be read after sending
+    take_icmp_budget(s, 2 * per_port, false);
+    struct timeval sent;
+    gettimeofday(&sent, NULL);
+    for (int i = 0; i < 2 * per_port; i++) {
+        if (send_packet(s->raw_sock, probes[i].packet, s->probe_len, probes[i].addr) < 0) {
             return -1;
         }
-        // send low entropy packets
-        if (send_packet(udp_sock, payload, configs->udp_payload_size, udp_serv_addr) < 0) {
+    }
+    receive_routine(&tdata);
+
+    double rtts[2 * PREFLIGHT_SYNS];
+    int count = 0;
+    for (int g = 0; g < 2; g++) {
+        bool answered = false;
+        for (int k = 0; k < per_port; k++) {
+            struct probe *p = &probes[g * per_port + k];
+            if (p->answered) {
+                rtts[count++] = time_diff_micro(p->reply_time, sent) / 1000;
+                answered = true;
+            }
+        }
+        if (!answered) {
+            fprintf(stderr, "Pre-flight failed: no reply from %s:%d within %dms\n",
+                    configs->server_ip, probes[g * per_port].port, PREFLIGHT_TIMEOUT);
             return -1;
         }
     }
 
-    LOGP("High entropy train sent.\n");
-    free(payload);
+    LOG("Pre-flight rtt %.3fms.\n", median(rtts, count));
+    return 1;
+}
 
-    // send tail SYN packet
-    // print_packet(tail_syn_packet, IP4_HDRLEN + TCP_HDRLEN);
-    send_packet(raw_sock, tail_syn_packet, IP4_HDRLEN + TCP_HDRLEN, tail_serv_addr);
-    LOGP("High entropy tail syn sent.\n");
+/**
+ * Sends the rtt samples and the two bracketed trains of a measurement
+ *
+ * s: pointer to session struct
+ * probes: probes of the trains, followed by the rtt probes
+ * ttl_count: number of ttls
+ * report: pointer to sender_report struct of the 2 trains
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+static int send_measurement(struct session *s, struct probe *probes, int ttl_count,
+                            struct sender_report *report)
+{
+    struct config *configs = s->configs;
+    int samples = configs->rtt_samples;
+    struct probe *rtt_probes = &probes[ttl_count * PROBE_SLOTS * configs->syn_probes];
+
+    if (send_rtt_samples(s, rtt_probes, samples) < 0) {
+        return -1;
+    }
+    start_sent_train(report, 0);
+    if (send_bracketed_train(s, probes, ttl_count, false, report) < 0) {
+        return -1;
+    }
+    end_sent_train(report, 0);
+
+    LOG("Sent low entropy tail syn packets. Sleeping for %ds.\n", configs->inter_measurement_time);
+    // sample at the end of the pause, once the low train has drained
+    int pause = configs->inter_measurement_time * 1000 - samples * RTT_SAMPLE_GAP;
+    sleep_milli(pause > 0 ? pause : 0);
+    if (send_rtt_samples(s, &rtt_probes[samples], samples) < 0) {
+        return -1;
+    }
+
+    start_sent_train(report, 1);
+    if (send_bracketed_train(s, probes, ttl_count, true, report) < 0) {
+        return -1;
+    }
+    end_sent_train(report, 1);
+    return 1;
+}
+
+/**
+ * Measures a low and a high entropy train, bracketed by SYN probes
+ * that expire after each of the given ttls. Probes that reach the
+ * server are answered with RSTs, probes that expire on the way with
+ * ICMP time exceeded messages from the hop they expired at, so one
+ * pair of trains measures the delta at every ttl at once. With
+ * rtt_samples set, light probes sample the rtt while the path is idle,
+ * before the low train and at the end of the pause before the high
+ * one, so the analysis can tell how much of the delta is rtt jitter.
+ *
+ * s: pointer to session struct
+ * ttls: ttls to probe
+ * ttl_count: number of ttls
+ * results: array of ttl_count compression_result structs to fill
+ * routers: array of ttl_count addresses that answered, may be NULL
+ * report: pointer to sender_report struct of the 2 trains, may be NULL,
+ *         freed again if measuring fails
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int measure(struct session *s, int *ttls, int ttl_count, struct compression_result *results,
+            struct in_addr *routers, struct sender_report *report)
+{
+    struct config *configs = s->configs;
+    int n = configs->syn_probes;
+    int train_probes = ttl_count * PROBE_SLOTS * n;
+    int samples = configs->rtt_samples;
+    int probe_count = train_probes + 2 * samples;
+    struct probe *probes = calloc(probe_count, sizeof(struct probe));
+    if (probes == NULL) {
+        perror("Error mallocing probes");
+        return -1;
+    }
+
+    // -------- stamp syn packets --------
+    for (int t = 0; t < ttl_count; t++) {
+        for (int slot = 0; slot < PROBE_SLOTS; slot++) {
+            bool head = slot == LOW_HEAD || slot == HIGH_HEAD;
+            for (int k = 0; k < n; k++) {
+                int i = (t * PROBE_SLOTS + slot) * n + k;
+                probes[i].group = t * PROBE_SLOTS + slot;
+                stamp_probe(s, &probes[i], s->frames[i], head, k, i, ttls[t]);
+            }
+        }
+    }
+    // rtt probes cross the whole path, they tell replies apart by seq
+    struct probe *rtt_probes = &probes[train_probes];
+    for (int i = 0; i < 2 * samples; i++) {
+        rtt_probes[i].group = -1;
+        stamp_probe(s, &rtt_probes[i], s->frames[train_probes + i], true, 0, train_probes + i, 255);
+    }
+
+    struct sender_report scratch_report;
+    if (report == NULL) {
+        report = &scratch_report;
+    }
+    if (init_sender_report(report, 2, configs->udp_train_size) < 0) {
+        free(probes);
+        return -1;
+    }
+
+    // -------- start receive thread --------
+    pthread_t receive_thread;
+
+    // set up thread data
+    struct thread_data tdata;
+    tdata.sockfd = s->raw_sock;
+    tdata.icmp_sockfd = s->icmp_sock;
+    tdata.timeout_ms = configs->rst_timeout * 1000;
+    s->expiring = false;
+    for (int t = 0; t < ttl_count; t++) {
+        s->expiring |= ttls[t] < 255;
+    }
+    if (configs->udp_bracket || s->expiring) {
+        // the sender may wait out the icmp rate limit without replies
+        tdata.timeout_ms += ICMP_BURST * configs->icmp_ratelimit;
+    }
+    tdata.probes = probes;
+    tdata.probe_count = probe_count;
+    tdata.group_count = ttl_count * PROBE_SLOTS;
+    tdata.protocol = configs->udp_bracket ? IPPROTO_UDP : IPPROTO_TCP;
+    tdata.cpu = configs->receiver_cpu;
+    tdata.fifo = configs->sched_fifo;
+    tdata.busy = configs->busy_poll > 0;
+    tdata.stop = false;
+
+    if (pthread_create(&receive_thread, NULL, receive_routine, (void *) &tdata) != 0) {
+        perror("Error creating receive thread");
+        free(probes);
+        free_sender_report(report);
+        return -1;
+    }
+
+    // -------- send entropy trains --------
+    int status = send_measurement(s, probes, ttl_count, report);
+    if (status < 0) {
+        // the thread holds the probes and its data on this stack
+        tdata.stop = true;
+    }
+
+    // ------- join thread and receive results -------
+    if (pthread_join(receive_thread, NULL) != 0) {
+        perror("Error joining thread");
+        status = -1;
+    }
+    if (status < 0) {
+        free(probes);
+        free_sender_report(report);
+        return -1;
+    }
+
+    double rtts[2 * MAX_RTT_SAMPLES];
+    int rtt_count = 0;
+    for (int i = 0; i < 2 * samples; i++) {
+        if (rtt_probes[i].answered) {
+            rtts[rtt_count++] = time_diff_micro(rtt_probes[i].reply_time, rtt_probes[i].sent_time) / 1000;
+        }
+    }
+    if (samples > 0) {
+        LOG("%d of %d rtt probes answered.\n", rtt_count, 2 * samples);
+    }
+
+    for (int t = 0; t < ttl_count; t++) {
+        struct in_addr router = { 0 };
+        double scratch[2 * MAX_RTT_SAMPLES];
+        memcpy(scratch, rtts, rtt_count * sizeof(double));
+        analyze_probes(configs, &probes[t * PROBE_SLOTS * n], scratch, rtt_count, &results[t], &router);
+        if (routers != NULL) {
+            routers[t] = router;
+        }
+    }
+
+    free(probes);
+    if (report == &scratch_report) {
+        free_sender_report(report);
+    }
+
+    return 1;
+}
+
+/**
+ * Runs a scan over the target list with the standalone configuration
+ *
+ * configs: pointer to config struct
+ * json: write the records as json lines
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int scan(struct config *configs, bool json)
+{
+    if (configs->targets == NULL) {
+        fprintf(stderr, "Scan mode needs a targets file\n");
+        return -1;
+    }
+    if (configs->scan_parallel < 1 || configs->scan_parallel > MAX_SCAN_PARALLEL) {
+        fprintf(stderr, "scan_parallel must be between 1 and %d\n", MAX_SCAN_PARALLEL);
+        return -1;
+    }
+
+    struct scan_config scan_configs = {
+        .client_ip = configs->client_ip,
+        .targets = configs->targets,
+        .tcp_port = configs->tcp_port,
+        .tcp_head_dest = configs->tcp_head_dest,
+        .tcp_tail_dest = configs->tcp_tail_dest,
+        .udp_source_port = configs->udp_source_port,
+        .udp_dest_port = configs->udp_dest_port,
+        .udp_payload_size = configs->udp_payload_size,
+        .udp_train_size = configs->udp_train_size,
+        .udp_ttl = configs->udp_ttl,
+        .inter_measurement_time = configs->inter_measurement_time,
+        .rst_timeout = configs->rst_timeout,
+        .threshold = configs->threshold,
+        .ratio_threshold = configs->ratio_threshold,
+        .parallel = configs->scan_parallel,
+        .rate = configs->scan_rate,
+    };
+    return run_scan(&scan_configs, json) < 0 ? -1 : 1;
+}
+
+/**
+ * Localizes the hop that compresses. The delta shows at every hop
+ * after the compressing link, so the first ttl with a delta is found
+ * by searching the ttl range, probing parallel_ttls ttls per pair of
+ * trains. With one ttl per pair this is a binary search and takes
+ * about log2(max_ttl) pairs instead of one per hop.
+ *
+ * s: pointer to session struct
+ * profile: pointer to hop_profile struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int localize(struct session *s, struct hop_profile *profile)
+{
+    struct config *configs = s->configs;
+    memset(profile, 0, sizeof(struct hop_profile));
+    profile->hop = -1;
+
+    int parallel = configs->parallel_ttls;
+    if (parallel < 1) {
+        parallel = 1;
+    } else if (parallel > MAX_PARALLEL_TTLS) {
+        parallel = MAX_PARALLEL_TTLS;
+    }
+
+    // compression must show at max_ttl, which is where the search ends
+    int lo = 1;
+    int hi = configs->max_ttl;
+    int ttls[MAX_PARALLEL_TTLS];
+    struct compression_result results[MAX_PARALLEL_TTLS];
+    struct in_addr routers[MAX_PARALLEL_TTLS];
+
+    while (lo < hi) {
+        // split [lo, hi] evenly, every ttl below hi
+        int count = 0;
+        for (int j = 1; j <= parallel; j++) {
+            int ttl = lo + j * (hi - lo) / (parallel + 1);
+            if (ttl < hi && (count == 0 || ttl > ttls[count - 1])) {
+                ttls[count++] = ttl;
+            }
+        }
+        if (count == 0) {
+            ttls[count++] = lo;
+        }
+
+        if (profile->count > 0) {
+            sleep(configs->inter_measurement_time);
+        }
+        if (measure(s, ttls, count, results, routers, NULL) < 0) {
+            return -1;
+        }
+
+        for (int j = 0; j < count; j++) {
+            add_hop(profile, ttls[j], &results[j], routers[j]);
+            LOG("TTL %d: %s\n", ttls[j], result_message(&results[j]));
+            if (!results[j].valid) {
+                LOG("No replies for ttl %d, giving up.\n", ttls[j]);
+                return 1;
+            }
+        }
+
+        // first compressed ttl bounds the search from above, the
+        // uncompressed ones before it from below
+        int next_lo = lo;
+        int next_hi = hi;
+        for (int j = 0; j < count; j++) {
+            if (results[j].compressed) {
+                next_hi = ttls[j];
+                break;
+            }
+            next_lo = ttls[j] + 1;
+        }
+        lo = next_lo;
+        hi = next_hi;
+    }
+
+    profile->hop = lo;
+    for (int i = 0; i < profile->count; i++) {
+        if (profile->points[i].ttl == lo) {
+            strcpy(profile->router, profile->points[i].router);
+        }
+    }
 
     return 1;
 }
@@ -253,11 +1019,12 @@ int main(int argc, char *argv[])
 {
     // check that config file is provided
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s config_file.json\n", argv[0]);
+        fprintf(stderr, "Usage: %s config_file.json [--json]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     char *filename = argv[1];
+    bool json = argc > 2 && strcmp(argv[2], "--json") == 0;
 
     struct stat buf;
     if (stat(filename, &buf) < 0) {
@@ -274,13 +1041,81 @@ int main(int argc, char *argv[])
     // parse config file
     struct config *configs = malloc(sizeof(struct config));
     parse_config(configs, config_contents);
+    if (configs->mode != MODE_DETECT && configs->mode != MODE_LOCALIZE && configs->mode != MODE_SCAN) {
+        fprintf(stderr, "Mode not supported by the standalone application\n");
+        return EXIT_FAILURE;
+    }
+    if (configs->syn_probes < 1 || configs->syn_probes > MAX_SYN_PROBES) {
+        fprintf(stderr, "syn_probes must be between 1 and %d\n", MAX_SYN_PROBES);
+        return EXIT_FAILURE;
+    }
+    if (configs->rtt_samples < 0 || configs->rtt_samples > MAX_RTT_SAMPLES) {
+        fprintf(stderr, "rtt_samples must be between 0 and %d\n", MAX_RTT_SAMPLES);
+        return EXIT_FAILURE;
+    }
+    if (configs->udp_bracket && configs->synack_port > 0) {
+        fprintf(stderr, "udp_bracket and synack_port exclude each other\n");
+        return EXIT_FAILURE;
+    }
+    // a train's head and tail must fit into one burst of replies
+    if ((configs->udp_bracket || configs->mode == MODE_LOCALIZE)
+            && 2 * configs->syn_probes > ICMP_BURST) {
+        fprintf(stderr, "syn_probes must be at most %d with udp_bracket or in localize mode\n",
+                ICMP_BURST / 2);
+        return EXIT_FAILURE;
+    }
+    if (configs->udp_bracket && configs->rtt_samples > ICMP_BURST) {
+        fprintf(stderr, "rtt_samples must be at most %d with udp_bracket\n", ICMP_BURST);
+        return EXIT_FAILURE;
+    }
+    // the scan sends a single SYN per head and tail from its own loop
+    if (configs->mode == MODE_SCAN && (configs->syn_probes != 1 || configs->raw_train
+            || configs->synack_port > 0 || configs->udp_bracket || configs->rtt_samples > 0
+            || configs->busy_poll > 0)) {
+        fprintf(stderr, "Scan mode does not support syn_probes, raw_train, synack_port, "
+                "udp_bracket, rtt_samples or busy_poll\n");
+        return EXIT_FAILURE;
+    }
+    // a spinning real time receiver never lets the sender on its cpu run
+    if (configs->busy_poll > 0 && configs->sched_fifo
+            && (configs->receiver_cpu < 0 || configs->receiver_cpu == configs->sender_cpu)) {
+        fprintf(stderr, "busy_poll with sched_fifo needs a receiver_cpu apart from the sender's\n");
+        return EXIT_FAILURE;
+    }
 
     free(config_contents);
 
+    // the main thread sends, the receive threads it starts inherit
+    // its scheduling class and, unless receiver_cpu is set, its cpu
+    if (configs->mlock && lock_memory() < 0) {
+        return EXIT_FAILURE;
+    }
+    if ((configs->sender_cpu >= 0 || configs->sched_fifo)
+            && set_thread_realtime(configs->sender_cpu, configs->sched_fifo) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (configs->mode == MODE_SCAN) {
+        int status = scan(configs, json);
+        free(configs);
+        return status < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+    if (configs->server_ip == NULL) {
+        fprintf(stderr, "No server_ip configured\n");
+        return EXIT_FAILURE;
+    }
+
+    struct session s;
+    s.configs = configs;
+    s.probe_len = configs->udp_bracket ? UDP_FRAME_HDRLEN : SYN_LEN;
+    // assume the hosts have not answered us lately
+    s.budget.tokens = ICMP_BURST * configs->icmp_ratelimit;
+    gettimeofday(&s.budget.last, NULL);
+    s.expiring = false;
+
     // -------- create address structs --------
     // addr struct for my tcp port
-    struct sockaddr_in *my_tcp_addr;
-    if ((my_tcp_addr = set_addr_struct(configs->client_ip, configs->tcp_port)) == NULL) {
+    if ((s.my_tcp_addr = set_addr_struct(configs->client_ip, configs->tcp_port)) == NULL) {
         return EXIT_FAILURE;
     }
 
@@ -290,129 +1125,137 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    // addr struct for server head tcp port
-    struct sockaddr_in *head_serv_addr;
-    if ((head_serv_addr = set_addr_struct(configs->server_ip, configs->tcp_head_dest)) == NULL) {
-        return EXIT_FAILURE;
+    // addr structs for server head and tail tcp ports. Redundant probes
+    // go to every other port from the head and tail ports, so adjacent
+    // head and tail ports never collide. SYN-ACK bracketing sends them
+    // all to the open port.
+    for (int k = 0; k < configs->syn_probes; k++) {
+        uint16_t head_port = configs->tcp_head_dest + 2 * k;
+        uint16_t tail_port = configs->tcp_tail_dest + 2 * k;
+        if (configs->synack_port > 0) {
+            head_port = configs->synack_port;
+            tail_port = configs->synack_port;
+        }
+        struct sockaddr_in *head, *tail;
+        if ((head = set_addr_struct(configs->server_ip, head_port)) == NULL
+                || (tail = set_addr_struct(configs->server_ip, tail_port)) == NULL) {
+            return EXIT_FAILURE;
+        }
+        s.syn_addrs[k] = *head;
+        s.syn_addrs[MAX_SYN_PROBES + k] = *tail;
+        free(head);
+        free(tail);
     }
+    // every SYN is stamped from one template, only port, seq and ttl differ
+    init_syn_template(&s.syn_template, s.my_tcp_addr, &s.syn_addrs[0]);
 
     // addr struct for server udp port
-    struct sockaddr_in *udp_serv_addr; 
-    if ((udp_serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
-        return EXIT_FAILURE;
-    }
-
-    // addr struct for server tail tcp port
-    struct sockaddr_in *tail_serv_addr;
-    if ((tail_serv_addr = set_addr_struct(configs->server_ip, configs->tcp_tail_dest)) == NULL) {
+    if ((s.udp_serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
         return EXIT_FAILURE;
     }
 
     // -------- create sockets --------
     // create raw socket
-    int raw_sock;
-    if ((raw_sock = create_raw_socket()) < 0) {
+    if ((s.raw_sock = create_raw_socket()) < 0) {
         return EXIT_FAILURE;
     }
 
+    // icmp socket for time exceeded replies when localizing, and for
+    // port unreachables
+    s.icmp_sock = -1;
+    if (configs->mode == MODE_LOCALIZE || configs->udp_bracket) {
+        if ((s.icmp_sock = create_icmp_socket()) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // kernel arrival stamps give the receive thread's wake latency
+    int reply_socks[2] = {s.raw_sock, s.icmp_sock};
+    for (int i = 0; i < 2 && reply_socks[i] >= 0; i++) {
+        if (add_timestamp_opt(reply_socks[i]) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (configs->busy_poll > 0 && add_busy_poll_opt(reply_socks[i], configs->busy_poll) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
     // create udp socket
-    int udp_sock;
-    if ((udp_sock = create_udp_socket()) < 0) {
+    if ((s.udp_sock = create_udp_socket()) < 0) {
         return EXIT_FAILURE;
     }
 
     // set DF bit
-    if (set_df_opt(udp_sock) < 0) {
+    if (set_df_opt(s.udp_sock) < 0) {
         return EXIT_FAILURE;
     }
     // add TTL opt
-    if (add_ttl_opt(udp_sock, configs->udp_ttl) < 0) {
+    if (add_ttl_opt(s.udp_sock, configs->udp_ttl) < 0) {
         return EXIT_FAILURE;
     }
     // bind to specified port
-    if (bind_port(udp_sock, my_udp_addr) < 0) {
+    if (bind_port(s.udp_sock, my_udp_addr) < 0) {
         return EXIT_FAILURE;
     }
 
-    // -------- create syn packets --------
-    char* head_syn_packet = create_syn_packet(my_tcp_addr, head_serv_addr, IP4_HDRLEN + TCP_HDRLEN);
-    if (head_syn_packet == NULL) {
+    // raw trains share the SYNs' socket and queue, port unreachable
+    // bracketing needs them for the broken checksums
+    s.train_frames[0] = NULL;
+    s.train_frames[1] = NULL;
+    if ((configs->raw_train || configs->udp_bracket) && build_train_frames(&s) < 0) {
         return EXIT_FAILURE;
     }
 
-    char* tail_syn_packet = create_syn_packet(my_tcp_addr, tail_serv_addr, IP4_HDRLEN + TCP_HDRLEN);
-    if (tail_syn_packet == NULL) {
+    // -------- check the path can be measured --------
+    if (preflight(&s) < 0) {
         return EXIT_FAILURE;
     }
 
-    // -------- start receive thread --------
-    pthread_t receive_thread;
-
-    // set up thread data
-    struct thread_data *tdata = malloc(sizeof(struct thread_data));
-    tdata->sockfd = raw_sock;
-    tdata->rst_timeout = configs->rst_timeout;
-    tdata->threshold = configs->threshold;
-    struct sockaddr_in *recv_addr = malloc(sizeof(struct sockaddr));
-    memset(recv_addr, 0, sizeof(struct sockaddr));
-    tdata->recv_addr = recv_addr;
-    
-    if (pthread_create(&receive_thread, NULL, receive_routine, (void *) tdata) < 0) {
-        perror("Error creating receive thread");
-        return EXIT_FAILURE;
-    }
-
-    // -------- send entropy trains --------
-    if (send_low_entropy_train(configs, raw_sock, head_syn_packet, head_serv_addr,
-                                udp_sock, udp_serv_addr, tail_syn_packet, tail_serv_addr) < 0) {
+    // -------- measure full path --------
+    int full_ttl = 255;
+    struct compression_result result;
+    struct sender_report report;
+    if (measure(&s, &full_ttl, 1, &result, NULL, &report) < 0) {
         return EXIT_FAILURE;
     }
 
-    LOG("Sent low entropy tail syn packet. Sleeping for %ds.\n", configs->inter_measurement_time);
-    sleep(configs->inter_measurement_time);
+    // print result
+    print_result(&result, json);
+    check_stalls(&report, &result, configs->threshold);
+    print_sender(&report, json);
+    free_sender_report(&report);
 
-    if (send_high_entropy_train(configs, raw_sock, head_syn_packet, head_serv_addr,
-                                udp_sock, udp_serv_addr, tail_syn_packet, tail_serv_addr) < 0) {
-        return EXIT_FAILURE;
-    }
+    // -------- localize compressing hop --------
+    if (configs->mode == MODE_LOCALIZE && result.compressed) {
+        sleep(configs->inter_measurement_time);
 
-    // ------- join thread and receive results -------
-    void* status;
-    if (pthread_join(receive_thread, &status) < 0) {
-        perror("Error joining thread");
-        return EXIT_FAILURE;
+        struct hop_profile profile;
+        if (localize(&s, &profile) < 0) {
+            return EXIT_FAILURE;
+        }
+        print_hops(&profile, json);
     }
 
-    // check thread status
-    // if (status < 0) {
-    //     return EXIT_FAILURE;
-    // }
-
-    // print result
-    printf("%s\n", tdata->result);
-
     // free memory
     free(configs);
-    free(head_syn_packet);
-    free(tail_syn_packet);
 
     // free addr structs
-    free(my_tcp_addr);
+    free(s.my_tcp_addr);
     free(my_udp_addr);
-    free(head_serv_addr);
-    free(udp_serv_addr);
-    free(tail_serv_addr);
-
-    // free thread data
-    free(recv_addr);
-    free(tdata);
+    free(s.udp_serv_addr);
+    free(s.train_frames[0]);
+    free(s.train_frames[1]);
 
     // close sockets
-    if (close(raw_sock) < 0) {
+    if (close(s.raw_sock) < 0) {
         perror("Error closing raw socket");
         return EXIT_FAILURE;
     }
-    if (close(udp_sock) < 0) {
+    if (s.icmp_sock >= 0 && close(s.icmp_sock) < 0) {
+        perror("Error closing icmp socket");
+        return EXIT_FAILURE;
+    }
+    if (close(s.udp_sock) < 0) {
         perror("Error closing udp socket");
         return EXIT_FAILURE;
     }
@@ -6,16 +6,47 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <linux/sockios.h>
 
 #include "cJSON.h"
+#include "analysis.h"
+#include "headers.h"
 #include "sockets.h"
 #include "util.h"
 #include "logger.h"
 
+#define CALIBRATION_TIMEOUT 1000    // ms to wait for a calibration echo
+#define PREFLIGHT_TIMEOUT 800       // ms the server gets to answer the pre-flight checks
+#define PREFLIGHT_ECHOES 2          // udp echoes sent by the pre-flight check
+#define PREFLIGHT_ID 0xFFFF         // packet id of the pre-flight echoes
+#define MIN_UDP_TIMEOUT 200         // ms, lower bound for the server receive timeout
+#define EWMA_GAIN 0.125             // gain for smoothed estimates (RFC 6298)
+#define MARKER_BASE_PORT 33434      // first destination port of the hop markers
+#define MARKER_DRAIN_TIMEOUT 100    // ms without icmp replies that ends collection
+#define TCP_CHUNK 65536             // bytes handed to the kernel per send during a bulk transfer
+
+// markers bracketing the trains, per ttl
+enum marker_slot {
+    LOW_HEAD,
+    LOW_TAIL,
+    HIGH_HEAD,
+    HIGH_TAIL,
+    MARKER_SLOTS
+};
+
 struct client_config {
     char* server_ip;
     uint16_t udp_source_port;
@@ -26,152 +57,1399 @@ struct client_config {
     int udp_train_size;
     int udp_timeout;
     int udp_ttl;
+    int threshold;
+    double ratio_threshold;
+    int max_ttl;
+    int calibration_pairs;
+    int rounds;
+    int tcp_bytes;              // bytes per bulk transfer in tcp mode
+    int bidirectional;          // 1 for reverse trains alongside ours, 2 after them
+    int flows;                  // concurrent flows, from udp_source_port up
+    int sender_cpu;             // cpu the sender thread is pinned to, -1 for none
+    int sched_fifo;             // run the sender thread as SCHED_FIFO
+    int mlock;                  // lock the client's memory
+    bool train_tags;            // tag the trains for the server's xdp program
+    int mode;
+    int levels[MAX_ENTROPY_LEVELS];     // sweep entropy levels
+    int level_count;
+    int udp_timeout_ms;         // server receive timeout, calibrated if enabled
+    int inter_measurement_ms;   // inter train gap, calibrated if enabled
+    int result_wait_ms;         // wait before asking the server for results
+};
+
+struct marker {
+    bool sent;
+    struct timeval sent_time;   // before the marker left, replies stamped earlier are stale
+    bool answered;
+    struct timeval reply_time;  // kernel arrival time of the reply
+    struct in_addr from;        // address that replied
+};
+
+struct hop_markers {
+    int sockfd;                 // udp socket the markers are sent from
+    int icmp_sockfd;            // raw socket the replies arrive on
+    uint16_t local_port;        // source port of the markers
+    struct sockaddr_in *addr;   // server address, port set per marker
+    int payload_size;           // payload bytes of a marker, those of a train packet
+    int hops;                   // routers before the server
+    bool reached;               // whether the server answered within max_ttl
+    struct marker markers[MARKER_SLOTS][MAX_HOPS];
 };
 
+struct path_estimate {
+    double srtt;        // smoothed round trip time (ms)
+    double rttvar;      // round trip time variation (ms)
+    double dispersion;  // smoothed packet pair dispersion (ms)
+    int samples;        // number of pair samples folded into the estimate
+};
+
+struct flow_sender {
+    pthread_t thread;
+    pthread_barrier_t *start;   // releases all flows into each train at once
+    struct client_config *configs;
+    struct sockaddr_in *serv_addr;
+    int sockfd;                 // udp socket bound to the flow's source port
+    char *trains[2];            // low and high entropy payloads, tagged with the flow
+    int index;                  // flow index
+    struct sender_report *report;
+};
+
+struct sender_thread {
+    pthread_t thread;
+    struct client_config *configs;
+    int udp_sock;
+    struct hop_markers *markers;    // NULL when not localizing
+    struct tcp_result *tcp;     // sender stats in tcp mode
+    struct sender_report report;
+    int status;                 // 1 if the trains were sent, -1 otherwise
+};
+
+struct reverse_trains {
+    pthread_t thread;
+    int sockfd;                 // udp socket the server sends the trains to
+    int train_size;
+    int wait_ms;                // ms to wait for a train to start
+    int timeout_ms;             // ms without packets that ends a train
+    struct train_record *records[2];
+    int received;               // packets received, -1 on error
+};
+
+/**
+ * Parses JSON file for client specific configurations
+ *
+ * configs: client_config struct to fill
+ * contents: json text to parse
+ */
+void parse_config(struct client_config *configs, char *contents)
+{
+    cJSON *root = cJSON_Parse(contents);
+    configs->server_ip = cJSON_GetObjectItem(root, "server_ip")->valuestring;
+    configs->udp_dest_port = atoi(cJSON_GetObjectItem(root, "udp_dest_port")->valuestring);
+    configs->udp_source_port = atoi(cJSON_GetObjectItem(root, "udp_source_port")->valuestring);
+    configs->tcp_port = atoi(cJSON_GetObjectItem(root, "tcp_port")->valuestring);
+    configs->udp_payload_size = atoi(cJSON_GetObjectItem(root, "udp_payload_size")->valuestring);
+    configs->inter_measurement_time = atoi(cJSON_GetObjectItem(root, "inter_measurement_time")->valuestring);
+    configs->udp_train_size = atoi(cJSON_GetObjectItem(root, "udp_train_size")->valuestring);
+    configs->udp_timeout = atoi(cJSON_GetObjectItem(root, "udp_timeout")->valuestring);
+    configs->udp_ttl = atoi(cJSON_GetObjectItem(root, "udp_ttl")->valuestring);
+    configs->threshold = atoi(cJSON_GetObjectItem(root, "threshold")->valuestring);
+    configs->ratio_threshold = get_config_double(root, "ratio_threshold", 0);
+    configs->max_ttl = get_config_int(root, "max_ttl", 30);
+    configs->calibration_pairs = get_config_int(root, "calibration_pairs", 0);
+    configs->rounds = get_config_int(root, "rounds", 1);
+    configs->bidirectional = get_config_int(root, "bidirectional", 0);
+    configs->flows = get_config_int(root, "flows", 1);
+    configs->sender_cpu = get_config_int(root, "sender_cpu", -1);
+    configs->sched_fifo = get_config_int(root, "sched_fifo", 0);
+    configs->mlock = get_config_int(root, "mlock", 0);
+    configs->tcp_bytes = get_config_int(root, "tcp_bytes", 4194304);
+    configs->train_tags = get_config_string(root, "xdp_interface", NULL) != NULL;
+    configs->mode = get_config_mode(root);
+    configs->level_count = 0;
+    if (configs->mode == MODE_SWEEP) {
+        configs->level_count = get_config_levels(root, configs->levels);
+    }
+
+    // hand picked values until the calibration phase replaces them
+    configs->udp_timeout_ms = configs->udp_timeout * 1000;
+    configs->inter_measurement_ms = configs->inter_measurement_time * 1000;
+    configs->result_wait_ms = (configs->udp_timeout + 1) * 1000;
+}
+
+/**
+ * Creates a client udp socket with the DF bit and TTL set, bound
+ * to the given source port
+ *
+ * configs: pointer to client_config struct
+ * port: source port to bind
+ *
+ * returns: udp socket file descriptor if successful, -1 otherwise
+ */
+int open_udp_socket(struct client_config *configs, uint16_t port)
+{
+    int udp_sock;
+    if ((udp_sock = create_udp_socket()) < 0) {
+        return -1;
+    }
+
+    // set DF bit
+    if (set_df_opt(udp_sock) < 0) {
+        return -1;
+    }
+    // add TTL opt
+    if (add_ttl_opt(udp_sock, configs->udp_ttl) < 0) {
+        return -1;
+    }
+    // the server's trains come back to this socket
+    if (configs->bidirectional && port == configs->udp_source_port) {
+        if (set_receive_buffer(udp_sock, configs->udp_train_size, configs->udp_payload_size) < 0
+                || add_drop_count_opt(udp_sock) < 0) {
+            return -1;
+        }
+    }
+    // bind to specified port
+    struct sockaddr_in *my_addr_udp = set_addr_struct(INADDR_ANY, port);
+    if (bind_port(udp_sock, my_addr_udp) < 0) {
+        return -1;
+    }
+    free(my_addr_udp);
+
+    return udp_sock;
+}
+
+/**
+ * Opens the sockets for the hop markers: an unbound udp socket whose
+ * TTL is set per marker, and a raw icmp socket with kernel receive
+ * timestamps for the time exceeded replies
+ *
+ * configs: pointer to client_config struct
+ * markers: pointer to hop_markers struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int open_markers(struct client_config *configs, struct hop_markers *markers)
+{
+    memset(markers, 0, sizeof(struct hop_markers));
+    if ((markers->icmp_sockfd = create_icmp_socket()) < 0) {
+        return -1;
+    }
+    if (add_timestamp_opt(markers->icmp_sockfd) < 0) {
+        return -1;
+    }
+
+    if ((markers->sockfd = create_udp_socket()) < 0) {
+        return -1;
+    }
+    if (set_df_opt(markers->sockfd) < 0) {
+        return -1;
+    }
+    // any free port, the replies are told apart by it
+    struct sockaddr_in *my_addr = set_addr_struct(INADDR_ANY, 0);
+    if (bind_port(markers->sockfd, my_addr) < 0) {
+        return -1;
+    }
+    socklen_t len = sizeof(struct sockaddr_in);
+    if (getsockname(markers->sockfd, (struct sockaddr *) my_addr, &len) < 0) {
+        perror("Error getting marker port");
+        return -1;
+    }
+    markers->local_port = ntohs(my_addr->sin_port);
+    free(my_addr);
+
+    if ((markers->addr = set_addr_struct(configs->server_ip, 0)) == NULL) {
+        return -1;
+    }
+    markers->payload_size = configs->udp_payload_size;
+
+    return 1;
+}
+
+/**
+ * Folds a packet pair sample into the path estimate, using the
+ * RFC 6298 smoothing for the round trip time
+ *
+ * est: pointer to path_estimate struct
+ * rtt: round trip time of the first packet in the pair (ms)
+ * dispersion: arrival gap between the two echoes (ms)
+ */
+void update_estimate(struct path_estimate *est, double rtt, double dispersion)
+{
+    if (est->samples == 0) {
+        est->srtt = rtt;
+        est->rttvar = rtt / 2;
+        est->dispersion = dispersion;
+    } else {
+        est->rttvar = (1 - EWMA_GAIN / 2) * est->rttvar + (EWMA_GAIN / 2) * fabs(est->srtt - rtt);
+        est->srtt = (1 - EWMA_GAIN) * est->srtt + EWMA_GAIN * rtt;
+        est->dispersion = (1 - EWMA_GAIN) * est->dispersion + EWMA_GAIN * dispersion;
+    }
+    est->samples++;
+}
+
+/**
+ * Pre-flight check of the udp path. Sends a few packets for the
+ * server to echo and fails fast if none comes back, rather than
+ * sending full trains into a path that cannot be measured.
+ *
+ * configs: pointer to client_config struct
+ * udp_sock: bound udp socket file descriptor
+ *
+ * returns: 1 if an echo came back, -1 otherwise
+ */
+int preflight(struct client_config *configs, int udp_sock)
+{
+    struct sockaddr_in *serv_addr;
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
+    }
+    struct sockaddr_in recv_addr;
+
+    if (add_timeout_opt_milli(udp_sock, PREFLIGHT_TIMEOUT) < 0) {
+        return -1;
+    }
+
+    char *probe = create_high_entropy_payload(PREFLIGHT_ID, configs->udp_payload_size);
+    if (probe == NULL) {
+        return -1;
+    }
+
+    struct timeval sent, now;
+    gettimeofday(&sent, NULL);
+    for (int i = 0; i < PREFLIGHT_ECHOES; i++) {
+        if (send_packet(udp_sock, probe, configs->udp_payload_size, serv_addr) < 0) {
+            return -1;
+        }
+    }
+    free(probe);
+    free(serv_addr);
+
+    // the socket timeout bounds every read, the loop bounds the total
+    char *echo;
+    gettimeofday(&now, NULL);
+    while (time_diff_milli(now, sent) < PREFLIGHT_TIMEOUT
+            && (echo = receive_packet(udp_sock, &recv_addr)) != NULL) {
+        uint16_t id = (uint8_t) echo[0] << 8 | (uint8_t) echo[1];
+        free(echo);
+        gettimeofday(&now, NULL);
+        if (id == PREFLIGHT_ID) {
+            LOG("Pre-flight udp echo after %.3fms.\n", time_diff_micro(now, sent) / 1000);
+            return 1;
+        }
+    }
+
+    fprintf(stderr, "Pre-flight failed: no udp echo from %s:%d within %dms\n",
+            configs->server_ip, configs->udp_dest_port, PREFLIGHT_TIMEOUT);
+    return -1;
+}
+
+/**
+ * Calibration phase of compression detection. Sends back to back
+ * packet pairs that the server echoes, measuring the round trip time
+ * and the bottleneck dispersion of the path. The estimate is used to
+ * derive the server receive timeout and the inter train gap.
+ *
+ * configs: pointer to client_config struct, timing fields get updated
+ * est: pointer to path_estimate struct, kept across rounds
+ * udp_sock: bound udp socket file descriptor
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int calibrate(struct client_config *configs, struct path_estimate *est, int udp_sock)
+{
+    struct sockaddr_in *serv_addr;
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
+    }
+    struct sockaddr_in recv_addr;
+
+    if (add_timeout_opt_milli(udp_sock, CALIBRATION_TIMEOUT) < 0) {
+        return -1;
+    }
+
+    // pairs use high entropy payloads so a compressing link cannot
+    // make the drain time look shorter than it is
+    char *first = create_high_entropy_payload(0, configs->udp_payload_size);
+    char *second = create_high_entropy_payload(1, configs->udp_payload_size);
+    if (first == NULL || second == NULL) {
+        return -1;
+    }
+
+    int received = 0;
+    for (int p = 0; p < configs->calibration_pairs; p++) {
+        uint16_t first_id = 2 * p;
+        uint16_t second_id = 2 * p + 1;
+        set_packet_id(first, first_id);
+        set_packet_id(second, second_id);
+
+        struct timeval sent, first_arrival, second_arrival;
+        gettimeofday(&sent, NULL);
+        if (send_packet(udp_sock, first, configs->udp_payload_size, serv_addr) < 0
+                || send_packet(udp_sock, second, configs->udp_payload_size, serv_addr) < 0) {
+            return -1;
+        }
+
+        // wait for both echoes, ignoring late echoes of older pairs
+        bool got_first = false, got_second = false;
+        char *echo;
+        while (!(got_first && got_second)
+                && (echo = receive_packet(udp_sock, &recv_addr)) != NULL) {
+            uint16_t id = (uint8_t) echo[0] << 8 | (uint8_t) echo[1];
+            if (id == first_id) {
+                gettimeofday(&first_arrival, NULL);
+                got_first = true;
+            } else if (id == second_id) {
+                gettimeofday(&second_arrival, NULL);
+                got_second = true;
+            }
+            free(echo);
+        }
+
+        if (!(got_first && got_second)) {
+            LOG("Calibration pair %d lost.\n", p);
+            continue;
+        }
+
+        double rtt = time_diff_micro(first_arrival, sent) / 1000;
+        double dispersion = time_diff_micro(second_arrival, first_arrival) / 1000;
+        if (dispersion < 0) {
+            // echoes reordered, the gap is still the dispersion
+            dispersion = -dispersion;
+        }
+        update_estimate(est, rtt, dispersion);
+        received++;
+    }
+
+    free(first);
+    free(second);
+    free(serv_addr);
+
+    if (received == 0) {
+        LOGP("No calibration pairs returned, keeping configured timing.\n");
+        return 1;
+    }
+
+    // bottleneck time needed to drain a full train
+    double drain = configs->udp_train_size * est->dispersion;
+
+    // silence inside a train beyond the usual variation ends the train
+    double timeout = est->srtt + 4 * est->rttvar;
+    if (timeout < MIN_UDP_TIMEOUT) {
+        timeout = MIN_UDP_TIMEOUT;
+    }
+
+    // next train may only arrive once the previous one drained and the
+    // server had the chance to time out on a lossy tail, with one more
+    // timeout of headroom for packets still queued at the receiver
+    double gap = drain + est->srtt + 2 * timeout;
+
+    configs->udp_timeout_ms = (int) ceil(timeout);
+    configs->inter_measurement_ms = (int) ceil(gap);
+    configs->result_wait_ms = (int) ceil(gap + est->srtt);
+
+    LOG("Calibrated srtt %.3fms, rttvar %.3fms, dispersion %.3fms.\n",
+            est->srtt, est->rttvar, est->dispersion);
+    LOG("Calibrated udp timeout %dms, inter measurement time %dms.\n",
+            configs->udp_timeout_ms, configs->inter_measurement_ms);
+
+    return 1;
+}
+
+/**
+ * Reads and parses the config file
+ *
+ * filename: file to read and parse
+ * contents: filled with the raw file contents to send to the server
+ *
+ * returns: client_config struct if successful, NULL otherwise
+ */
+struct client_config* load_config(char *filename, char **contents)
+{
+    struct stat buf;
+    if (stat(filename, &buf) < 0) {
+        perror("Error retrieving file info");
+        return NULL;
+    }
+
+    // read in config file contents
+    char *config_contents = read_file(filename, buf.st_size);
+    if (config_contents == NULL) {
+        return NULL;
+    }
+
+    // parse config file
+    struct client_config *configs = malloc(sizeof(struct client_config));
+    parse_config(configs, config_contents);
+    if (configs->mode < 0 || (configs->mode == MODE_SWEEP && configs->level_count < 0)) {
+        return NULL;
+    }
+    if (configs->mode == MODE_SCAN) {
+        fprintf(stderr, "Mode not supported by the cooperative application\n");
+        return NULL;
+    }
+    if (configs->bidirectional && configs->mode != MODE_DETECT) {
+        fprintf(stderr, "Bidirectional sessions only support the detect mode\n");
+        return NULL;
+    }
+    if (configs->bidirectional < 0 || configs->bidirectional > 2) {
+        fprintf(stderr, "bidirectional must be 0, 1 or 2\n");
+        return NULL;
+    }
+    if (configs->flows < 1 || configs->flows > MAX_FLOWS
+            || configs->udp_source_port + configs->flows - 1 > 65535) {
+        fprintf(stderr, "flows must be between 1 and %d, with room for their source ports\n",
+                MAX_FLOWS);
+        return NULL;
+    }
+    if (configs->flows > 1 && (configs->mode != MODE_DETECT || configs->bidirectional)) {
+        fprintf(stderr, "Multiple flows only support one way detect sessions\n");
+        return NULL;
+    }
+    if (configs->train_tags && (configs->mode != MODE_DETECT || configs->flows > 1
+            || configs->bidirectional || configs->udp_payload_size < TRAIN_TAG_SIZE)) {
+        fprintf(stderr, "xdp_interface needs a one way detect session with %d byte payloads or more\n",
+                TRAIN_TAG_SIZE);
+        return NULL;
+    }
+    if (configs->mode == MODE_TCP && configs->tcp_bytes <= 0) {
+        fprintf(stderr, "tcp_bytes must be positive\n");
+        return NULL;
+    }
+    if (configs->mode == MODE_LOCALIZE && (configs->max_ttl < 1 || configs->max_ttl > MAX_HOPS)) {
+        fprintf(stderr, "max_ttl must be between 1 and %d\n", MAX_HOPS);
+        return NULL;
+    }
+    // pipelined trains share the 16 bit id space
+    int trains = configs->mode == MODE_DEDUP ? 3 : configs->level_count;
+    if (configs->flows > 1) {
+        trains = 2;
+    }
+    if (trains * configs->udp_train_size > 65536) {
+        fprintf(stderr, "Pipelined trains need trains * udp_train_size <= 65536\n");
+        return NULL;
+    }
+
+    *contents = config_contents;
+    return configs;
+}
+
+/**
+ * Thread process receiving the server's reverse trains
+ *
+ * arg: void pointer (preferably pointer to reverse_trains struct)
+ *
+ * returns: NULL
+ */
+void* reverse_routine(void *arg)
+{
+    struct reverse_trains *reverse = (struct reverse_trains *) arg;
+    reverse->received = receive_trains(reverse->sockfd, reverse->records, 2, reverse->train_size,
+                                        reverse->wait_ms, reverse->timeout_ms, 1, false);
+    return NULL;
+}
+
+/**
+ * Starts receiving the server's reverse trains. The server sends
+ * them while or after receiving ours, so the first one may take
+ * until our trains and the server's timeout are over to arrive.
+ *
+ * configs: pointer to client_config struct
+ * reverse: pointer to reverse_trains struct to fill
+ * udp_sock: bound udp socket file descriptor
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int start_reverse(struct client_config *configs, struct reverse_trains *reverse, int udp_sock)
+{
+    reverse->sockfd = udp_sock;
+    reverse->train_size = configs->udp_train_size;
+    reverse->wait_ms = 2 * configs->inter_measurement_ms + configs->result_wait_ms;
+    reverse->timeout_ms = configs->udp_timeout_ms;
+    reverse->received = 0;
+    for (int k = 0; k < 2; k++) {
+        if ((reverse->records[k] = create_train_record(configs->udp_train_size)) == NULL) {
+            return -1;
+        }
+    }
+
+    if (pthread_create(&reverse->thread, NULL, reverse_routine, reverse) != 0) {
+        perror("Error creating reverse thread");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Waits for the reverse trains and analyzes them like the server
+ * does ours
+ *
+ * configs: pointer to client_config struct
+ * reverse: pointer to reverse_trains struct
+ * result: filled with the server to client result
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int finish_reverse(struct client_config *configs, struct reverse_trains *reverse,
+                   struct compression_result *result)
+{
+    pthread_join(reverse->thread, NULL);
+    if (reverse->received < 0) {
+        return -1;
+    }
+    LOG("Reverse trains: %d of %d packets received.\n", reverse->received,
+        2 * configs->udp_train_size);
+
+    analyze_trains(reverse->records[0], reverse->records[1], configs->threshold,
+                   configs->ratio_threshold, result);
+    for (int k = 0; k < 2; k++) {
+        free_train_record(reverse->records[k]);
+    }
+    return 1;
+}
+
+/**
+ * Pre-probing phase of compression detection. Establishes a
+ * TCP connection, sends over file contents, and runs the pre-flight
+ * check and, if enabled, the calibration against the server's
+ * echoes. The connection stays open until the receive timeout has
+ * been sent to the server. For bidirectional sessions the reverse
+ * trains are listened for before that, since the server may start
+ * sending as soon as it has the timing.
+ *
+ * configs: pointer to client_config struct
+ * config_contents: file contents to send
+ * est: pointer to path_estimate struct, kept across rounds
+ * udp_sock: bound udp socket file descriptor
+ * reverse: pointer to reverse_trains struct, NULL unless bidirectional
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int pre_probing(struct client_config *configs, char *config_contents,
+                struct path_estimate *est, int udp_sock, struct reverse_trains *reverse)
+{
+    // create socket and establish connection, failing fast if the
+    // server does not answer
+    int tcp_sock;
+    if ((tcp_sock = create_tcp_socket()) < 0) {
+        return -1;
+    }
+    if (add_send_timeout_opt_milli(tcp_sock, PREFLIGHT_TIMEOUT) < 0
+            || add_timeout_opt_milli(tcp_sock, PREFLIGHT_TIMEOUT) < 0) {
+        return -1;
+    }
+    struct timeval start, connected;
+    gettimeofday(&start, NULL);
+    if ((tcp_sock = establish_connection(tcp_sock, configs->server_ip, configs->tcp_port)) < 0) {
+        fprintf(stderr, "Pre-flight failed: no tcp connection to %s:%d within %dms\n",
+                configs->server_ip, configs->tcp_port, PREFLIGHT_TIMEOUT);
+        return -1;
+    }
+    gettimeofday(&connected, NULL);
+    LOG("Pre-flight tcp connect after %.3fms.\n", time_diff_micro(connected, start) / 1000);
+
+    // send config data
+    if (send_message(tcp_sock, config_contents) < 0) {
+        return -1;
+    }
+
+    // wait until the server has its udp socket bound
+    char *ready = receive_stream(tcp_sock);
+    if (ready == NULL || strcmp(ready, "ready") != 0) {
+        fprintf(stderr, "Pre-flight failed: server did not get ready within %dms\n",
+                PREFLIGHT_TIMEOUT);
+        free(ready);
+        return -1;
+    }
+    free(ready);
+
+    if (preflight(configs, udp_sock) < 0) {
+        return -1;
+    }
+
+    if (configs->calibration_pairs > 0) {
+        if (calibrate(configs, est, udp_sock) < 0) {
+            return -1;
+        }
+    }
+
+    if (reverse != NULL && start_reverse(configs, reverse, udp_sock) < 0) {
+        return -1;
+    }
+
+    // end the server's echo phase and let it know what timing to use
+    cJSON *msg = cJSON_CreateObject();
+    char timeout[16];
+    snprintf(timeout, sizeof(timeout), "%d", configs->udp_timeout_ms);
+    cJSON_AddStringToObject(msg, "udp_timeout_ms", timeout);
+    char gap[16];
+    snprintf(gap, sizeof(gap), "%d", configs->inter_measurement_ms);
+    cJSON_AddStringToObject(msg, "inter_measurement_ms", gap);
+    char *text = cJSON_PrintUnformatted(msg);
+    if (send_message(tcp_sock, text) < 0) {
+        return -1;
+    }
+    free(text);
+    cJSON_Delete(msg);
+
+    LOGP("Config contents sent, closing TCP connection.\n");
+    if (close(tcp_sock) < 0) {
+        perror("Error closing tcp socket");
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Sends a marker that expires at the given ttl. The marker is a packet
+ * of its train, with the payload size and entropy of the train, so a
+ * compressor serves it like the train packets it brackets. The
+ * destination port encodes the slot and the ttl, which the time
+ * exceeded reply quotes back.
+ *
+ * markers: pointer to hop_markers struct
+ * slot: marker_slot value
+ * ttl: ttl of the marker
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_marker(struct hop_markers *markers, int slot, int ttl)
+{
+    char *payload;
+    if (slot == LOW_HEAD || slot == LOW_TAIL) {
+        payload = create_low_entropy_payload(0, markers->payload_size);
+    } else {
+        payload = create_high_entropy_payload(0, markers->payload_size);
+    }
+    if (payload == NULL) {
+        return -1;
+    }
+
+    if (add_ttl_opt(markers->sockfd, ttl) < 0) {
+        free(payload);
+        return -1;
+    }
+    markers->addr->sin_port = htons(MARKER_BASE_PORT + slot * MAX_HOPS + ttl - 1);
+    struct marker *m = &markers->markers[slot][ttl - 1];
+    gettimeofday(&m->sent_time, NULL);
+    m->sent = true;
+    if (send_packet(markers->sockfd, payload, markers->payload_size, markers->addr) < 0) {
+        free(payload);
+        return -1;
+    }
+
+    free(payload);
+    return 1;
+}
+
+/**
+ * Sends one marker for each router on the path
+ *
+ * markers: pointer to hop_markers struct
+ * slot: marker_slot value
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_markers(struct hop_markers *markers, int slot)
+{
+    for (int ttl = 1; ttl <= markers->hops; ttl++) {
+        if (send_marker(markers, slot, ttl) < 0) {
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Reads the next icmp reply to a marker, as stamped by the kernel on
+ * arrival, within the receive timeout of the icmp socket
+ *
+ * markers: pointer to hop_markers struct
+ * reply: probe_reply struct to fill
+ * stamp: filled with the arrival time
+ *
+ * returns: 1 if a reply arrived, -1 otherwise
+ */
+int next_marker_reply(struct hop_markers *markers, struct probe_reply *reply, struct timeval *stamp)
+{
+    char buf[RECV_BUFFER];
+    int len;
+    while ((len = receive_datagram_stamped(markers->icmp_sockfd, buf, RECV_BUFFER, stamp)) >= 0) {
+        if (parse_reply(buf, len, reply) != REPLY_NONE && reply->protocol == IPPROTO_UDP
+                && reply->local_port == markers->local_port
+                && reply->port >= MARKER_BASE_PORT
+                && reply->port < MARKER_BASE_PORT + MARKER_SLOTS * MAX_HOPS) {
+            return 1;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Counts the routers before the server, one ttl at a time like
+ * traceroute. Hosts rate limit port unreachable to a few messages a
+ * second, so only the routers get markers during the trains and the
+ * server is measured by its own timestamps.
+ *
+ * configs: pointer to client_config struct
+ * markers: pointer to hop_markers struct, hops gets filled
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int discover_path(struct client_config *configs, struct hop_markers *markers)
+{
+    if (add_timeout_opt_milli(markers->icmp_sockfd, CALIBRATION_TIMEOUT) < 0) {
+        return -1;
+    }
+
+    markers->hops = configs->max_ttl;
+    markers->reached = false;
+    for (int ttl = 1; ttl <= configs->max_ttl; ttl++) {
+        if (send_marker(markers, LOW_HEAD, ttl) < 0) {
+            return -1;
+        }
+
+        struct probe_reply reply;
+        struct timeval stamp;
+        bool answered = false;
+        while (!answered && next_marker_reply(markers, &reply, &stamp) > 0) {
+            answered = reply.port == MARKER_BASE_PORT + ttl - 1;
+        }
+        if (answered && reply.kind == REPLY_UNREACHABLE) {
+            markers->hops = ttl - 1;
+            markers->reached = true;
+            break;
+        }
+    }
+
+    LOG("%d routers before the server.\n", markers->hops);
+    return 1;
+}
+
+/**
+ * Reads the icmp replies to the markers, which the kernel stamped and
+ * queued as they arrived, until none arrived for wait_milli. Path
+ * discovery uses the same ports, so a late reply to one of its markers
+ * may still be queued. Replies stamped before their marker left are
+ * such leftovers and are skipped.
+ *
+ * markers: pointer to hop_markers struct
+ * wait_milli: ms without replies that ends collection
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int collect_markers(struct hop_markers *markers, int wait_milli)
+{
+    if (add_timeout_opt_milli(markers->icmp_sockfd, wait_milli) < 0) {
+        return -1;
+    }
+
+    struct probe_reply reply;
+    struct timeval stamp;
+    while (next_marker_reply(markers, &reply, &stamp) > 0) {
+        int index = reply.port - MARKER_BASE_PORT;
+        struct marker *m = &markers->markers[index / MAX_HOPS][index % MAX_HOPS];
+        if (!m->sent || time_diff_micro(stamp, m->sent_time) < 0) {
+            continue;
+        }
+        if (!m->answered) {
+            m->answered = true;
+            m->reply_time = stamp;
+            m->from = reply.from;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Turns the marker replies into a hop profile. The delta of a router
+ * is the gap between the replies to its head and tail markers, the
+ * server's own result closes the profile.
+ *
+ * configs: pointer to client_config struct
+ * markers: pointer to hop_markers struct
+ * server: pointer to the compression_result struct of the server
+ * profile: pointer to hop_profile struct to fill
+ */
+void build_profile(struct client_config *configs, struct hop_markers *markers,
+                    struct compression_result *server, struct hop_profile *profile)
+{
+    memset(profile, 0, sizeof(struct hop_profile));
+    long bytes = (long) configs->udp_train_size * configs->udp_payload_size;
+
+    for (int ttl = 1; ttl <= markers->hops; ttl++) {
+        struct marker *m[MARKER_SLOTS];
+        struct compression_result result;
+        init_result(&result);
+
+        bool answered = true;
+        for (int slot = 0; slot < MARKER_SLOTS; slot++) {
+            m[slot] = &markers->markers[slot][ttl - 1];
+            answered = answered && m[slot]->answered;
+        }
+
+        if (answered) {
+            result.valid = true;
+            result.low_delta = time_diff_micro(m[LOW_TAIL]->reply_time, m[LOW_HEAD]->reply_time) / 1000;
+            result.high_delta = time_diff_micro(m[HIGH_TAIL]->reply_time, m[HIGH_HEAD]->reply_time) / 1000;
+            result.low_bytes = bytes;
+            result.high_bytes = bytes;
+            judge_deltas(&result, configs->threshold, configs->ratio_threshold);
+        }
+        add_hop(profile, ttl, &result, m[LOW_HEAD]->from);
+    }
+
+    if (markers->reached) {
+        add_hop(profile, markers->hops + 1, server, markers->addr->sin_addr);
+    }
+    locate_hop(profile);
+}
+
+/**
+ * Probing phase of compression detection. Sends two sets of
+ * UDP packets back to back, one with low entropy and one with
+ * high entropy. When localizing, each train is bracketed by hop
+ * markers, so one pair of trains measures the delta at every hop.
+ *
+ * configs: pointer to client_config struct
+ * udp_sock: bound udp socket file descriptor
+ * markers: pointer to hop_markers struct, NULL when not localizing
+ * report: pointer to sender_report struct of 2 trains
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int probing(struct client_config *configs, int udp_sock, struct hop_markers *markers,
+            struct sender_report *report)
+{
+    // set up addr struct
+    struct sockaddr_in *serv_addr; 
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
+    }
+
+    if (markers != NULL) {
+        memset(markers->markers, 0, sizeof(markers->markers));
+        if (send_markers(markers, LOW_HEAD) < 0) {
+            return -1;
+        }
+    }
+
+    // low entropy train
+    char *payload;
+    start_sent_train(report, 0);
+    for (int i = 0; i < configs->udp_train_size; i++) {
+        payload = create_low_entropy_payload(i, configs->udp_payload_size);
+        if (payload == NULL) {
+            return -1;
+        }
+        if (configs->train_tags) {
+            set_train_tag(payload, 0);
+        }
+        // send low entropy packets
+        if (send_packet(udp_sock, payload, configs->udp_payload_size, serv_addr) < 0) {
+            return -1;
+        }
+        stamp_sent(report, 0, configs->udp_payload_size);
+        free(payload);
+    }
+    end_sent_train(report, 0);
+
+    if (markers != NULL && send_markers(markers, LOW_TAIL) < 0) {
+        return -1;
+    }
+
+    LOG("First train sent. Sleeping for %dms.\n", configs->inter_measurement_ms);
+    sleep_milli(configs->inter_measurement_ms);
+
+    if (markers != NULL && send_markers(markers, HIGH_HEAD) < 0) {
+        return -1;
+    }
+
+    // high entropy train
+    start_sent_train(report, 1);
+    for (int i = 0; i < configs->udp_train_size; i++) {
+        payload = create_high_entropy_payload(i, configs->udp_payload_size);
+        if (payload == NULL) {
+            return -1;
+        }
+        if (configs->train_tags) {
+            set_train_tag(payload, 1);
+        }
+        // send high entropy packets
+        if (send_packet(udp_sock, payload, configs->udp_payload_size, serv_addr) < 0) {
+            return -1;
+        }
+        stamp_sent(report, 1, configs->udp_payload_size);
+        free(payload);
+    }
+    end_sent_train(report, 1);
+
+    if (markers != NULL && send_markers(markers, HIGH_TAIL) < 0) {
+        return -1;
+    }
+
+    LOGP("Second train sent.\n");
+    free(serv_addr);
+
+    return 1;
+}
+
 /**
- * Parses JSON file for client specific configurations
+ * Sends a train of pre-generated payloads
  *
- * configs: client_config struct to fill
- * contents: json text to parse
+ * udp_sock: udp socket file descriptor
+ * serv_addr: pointer to sockaddr_in struct for server udp port
+ * train: payloads laid out back to back
+ * configs: pointer to client_config struct
+ * report: pointer to sender_report struct
+ * index: index of the train in the report
+ *
+ * returns: 1 if successful, -1 otherwise
  */
-void parse_config(struct client_config *configs, char *contents)
+int send_train(int udp_sock, struct sockaddr_in *serv_addr, char *train,
+                struct client_config *configs, struct sender_report *report, int index)
 {
-    cJSON *root = cJSON_Parse(contents);
-    configs->server_ip = cJSON_GetObjectItem(root, "server_ip")->valuestring;
-    configs->udp_dest_port = atoi(cJSON_GetObjectItem(root, "udp_dest_port")->valuestring);
-    configs->udp_source_port = atoi(cJSON_GetObjectItem(root, "udp_source_port")->valuestring);
-    configs->tcp_port = atoi(cJSON_GetObjectItem(root, "tcp_port")->valuestring);
-    configs->udp_payload_size = atoi(cJSON_GetObjectItem(root, "udp_payload_size")->valuestring);
-    configs->inter_measurement_time = atoi(cJSON_GetObjectItem(root, "inter_measurement_time")->valuestring);
-    configs->udp_train_size = atoi(cJSON_GetObjectItem(root, "udp_train_size")->valuestring);
-    configs->udp_timeout = atoi(cJSON_GetObjectItem(root, "udp_timeout")->valuestring);
-    configs->udp_ttl = atoi(cJSON_GetObjectItem(root, "udp_ttl")->valuestring);
+    for (int i = 0; i < configs->udp_train_size; i++) {
+        char *payload = train + (size_t) i * configs->udp_payload_size;
+        if (send_packet(udp_sock, payload, configs->udp_payload_size, serv_addr) < 0) {
+            return -1;
+        }
+        stamp_sent(report, index, configs->udp_payload_size);
+    }
+
+    return 1;
 }
 
 /**
- * Pre-probing phase of compression detection. Establishes a
- * TCP connection and sends over file contents.
+ * Sweep probing phase. Sends one train per entropy level, separated
+ * by the inter measurement gap, with ids numbered on from one train
+ * to the next so the server can tell the trains apart. Payloads are
+ * generated before each train so the send loop only sends.
  *
- * filename: file to read, parse, and send
+ * configs: pointer to client_config struct
+ * udp_sock: bound udp socket file descriptor
+ * report: pointer to sender_report struct of one train per level
  *
- * returns: client_config struct if successful, NULL otherwise
+ * returns: 1 if successful, -1 otherwise
  */
-struct client_config* pre_probing(char *filename)
+int sweep_probing(struct client_config *configs, int udp_sock, struct sender_report *report)
 {
-    struct stat buf;
-    if (stat(filename, &buf) < 0) {
-        perror("Error retrieving file info");
-        return NULL;
+    struct sockaddr_in *serv_addr; 
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
     }
 
-    // read in config file contents
-    char *config_contents = read_file(filename, buf.st_size);
-    if (config_contents == NULL) {
-        return NULL;
+    for (int k = 0; k < configs->level_count; k++) {
+        if (k > 0) {
+            sleep_milli(configs->inter_measurement_ms);
+        }
+
+        char *train = create_entropy_train(k * configs->udp_train_size, configs->udp_train_size,
+                                            configs->udp_payload_size, configs->levels[k]);
+        if (train == NULL) {
+            return -1;
+        }
+        start_sent_train(report, k);
+        if (send_train(udp_sock, serv_addr, train, configs, report, k) < 0) {
+            return -1;
+        }
+        end_sent_train(report, k);
+        free(train);
+
+        LOG("Train with %d bits of entropy sent.\n", configs->levels[k]);
     }
 
-    // parse config file
-    struct client_config *configs = malloc(sizeof(struct client_config));
-    parse_config(configs, config_contents);
+    free(serv_addr);
 
-    // create socket and establish connection
-    int tcp_sock;
-    if ((tcp_sock = create_tcp_socket()) < 0) {
-        return NULL;
+    return 1;
+}
+
+/**
+ * Deduplication probing phase. Sends a train of unique random
+ * payloads, a train repeating one random payload, and a low entropy
+ * train, numbered on like the sweep trains.
+ *
+ * configs: pointer to client_config struct
+ * udp_sock: bound udp socket file descriptor
+ * report: pointer to sender_report struct of 3 trains
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int dedup_probing(struct client_config *configs, int udp_sock, struct sender_report *report)
+{
+    struct sockaddr_in *serv_addr; 
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
     }
-    if ((tcp_sock = establish_connection(tcp_sock, configs->server_ip, configs->tcp_port)) < 0) {
-        return NULL;
+
+    int n = configs->udp_train_size;
+    for (int k = 0; k < 3; k++) {
+        if (k > 0) {
+            sleep_milli(configs->inter_measurement_ms);
+        }
+
+        char *train;
+        if (k == 0) {
+            train = create_entropy_train(0, n, configs->udp_payload_size, 8);
+        } else if (k == 1) {
+            train = create_repeated_train(n, n, configs->udp_payload_size);
+        } else {
+            train = create_entropy_train(2 * n, n, configs->udp_payload_size, 0);
+        }
+        if (train == NULL) {
+            return -1;
+        }
+        start_sent_train(report, k);
+        if (send_train(udp_sock, serv_addr, train, configs, report, k) < 0) {
+            return -1;
+        }
+        end_sent_train(report, k);
+        free(train);
+
+        LOG("Deduplication train %d sent.\n", k);
     }
 
-    // send config data
-    if (send_stream(tcp_sock, config_contents) < 0) {
-        return NULL;
+    free(serv_addr);
+
+    return 1;
+}
+
+/**
+ * Streams one bulk transfer over a connected socket, sampling the
+ * sender's tcp_info until the server has read all of it and closed
+ * its side. Waiting for the close gives up once the send queue has not
+ * shrunk for udp_timeout seconds, in case the server or the path went
+ * away.
+ *
+ * configs: pointer to client_config struct
+ * sock: tcp socket connected to the server
+ * data: bytes to send
+ * stats: pointer to tcp_stats struct to fill
+ * report: pointer to sender_report struct
+ * index: index of the transfer in the report
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int stream_bulk(struct client_config *configs, int sock, char *data, struct tcp_stats *stats,
+                struct sender_report *report, int index)
+{
+    struct tcp_sampler sampler;
+    init_tcp_sampler(&sampler, sock, true);
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    long sent = 0;
+    while (sent < configs->tcp_bytes) {
+        long left = configs->tcp_bytes - sent;
+        int bytes = send(sock, data + sent, left < TCP_CHUNK ? left : TCP_CHUNK, 0);
+        if (bytes < 0) {
+            perror("Error sending bulk transfer");
+            return -1;
+        }
+        sent += bytes;
+        stamp_sent(report, index, bytes);
+        sample_tcp(&sampler, false);
     }
-    
-    LOGP("Config contents sent, closing TCP connection.\n");
-    if (close(tcp_sock) < 0) {
-        perror("Error closing tcp socket");
-        return NULL;
+    if (shutdown(sock, SHUT_WR) < 0) {
+        perror("Error shutting down bulk transfer");
+        return -1;
     }
-    free(config_contents);
 
-    return configs;
+    // the send buffer drains after the last send, keep sampling until
+    // the server closes its side
+    if (add_timeout_opt_milli(sock, TCP_SAMPLE_INTERVAL) < 0) {
+        return -1;
+    }
+    int queued = -1;
+    struct timeval progress, now;
+    gettimeofday(&progress, NULL);
+    char byte;
+    int bytes;
+    while ((bytes = recv(sock, &byte, 1, 0)) != 0) {
+        if (bytes < 0 && errno != EAGAIN) {
+            perror("Error waiting for the server to close");
+            return -1;
+        }
+        sample_tcp(&sampler, true);
+
+        gettimeofday(&now, NULL);
+        int unacked;
+        if (ioctl(sock, SIOCOUTQ, &unacked) == 0 && (queued < 0 || unacked < queued)) {
+            queued = unacked;
+            progress = now;
+        } else if (time_diff_sec(now, progress) > configs->udp_timeout) {
+            fprintf(stderr, "Server did not close the bulk transfer within %ds\n",
+                    configs->udp_timeout);
+            return -1;
+        }
+    }
+    gettimeofday(&end, NULL);
+
+    stats->bytes = sent;
+    stats->duration = time_diff_micro(end, start) / 1000;
+    return finish_tcp_stats(&sampler, stats);
 }
 
 /**
- * Probing phase of compression detection. Sends two sets of
- * UDP packets back to back, one with low entropy and one with
- * high entropy.
+ * Streams one bulk transfer to the server over a new connection
  *
  * configs: pointer to client_config struct
+ * data: bytes to send
+ * stats: pointer to tcp_stats struct to fill
+ * report: pointer to sender_report struct
+ * index: index of the transfer in the report
  *
  * returns: 1 if successful, -1 otherwise
  */
-int probing(struct client_config *configs)
+int send_bulk(struct client_config *configs, char *data, struct tcp_stats *stats,
+              struct sender_report *report, int index)
 {
-    int udp_sock;
-    if ((udp_sock = create_udp_socket()) < 0) {
+    init_tcp_stats(stats);
+    int sock;
+    if ((sock = create_tcp_socket()) < 0) {
+        return -1;
+    }
+    if (establish_connection(sock, configs->server_ip, configs->tcp_port) < 0) {
+        close(sock);
         return -1;
     }
 
-    // set DF bit
-    if (set_df_opt(udp_sock) < 0) {
+    int status = stream_bulk(configs, sock, data, stats, report, index);
+    if (close(sock) < 0) {
+        perror("Error closing bulk socket");
         return -1;
     }
-    // add TTL opt
-    if (add_ttl_opt(udp_sock, configs->udp_ttl) < 0) {
+    return status;
+}
+
+/**
+ * TCP probing phase. Streams a low and a high entropy bulk transfer
+ * to the server, separated by the inter measurement gap. The data is
+ * generated up front so the transfers run at the speed of the path.
+ *
+ * configs: pointer to client_config struct
+ * result: pointer to tcp_result struct, sender stats get filled
+ * report: pointer to sender_report struct of 2 transfers
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int tcp_probing(struct client_config *configs, struct tcp_result *result,
+                struct sender_report *report)
+{
+    char *data = malloc(configs->tcp_bytes);
+    if (data == NULL) {
+        perror("Error mallocing bulk data");
         return -1;
     }
-    // bind to specified port
-    struct sockaddr_in *my_addr_udp = set_addr_struct(INADDR_ANY, configs->udp_source_port);
-    if (bind_port(udp_sock, my_addr_udp) < 0) {
+    uint32_t state = random_seed();
+
+    fill_entropy(data, configs->tcp_bytes, 0, &state);
+    start_sent_train(report, 0);
+    if (send_bulk(configs, data, &result->low_sender, report, 0) < 0) {
+        free(data);
         return -1;
     }
+    end_sent_train(report, 0);
+    LOG("Low entropy transfer sent. Sleeping for %dms.\n", configs->inter_measurement_ms);
+    sleep_milli(configs->inter_measurement_ms);
 
-    // set up addr struct
-    struct sockaddr_in *serv_addr; 
-    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+    fill_entropy(data, configs->tcp_bytes, 8, &state);
+    start_sent_train(report, 1);
+    if (send_bulk(configs, data, &result->high_sender, report, 1) < 0) {
+        free(data);
         return -1;
     }
+    end_sent_train(report, 1);
+    LOGP("High entropy transfer sent.\n");
 
-    // low entropy train
-    char *payload;
+    free(data);
+    return 1;
+}
+
+/**
+ * Sends one train of a flow, yielding after every packet. When the
+ * flows share fewer cores than there are flows, the trains then
+ * interleave packet by packet rather than going out one after another
+ * in whatever order the threads get scheduled.
+ *
+ * flow: pointer to flow_sender struct
+ * k: 0 for the low entropy train, 1 for the high entropy train
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_flow_train(struct flow_sender *flow, int k)
+{
+    struct client_config *configs = flow->configs;
+    int index = 2 * flow->index + k;
+    start_sent_train(flow->report, index);
     for (int i = 0; i < configs->udp_train_size; i++) {
-        payload = create_low_entropy_payload(i, configs->udp_payload_size);
-        if (payload == NULL) {
-            return -1;
-        }
-        // send low entropy packets
-        if (send_packet(udp_sock, payload, configs->udp_payload_size, serv_addr) < 0) {
+        char *payload = flow->trains[k] + (size_t) i * configs->udp_payload_size;
+        if (send_packet(flow->sockfd, payload, configs->udp_payload_size, flow->serv_addr) < 0) {
             return -1;
         }
+        stamp_sent(flow->report, index, configs->udp_payload_size);
+        sched_yield();
     }
+    end_sent_train(flow->report, index);
 
-    LOG("First train sent. Sleeping for %ds.\n", configs->inter_measurement_time);
-    sleep(configs->inter_measurement_time);
+    return 1;
+}
 
-    // high entropy train
-    for (int i = 0; i < configs->udp_train_size; i++) {
-        payload = create_high_entropy_payload(i, configs->udp_payload_size);
-        if (payload == NULL) {
+/**
+ * Thread process sending the trains of one flow
+ *
+ * arg: void pointer (preferably pointer to flow_sender struct)
+ *
+ * returns: NULL if successful, non-NULL otherwise
+ */
+void* flow_routine(void *arg)
+{
+    struct flow_sender *flow = (struct flow_sender *) arg;
+    pthread_barrier_wait(flow->start);
+
+    if (send_flow_train(flow, 0) < 0) {
+        return arg;
+    }
+    sleep_milli(flow->configs->inter_measurement_ms);
+    pthread_barrier_wait(flow->start);
+    if (send_flow_train(flow, 1) < 0) {
+        return arg;
+    }
+
+    return NULL;
+}
+
+/**
+ * Multi-flow probing phase. Sends the low and high entropy trains of
+ * every flow at the same time, each flow from its own thread and
+ * source port so that ECMP routers may hash the flows onto different
+ * paths. The ids are numbered on from the low to the high train, and
+ * every packet is tagged with its flow.
+ *
+ * configs: pointer to client_config struct
+ * udp_sock: bound udp socket file descriptor, used by the first flow
+ * report: pointer to sender_report struct, low and high train of each flow
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int flows_probing(struct client_config *configs, int udp_sock, struct sender_report *report)
+{
+    struct sockaddr_in *serv_addr;
+    if ((serv_addr = set_addr_struct(configs->server_ip, configs->udp_dest_port)) == NULL) {
+        return -1;
+    }
+
+    int n = configs->udp_train_size;
+    struct flow_sender flows[MAX_FLOWS];
+    for (int i = 0; i < configs->flows; i++) {
+        flows[i].configs = configs;
+        flows[i].serv_addr = serv_addr;
+        flows[i].sockfd = udp_sock;
+        flows[i].index = i;
+        flows[i].report = report;
+        if (i > 0 && (flows[i].sockfd = open_udp_socket(configs, configs->udp_source_port + i)) < 0) {
             return -1;
         }
-        // send high entropy packets
-        if (send_packet(udp_sock, payload, configs->udp_payload_size, serv_addr) < 0) {
+        for (int k = 0; k < 2; k++) {
+            flows[i].trains[k] = create_entropy_train(k * n, n, configs->udp_payload_size, k == 0 ? 0 : 8);
+            if (flows[i].trains[k] == NULL) {
+                return -1;
+            }
+            for (int j = 0; j < n; j++) {
+                set_flow_tag(flows[i].trains[k] + (size_t) j * configs->udp_payload_size, i);
+            }
+        }
+    }
+
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, configs->flows);
+    for (int i = 0; i < configs->flows; i++) {
+        flows[i].start = &start;
+        if (pthread_create(&flows[i].thread, NULL, flow_routine, &flows[i]) != 0) {
+            perror("Error creating flow thread");
             return -1;
         }
     }
 
-    LOGP("Second train sent.\n");
-    free(payload);
+    int status = 1;
+    for (int i = 0; i < configs->flows; i++) {
+        void *flow_status;
+        pthread_join(flows[i].thread, &flow_status);
+        if (flow_status != NULL) {
+            status = -1;
+        }
+        free(flows[i].trains[0]);
+        free(flows[i].trains[1]);
+        if (i > 0) {
+            close(flows[i].sockfd);
+        }
+    }
+    pthread_barrier_destroy(&start);
+    free(serv_addr);
 
-    // close socket
-    if (close(udp_sock) < 0) {
-        perror("Error closing udp socket");
-        return -1;
+    LOG("Trains of %d flows sent.\n", configs->flows);
+    return status;
+}
+
+/**
+ * Sends the trains of the configured mode
+ *
+ * sender: pointer to sender_thread struct, status gets filled
+ */
+void send_probes(struct sender_thread *sender)
+{
+    struct client_config *configs = sender->configs;
+    struct sender_report *report = &sender->report;
+    int n = configs->udp_train_size;
+    if (configs->mode == MODE_SWEEP) {
+        sender->status = init_sender_report(report, configs->level_count, n);
+        if (sender->status > 0) {
+            sender->status = sweep_probing(configs, sender->udp_sock, report);
+        }
+    } else if (configs->mode == MODE_DEDUP) {
+        sender->status = init_sender_report(report, 3, n);
+        if (sender->status > 0) {
+            sender->status = dedup_probing(configs, sender->udp_sock, report);
+        }
+    } else if (configs->mode == MODE_TCP) {
+        // sends may come back short, those past the full chunks go untimed
+        sender->status = init_sender_report(report, 2, 2 * (configs->tcp_bytes / TCP_CHUNK + 1));
+        if (sender->status > 0) {
+            sender->status = tcp_probing(configs, sender->tcp, report);
+        }
+    } else if (configs->flows > 1) {
+        sender->status = init_sender_report(report, 2 * configs->flows, n);
+        if (sender->status > 0) {
+            sender->status = flows_probing(configs, sender->udp_sock, report);
+        }
+    } else {
+        sender->status = init_sender_report(report, 2, n);
+        if (sender->status > 0) {
+            sender->status = probing(configs, sender->udp_sock, sender->markers, report);
+        }
     }
+}
 
-    return 1;
+/**
+ * Thread process sending the trains, pinned and scheduled as
+ * configured. Flow threads it starts inherit both.
+ *
+ * arg: void pointer (preferably pointer to sender_thread struct)
+ *
+ * returns: NULL
+ */
+void* sender_routine(void *arg)
+{
+    struct sender_thread *sender = (struct sender_thread *) arg;
+    if (set_thread_realtime(sender->configs->sender_cpu, sender->configs->sched_fifo) < 0) {
+        init_sender_report(&sender->report, 0, 0);
+        sender->status = -1;
+        return NULL;
+    }
+    send_probes(sender);
+    return NULL;
 }
 
 /**
@@ -179,10 +1457,15 @@ int probing(struct client_config *configs)
  * TCP connection and receives compression status from server.
  *
  * configs: pointer to client_config struct
+ * json: print the results as json
+ * result: filled with the server's result in detect and localize mode
+ * reverse: server to client result, NULL unless bidirectional
+ * tcp: pointer to tcp_result struct with the sender stats in tcp mode
  *
  * returns: 1 if successful, -1 otherwise
  */
-int post_probing(struct client_config *configs)
+int post_probing(struct client_config *configs, bool json, struct compression_result *result,
+                 struct compression_result *reverse, struct tcp_result *tcp)
 {
     // create socket and establish connection
     int tcp_sock;
@@ -196,10 +1479,46 @@ int post_probing(struct client_config *configs)
 
     // receive compression detection results
     char *msg;
-    if ((msg = receive_stream(tcp_sock)) == NULL) {
+    if ((msg = receive_stream_all(tcp_sock)) == NULL) {
         return -1;
     }
-    printf("%s\n", msg);
+    if (configs->mode == MODE_SWEEP) {
+        struct sweep_result sweep;
+        if (sweep_from_json(&sweep, msg) < 0) {
+            return -1;
+        }
+        print_sweep(&sweep, json);
+    } else if (configs->mode == MODE_DEDUP) {
+        struct dedup_result dedup;
+        if (dedup_from_json(&dedup, msg) < 0) {
+            return -1;
+        }
+        print_dedup(&dedup, json);
+    } else if (configs->mode == MODE_TCP) {
+        struct tcp_result receiver;
+        if (tcp_from_json(&receiver, msg) < 0) {
+            return -1;
+        }
+        receiver.low_sender = tcp->low_sender;
+        receiver.high_sender = tcp->high_sender;
+        *tcp = receiver;
+        print_tcp(tcp, json);
+    } else if (configs->flows > 1) {
+        struct flow_result flows;
+        if (flows_from_json(&flows, msg) < 0) {
+            return -1;
+        }
+        print_flows(&flows, json);
+    } else {
+        if (result_from_json(result, msg) < 0) {
+            return -1;
+        }
+        if (reverse != NULL) {
+            print_directions(result, reverse, json);
+        } else {
+            print_result(result, json);
+        }
+    }
     free(msg);
 
     // close socket
@@ -215,32 +1534,125 @@ int main(int argc, char *argv[])
 {
     // check that config file is provided
     if (argc < 2) {
-        fprintf(stderr, "Usage: %s config_file.json\n", argv[0]);
+        fprintf(stderr, "Usage: %s config_file.json [--json]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
     char *filename = argv[1];
+    bool json = argc > 2 && strcmp(argv[2], "--json") == 0;
 
-    // ---- pre probing phase ----
+    char *config_contents;
     struct client_config *configs;
-    if ((configs = pre_probing(filename)) == NULL) {
+    if ((configs = load_config(filename, &config_contents)) == NULL) {
         return EXIT_FAILURE;
     }
 
-    // ---- probing phase ----
-    sleep(1); // ready for UDP
-    if (probing(configs) < 0 ) {
+    if (configs->mlock && lock_memory() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    int udp_sock;
+    if ((udp_sock = open_udp_socket(configs, configs->udp_source_port)) < 0) {
         return EXIT_FAILURE;
     }
-    // ensure server opens TCP
-    sleep(configs->udp_timeout + 1);
 
-    // ---- post probing phase ----
-    if (post_probing(configs) < 0) {
+    // hop markers when localizing the compressing hop
+    struct hop_markers markers;
+    struct hop_markers *hop_markers = NULL;
+    if (configs->mode == MODE_LOCALIZE) {
+        if (open_markers(configs, &markers) < 0) {
+            return EXIT_FAILURE;
+        }
+        hop_markers = &markers;
+        if (discover_path(configs, hop_markers) < 0) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    // path estimate carries over between rounds
+    struct path_estimate est;
+    memset(&est, 0, sizeof(est));
+
+    for (int round = 0; round < configs->rounds; round++) {
+        if (round > 0) {
+            // give the server time to get back to listening
+            sleep_milli(configs->inter_measurement_ms);
+        }
+
+        // ---- pre probing phase ----
+        struct reverse_trains reverse_trains;
+        struct reverse_trains *reverse = configs->bidirectional ? &reverse_trains : NULL;
+        if (pre_probing(configs, config_contents, &est, udp_sock, reverse) < 0) {
+            return EXIT_FAILURE;
+        }
+
+        // ---- probing phase ----
+        struct tcp_result tcp;
+        struct sender_thread sender = {
+            .configs = configs,
+            .udp_sock = udp_sock,
+            .markers = hop_markers,
+            .tcp = &tcp,
+        };
+        // a dedicated sender thread keeps pinning and priority off the rest
+        if (configs->sender_cpu >= 0 || configs->sched_fifo) {
+            if (pthread_create(&sender.thread, NULL, sender_routine, &sender) != 0) {
+                perror("Error creating sender thread");
+                return EXIT_FAILURE;
+            }
+            pthread_join(sender.thread, NULL);
+        } else {
+            send_probes(&sender);
+        }
+        if (sender.status < 0) {
+            return EXIT_FAILURE;
+        }
+        struct compression_result reverse_result;
+        if (reverse != NULL && finish_reverse(configs, reverse, &reverse_result) < 0) {
+            return EXIT_FAILURE;
+        }
+        // ensure server opens TCP
+        sleep_milli(configs->result_wait_ms);
+
+        // ---- post probing phase ----
+        struct compression_result result;
+        if (post_probing(configs, json, &result, reverse != NULL ? &reverse_result : NULL,
+                         &tcp) < 0) {
+            return EXIT_FAILURE;
+        }
+        if (hop_markers != NULL) {
+            if (collect_markers(hop_markers, MARKER_DRAIN_TIMEOUT) < 0) {
+                return EXIT_FAILURE;
+            }
+            struct hop_profile profile;
+            build_profile(configs, hop_markers, &result, &profile);
+            print_hops(&profile, json);
+        }
+        // only detect and localize runs get a delta back, and tcp
+        // sends block on the congestion window rather than stall
+        bool measured = (configs->mode == MODE_DETECT || configs->mode == MODE_LOCALIZE)
+                        && configs->flows <= 1;
+        if (configs->mode != MODE_TCP) {
+            check_stalls(&sender.report, measured ? &result : NULL, configs->threshold);
+        }
+        print_sender(&sender.report, json);
+        free_sender_report(&sender.report);
+    }
+
+    if (hop_markers != NULL) {
+        close(markers.sockfd);
+        close(markers.icmp_sockfd);
+        free(markers.addr);
+    }
+
+    // close socket
+    if (close(udp_sock) < 0) {
+        perror("Error closing udp socket");
         return EXIT_FAILURE;
     }
 
     // free config structure data
+    free(config_contents);
     free(configs);
 
     return EXIT_SUCCESS;
@@ -10,22 +10,50 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/time.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 #include "cJSON.h"
+#include "analysis.h"
 #include "sockets.h"
 #include "util.h"
+#include "xdp.h"
 #include "logger.h"
 
 #define RECV_BUFFER 1024
+#define HANDSHAKE_TIMEOUT 5000      // ms of client silence that aborts the handshake
+#define TCP_CHUNK 65536             // bytes read per call during a bulk transfer
+#define AGGREGATE_POLL 1            // ms between reads of the train aggregates
 
 struct server_config {
     uint16_t udp_dest_port;
+    int udp_payload_size;
     int udp_train_size;
     int udp_timeout;
     int threshold;
+    double ratio_threshold;
+    int mode;
+    int levels[MAX_ENTROPY_LEVELS];     // sweep entropy levels
+    int level_count;
+    int udp_timeout_ms;     // receive timeout once a train has started
+    int inter_measurement_ms;   // gap between the reverse trains
+    int bidirectional;      // 1 to send reverse trains alongside the client's, 2 after them
+    int flows;              // concurrent flows, each from its own source port
+    bool udp_gro;           // let the kernel coalesce the trains' datagrams
+    int busy_poll;          // us the socket busy polls the device for, 0 to sleep on the socket
+    int receiver_cpu;       // cpu to pin the receiving thread to, -1 to leave it
+    char *xdp_interface;    // interface to aggregate the trains on in the kernel, NULL to receive them
+    struct xdp_aggregator aggregator;
+    int udp_sock;           // probing socket, opened during pre-probing
+    int listen_sock;        // tcp socket kept listening for bulk transfers, -1 otherwise
+    int client_sock;        // tcp connection of the handshake, -1 once it is closed
+    struct sockaddr_in client_addr;     // where the handshake echoes went
+    bool client_known;
 };
 
 /**
@@ -33,63 +61,377 @@ struct server_config {
  *
  * configs: server_config struct to fill
  * contents: json text to parse
+ *
+ * returns: 1 if successful, -1 if the text is not json or lacks a required key
  */
-void parse_config(struct server_config *configs, char *contents)
+int parse_config(struct server_config *configs, char *contents)
 {
     cJSON *root = cJSON_Parse(contents);
+    if (root == NULL) {
+        fprintf(stderr, "Config is not valid json\n");
+        return -1;
+    }
+    char *required[] = { "udp_dest_port", "udp_payload_size", "udp_train_size",
+                         "udp_timeout", "threshold" };
+    for (size_t i = 0; i < sizeof(required) / sizeof(required[0]); i++) {
+        cJSON *item = cJSON_GetObjectItem(root, required[i]);
+        if (item == NULL || item->valuestring == NULL) {
+            fprintf(stderr, "Config lacks the %s key\n", required[i]);
+            cJSON_Delete(root);
+            return -1;
+        }
+    }
+
     configs->udp_dest_port = atoi(cJSON_GetObjectItem(root, "udp_dest_port")->valuestring);
+    configs->udp_payload_size = atoi(cJSON_GetObjectItem(root, "udp_payload_size")->valuestring);
     configs->udp_train_size = atoi(cJSON_GetObjectItem(root, "udp_train_size")->valuestring);
     configs->udp_timeout = atoi(cJSON_GetObjectItem(root, "udp_timeout")->valuestring);
     configs->threshold = atoi(cJSON_GetObjectItem(root, "threshold")->valuestring);
+    configs->ratio_threshold = get_config_double(root, "ratio_threshold", 0);
+    configs->mode = get_config_mode(root);
+    configs->level_count = 0;
+    if (configs->mode == MODE_SWEEP) {
+        configs->level_count = get_config_levels(root, configs->levels);
+    }
+    configs->udp_timeout_ms = configs->udp_timeout * 1000;
+    configs->inter_measurement_ms = get_config_int(root, "inter_measurement_time", 1) * 1000;
+    configs->bidirectional = get_config_int(root, "bidirectional", 0);
+    configs->flows = get_config_int(root, "flows", 1);
+    configs->udp_gro = get_config_int(root, "udp_gro", 0);
+    configs->busy_poll = get_config_int(root, "busy_poll", 0);
+    configs->receiver_cpu = get_config_int(root, "receiver_cpu", -1);
+    configs->xdp_interface = get_config_string(root, "xdp_interface", NULL);
+    configs->client_known = false;
+    return 1;
+}
+
+/**
+ * Creates the udp probing socket and binds it to the configured port
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: udp socket file descriptor if successful, -1 otherwise
+ */
+int open_udp_socket(struct server_config *configs)
+{
+    int udp_sock;
+    if ((udp_sock = create_udp_socket()) < 0) {
+        return -1;
+    }
+
+    // room for every train running at once, and their drop counts
+    if (set_receive_buffer(udp_sock, configs->flows * configs->udp_train_size,
+                           configs->udp_payload_size) < 0) {
+        return -1;
+    }
+    if (add_drop_count_opt(udp_sock) < 0) {
+        return -1;
+    }
+    // kernel arrival times tell how long reads take to wake up
+    if (add_timestamp_opt(udp_sock) < 0) {
+        return -1;
+    }
+    if (configs->busy_poll > 0 && add_busy_poll_opt(udp_sock, configs->busy_poll) < 0) {
+        return -1;
+    }
+
+    // set up addr struct and bind port
+    struct sockaddr_in *my_addr = set_addr_struct(INADDR_ANY, configs->udp_dest_port);
+    if (bind_port(udp_sock, my_addr) < 0) {
+        return -1;
+    }
+    free(my_addr);
+
+    return udp_sock;
+}
+
+/**
+ * Handshake of compression detection. Tells the client the udp socket
+ * is bound, then echoes every udp packet straight back until the
+ * client ends the handshake over TCP with the receive timeout to use.
+ * The echoes serve the client's pre-flight check and its calibration
+ * pairs, which it times for the round trip time and pair dispersion.
+ * They also tell the server where to send reverse trains to.
+ *
+ * configs: pointer to server_config struct, timing fields get updated
+ * client_sock: open tcp connection to the client
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int handshake(struct server_config *configs, int client_sock)
+{
+    // udp socket is bound, client may start sending
+    if (send_stream(client_sock, "ready") < 0) {
+        return -1;
+    }
+
+    struct pollfd fds[2];
+    fds[0].fd = configs->udp_sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = client_sock;
+    fds[1].events = POLLIN;
+
+    struct sockaddr_in recv_addr;
+    char *payload;
+    while (true) {
+        int ready;
+        if ((ready = poll(fds, 2, HANDSHAKE_TIMEOUT)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error polling handshake sockets");
+            return -1;
+        }
+        if (ready == 0) {
+            fprintf(stderr, "Client went silent during the handshake\n");
+            return -1;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            if ((payload = receive_packet(configs->udp_sock, &recv_addr)) == NULL) {
+                return -1;
+            }
+            // echo back at full size so a pair disperses on the way back too
+            int echo_size = configs->udp_payload_size < RECV_BUFFER ? configs->udp_payload_size : RECV_BUFFER;
+            if (send_packet(configs->udp_sock, payload, echo_size, &recv_addr) < 0) {
+                return -1;
+            }
+            free(payload);
+            configs->client_addr = recv_addr;
+            configs->client_known = true;
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            break;
+        }
+    }
+
+    // receive calibrated timing
+    char *msg;
+    if ((msg = receive_message(client_sock)) == NULL) {
+        return -1;
+    }
+    cJSON *root = cJSON_Parse(msg);
+    configs->udp_timeout_ms = get_config_int(root, "udp_timeout_ms", configs->udp_timeout_ms);
+    configs->inter_measurement_ms = get_config_int(root, "inter_measurement_ms",
+                                                    configs->inter_measurement_ms);
+    cJSON_Delete(root);
+    free(msg);
+
+    LOG("Udp timeout: %dms\n", configs->udp_timeout_ms);
+
+    return 1;
 }
 
 /**
  * Pre-probing phase of compression detection. Accepts a
- * TCP connection and receives configuration data.
+ * TCP connection and receives configuration data. Opens the
+ * udp probing socket and runs the handshake. Sockets go into the
+ * config as they are opened, so close_session() closes them on
+ * failure too.
  *
  * listen_port: port to listen on 
+ * configs: server_config struct set up with init_session, to fill
  *
- * returns: server_config struct if successful, NULL otherwise
+ * returns: 1 if successful, -1 otherwise
  */
-struct server_config* pre_probing(uint16_t listen_port)
+int pre_probing(uint16_t listen_port, struct server_config *configs)
 {
     // bind port and accept client connection
-    int tcp_sock;
-    if ((tcp_sock = create_tcp_socket()) < 0) {
-        return NULL;
+    if ((configs->listen_sock = create_tcp_socket()) < 0) {
+        return -1;
     }
 
-    if (bind_and_listen(tcp_sock, listen_port) < 0) {
-        return NULL;
+    if (bind_and_listen(configs->listen_sock, listen_port) < 0) {
+        return -1;
     }
     
-    int client_sock;
-    if ((client_sock = accept_connection(tcp_sock)) < 0) {
-        return NULL;
+    if ((configs->client_sock = accept_connection(configs->listen_sock)) < 0) {
+        return -1;
     }
 
     // receive message
     char *config_contents;
-    if ((config_contents = receive_stream(client_sock)) == NULL) {
-        return NULL;
+    if ((config_contents = receive_message(configs->client_sock)) == NULL) {
+        return -1;
     }
 
-    LOGP("Config contents received, closing TCP connection.\n");
-    if (close(tcp_sock) < 0) {
-        perror("Error closing tcp socket");
-        return NULL;
+    // parse received config file
+    int parsed = parse_config(configs, config_contents);
+    free(config_contents);
+    if (parsed < 0) {
+        return -1;
+    }
+    if (configs->mode < 0 || (configs->mode == MODE_SWEEP && configs->level_count < 0)) {
+        return -1;
+    }
+    if (configs->bidirectional && configs->mode != MODE_DETECT) {
+        fprintf(stderr, "Bidirectional sessions only support the detect mode\n");
+        return -1;
+    }
+    if (configs->flows < 1 || configs->flows > MAX_FLOWS
+            || (configs->flows > 1 && (configs->mode != MODE_DETECT || configs->bidirectional))) {
+        fprintf(stderr, "Multiple flows need 1 to %d flows in a one way detect session\n", MAX_FLOWS);
+        return -1;
+    }
+
+    if (configs->xdp_interface != NULL && (configs->mode != MODE_DETECT || configs->flows > 1
+            || configs->bidirectional || configs->udp_payload_size < TRAIN_TAG_SIZE)) {
+        fprintf(stderr, "xdp_interface needs a one way detect session with %d byte payloads or more\n",
+                TRAIN_TAG_SIZE);
+        return -1;
+    }
+
+    // socket is opened before probing so the handshake can use it
+    if ((configs->udp_sock = open_udp_socket(configs)) < 0) {
+        return -1;
+    }
+    // in place before the first train can arrive, the untagged
+    // handshake echoes still reach the socket
+    if (configs->xdp_interface != NULL
+            && attach_aggregator(&configs->aggregator, configs->xdp_interface,
+                                 configs->udp_dest_port) < 0) {
+        return -1;
     }
-    if (close(client_sock) < 0) {
+
+    if (handshake(configs, configs->client_sock) < 0) {
+        return -1;
+    }
+    if (configs->bidirectional && !configs->client_known) {
+        fprintf(stderr, "No echo from the client, cannot send reverse trains\n");
+        return -1;
+    }
+
+    LOGP("Config contents received, closing TCP connection.\n");
+    int status = close(configs->client_sock);
+    configs->client_sock = -1;
+    if (status < 0) {
         perror("Error closing client socket");
-        return NULL;
+        return -1;
     }
 
-    // parse received config file
-    struct server_config *configs = malloc(sizeof(struct server_config));
-    parse_config(configs, config_contents);
-    free(config_contents);
+    // bulk transfers connect to the same port, keep listening
+    if (configs->mode != MODE_TCP) {
+        status = close(configs->listen_sock);
+        configs->listen_sock = -1;
+        if (status < 0) {
+            perror("Error closing tcp socket");
+            return -1;
+        }
+    }
+
+    return 1;
+}
 
-    return configs;
+/**
+ * Counts the udp errors of the network namespace since a snapshot
+ *
+ * before: pointer to udp_counters struct taken with get_udp_counters
+ * since: pointer to udp_counters struct to fill, -1 where unknown
+ */
+void udp_errors_since(struct udp_counters *before, struct udp_counters *since)
+{
+    struct udp_counters now;
+    get_udp_counters(&now);
+    since->in_errors = now.in_errors < 0 || before->in_errors < 0
+                        ? -1 : now.in_errors - before->in_errors;
+    since->rcvbuf_errors = now.rcvbuf_errors < 0 || before->rcvbuf_errors < 0
+                        ? -1 : now.rcvbuf_errors - before->rcvbuf_errors;
+}
+
+/**
+ * Counts and logs what the receiver dropped during pipelined trains
+ *
+ * records: array of train_record pointers
+ * count: number of records
+ * errors: pointer to udp_counters struct of the errors during the trains
+ *
+ * returns: datagrams the socket dropped
+ */
+long count_drops(struct train_record **records, int count, struct udp_counters *errors)
+{
+    long drops = 0;
+    for (int k = 0; k < count; k++) {
+        drops += records[k]->drops;
+    }
+    LOG("Dropped at the receiver: %ld by the socket, %ld udp receive errors (%ld on full buffers).\n",
+        drops, errors->in_errors, errors->rcvbuf_errors);
+    return drops;
+}
+
+/**
+ * Receives one UDP packet train, recording every arrival. The first
+ * packet may take up to udp_timeout seconds to show up, after that
+ * the train ends once the socket stays silent for udp_timeout_ms.
+ * Socket drops from the first datagram of the train on go to the
+ * record, see add_drop_count_opt, and so do datagrams past a full
+ * record. A UDP GRO read is split back into its datagrams, see
+ * record_arrival.
+ *
+ * configs: pointer to server_config struct
+ * record: pointer to train_record struct to fill
+ * recv_addr: pointer to sockaddr_in struct to be filled
+ *
+ * returns: number of packets received if successful, -1 otherwise
+ */
+int receive_train(struct server_config *configs, struct train_record *record,
+                    struct sockaddr_in *recv_addr)
+{
+    if (add_timeout_opt(configs->udp_sock, configs->udp_timeout) < 0) {
+        return -1;
+    }
+
+    struct datagram_batch batch;
+    if (init_datagram_batch(&batch) < 0) {
+        return -1;
+    }
+    uint32_t first_drops = 0;
+    long overflow = 0;
+    while (record->count < configs->udp_train_size) {
+        if (receive_datagram_batch(configs->udp_sock, &batch, configs->busy_poll > 0) < 0) {
+            if (errno == 11) { // EAGAIN
+                LOGP("Train timeout.\n");
+                break;
+            }
+            free_datagram_batch(&batch);
+            return -1;
+        }
+        for (int d = 0; d < batch.count; d++) {
+            char *buf = batch.bufs + (size_t) d * GRO_BUFFER;
+            int bytes = batch.lengths[d];
+            struct datagram_meta *meta = &batch.metas[d];
+            bool started = record->count == 0;
+            double wake = meta->stamped ? time_diff_micro(meta->read, meta->stamp) : -1;
+            for (int offset = 0; offset < bytes; offset += meta->segment_size) {
+                char *payload = buf + offset;
+                int length = bytes - offset < meta->segment_size ? bytes - offset : meta->segment_size;
+                uint16_t id = (uint8_t) payload[0] << 8 | (uint8_t) payload[1];
+                if (record_arrival(record, id, length, offset > 0, offset > 0 ? -1 : wake) < 0) {
+                    overflow++;     // past the train size, duplicates or stray datagrams
+                }
+            }
+            if (started) {
+                first_drops = meta->drops;
+            }
+            record->drops = meta->drops - first_drops + overflow;
+
+            // train has started, switch to the short timeout
+            if (started) {
+                if (add_timeout_opt_milli(configs->udp_sock, configs->udp_timeout_ms) < 0) {
+                    free_datagram_batch(&batch);
+                    return -1;
+                }
+            }
+        }
+        memcpy(recv_addr, &batch.addrs[batch.count - 1], sizeof(struct sockaddr_in));
+    }
+    free_datagram_batch(&batch);
+
+    if (record->count > 0) {
+        LOG("First udp id: %d\n", record->arrivals[0].id);
+        LOG("Last udp id: %d\n", record->arrivals[record->count - 1].id);
+    }
+
+    return record->count;
 }
 
 /**
@@ -99,114 +441,417 @@ struct server_config* pre_probing(uint16_t listen_port)
  *
  * configs: pointer to server_config struct
  *
- * returns: compression results if successful, NULL otherwise
+ * returns: json compression results if successful, NULL otherwise
  */
 char* probing(struct server_config *configs)
 {
-    int udp_sock;
-    if ((udp_sock = create_udp_socket()) < 0) {
+    // prep structures and data for packet trains
+    struct sockaddr_in *recv_addr = malloc(sizeof(struct sockaddr));
+    memset(recv_addr, 0, sizeof(struct sockaddr));
+    struct train_record *low = create_train_record(configs->udp_train_size);
+    struct train_record *high = create_train_record(configs->udp_train_size);
+    if (low == NULL || high == NULL) {
         return NULL;
     }
 
-    // add timeout
-    if (add_timeout_opt(udp_sock, configs->udp_timeout) < 0) {
+    // receive low entropy packets
+    struct udp_counters before, low_errors, high_errors;
+    get_udp_counters(&before);
+    if (receive_train(configs, low, recv_addr) < 0) {
         return NULL;
     }
+    udp_errors_since(&before, &low_errors);
+    LOGP("First train received.\n");
 
-    // set up addr struct and bind port
-    struct sockaddr_in *my_addr = set_addr_struct(INADDR_ANY, configs->udp_dest_port);
-    if (bind_port(udp_sock, my_addr) < 0) {
+    // receive high entropy packets
+    get_udp_counters(&before);
+    if (receive_train(configs, high, recv_addr) < 0) {
         return NULL;
     }
+    udp_errors_since(&before, &high_errors);
+    LOGP("Second train received.\n");
 
-    // prep structures and data for packet trains
-    struct sockaddr_in *recv_addr = malloc(sizeof(struct sockaddr));
-    memset(recv_addr, 0, sizeof(struct sockaddr));
-    struct timeval low_start, low_end, high_start, high_end;
-    char* payload;
+    // compression detection calculations
+    struct compression_result result;
+    analyze_trains(low, high, configs->threshold, configs->ratio_threshold, &result);
+    result.busy_poll = configs->busy_poll > 0;
+    if (low_errors.in_errors >= 0 && high_errors.in_errors >= 0) {
+        result.in_errors = low_errors.in_errors + high_errors.in_errors;
+        result.rcvbuf_errors = low_errors.rcvbuf_errors + high_errors.rcvbuf_errors;
+    }
 
-    // receive low entropy packets
-    uint16_t first_low_udp = 0;
-    uint16_t last_low_udp = 0;
-    bool begin = false;
+    // free memory
+    free(recv_addr);
+    free_train_record(low);
+    free_train_record(high);
 
-    for (int i = 0; i < configs->udp_train_size; i++) {
-        if ((payload = receive_packet(udp_sock, recv_addr)) == NULL) {
-            if (errno == 11) { // EAGAIN
-                LOGP("Low entropy timeout.\n");
-                break;
-            }
-            return NULL;
+    return result_to_json(&result);
+}
+
+/**
+ * Waits for one train to pass the xdp program. The first packet may
+ * take up to udp_timeout seconds to show up, after that the train ends
+ * once no packet arrived for udp_timeout_ms, as in receive_train().
+ *
+ * configs: pointer to server_config struct
+ * train: train index
+ * summary: pointer to train_summary struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int wait_aggregate(struct server_config *configs, int train, struct train_summary *summary)
+{
+    struct train_aggregate *aggregate = malloc(sizeof(struct train_aggregate));
+    if (aggregate == NULL) {
+        perror("Error mallocing train aggregate");
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    int64_t start = now.tv_sec * 1000000000LL + now.tv_nsec;
+    while (true) {
+        if (read_aggregate(&configs->aggregator, train, aggregate) < 0) {
+            free(aggregate);
+            return -1;
         }
-        // receive first low entropy packet
-        if (!begin) {
-            gettimeofday(&low_start, NULL);
-            first_low_udp = payload[0] << 8 | payload[1];
-            begin = true;
+        if (aggregate->packets >= (uint64_t) configs->udp_train_size) {
+            break;
         }
-        gettimeofday(&low_end, NULL);
-        last_low_udp = payload[0] << 8 | payload[1];
+        // the program stamps on the same clock
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t elapsed = now.tv_sec * 1000000000LL + now.tv_nsec
+                            - (aggregate->packets == 0 ? start : (int64_t) aggregate->last);
+        if (elapsed > (aggregate->packets == 0 ? configs->udp_timeout * 1000000000LL
+                                                : configs->udp_timeout_ms * 1000000LL)) {
+            LOGP("Train timeout.\n");
+            break;
+        }
+        sleep_milli(AGGREGATE_POLL);
     }
 
-    LOG("First low udp id: %d\n", first_low_udp);
-    LOG("Last low udp id: %d\n", last_low_udp);
-    LOGP("First train received.\n");
+    summary->packets = count_ids(aggregate);
+    summary->bytes = aggregate->bytes;
+    summary->first_bytes = aggregate->first_bytes;
+    summary->duration = aggregate->packets > 0 ? (aggregate->last - aggregate->first) / 1000000.0 : 0;
+    LOG("Train %d: %d ids in %lu packets over %.3fms\n", train, summary->packets,
+        (unsigned long) aggregate->packets, summary->duration);
 
-    // receive high entropy packets
-    uint16_t first_high_udp = 0; 
-    uint16_t last_high_udp = 0;
-    begin = false;
-    
-    for (int i = 0; i < configs->udp_train_size; i++) {
-        if ((payload = receive_packet(udp_sock, recv_addr)) == NULL) {
-            if (errno == 11) { // EAGAIN
-                LOGP("High entropy timeout.\n");
-                break;
-            }
+    free(aggregate);
+    return 1;
+}
+
+/**
+ * Probing phase with the xdp program aggregating the trains. The
+ * program drops the tagged datagrams before they reach the socket,
+ * so only the two aggregates are read.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: json compression results if successful, NULL otherwise
+ */
+char* aggregate_probing(struct server_config *configs)
+{
+    struct train_summary low, high;
+    if (wait_aggregate(configs, 0, &low) < 0) {
+        return NULL;
+    }
+    LOGP("First train aggregated.\n");
+    if (wait_aggregate(configs, 1, &high) < 0) {
+        return NULL;
+    }
+    LOGP("Second train aggregated.\n");
+
+    struct compression_result result;
+    analyze_summaries(&low, &high, configs->threshold, configs->ratio_threshold, &result);
+    return result_to_json(&result);
+}
+
+/**
+ * Sweep probing phase. Receives one train per entropy level.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: json sweep results if successful, NULL otherwise
+ */
+char* sweep_probing(struct server_config *configs)
+{
+    int count = configs->level_count;
+    struct train_record *records[MAX_ENTROPY_LEVELS];
+    for (int k = 0; k < count; k++) {
+        if ((records[k] = create_train_record(configs->udp_train_size)) == NULL) {
             return NULL;
         }
-        // receive first high entropy packet
-        if (!begin) {
-            gettimeofday(&high_start, NULL);
-            first_high_udp = payload[0] << 8 | payload[1];
-            begin = true;
-        }
-        gettimeofday(&high_end, NULL);
-        last_high_udp = payload[0] << 8 | payload[1];
     }
 
-    LOG("First high udp id: %d\n", first_high_udp);
-    LOG("Last high udp id: %d\n", last_high_udp);
-    LOGP("Second train received.\n");
+    struct udp_counters before, errors;
+    get_udp_counters(&before);
+    if (receive_trains(configs->udp_sock, records, count, configs->udp_train_size,
+                        configs->udp_timeout * 1000, configs->udp_timeout_ms, 1,
+                        configs->busy_poll > 0) < 0) {
+        return NULL;
+    }
+    udp_errors_since(&before, &errors);
+    LOGP("Sweep received.\n");
 
-    // compression detection calculations
-    char *result;
-    double low_delta = time_diff_milli(low_end, low_start);
-    double high_delta = time_diff_milli(high_end, high_start);
-    double difference = high_delta - low_delta;
+    struct sweep_result result;
+    estimate_sweep(records, configs->levels, count, &result);
+    result.local_drops = count_drops(records, count, &errors);
+    result.in_errors = errors.in_errors;
+    result.rcvbuf_errors = errors.rcvbuf_errors;
+    for (int k = 0; k < count; k++) {
+        free_train_record(records[k]);
+    }
 
-    LOG("Low entropy: %.0fms\n", low_delta);
-    LOG("High entropy: %.0fms\n", high_delta);
-    LOG("Delta: %.0fms\n", difference);
+    return sweep_to_json(&result);
+}
 
-    if (difference > configs->threshold) {
-        result = "Compression detected.";
+/**
+ * Deduplication probing phase. Receives a train of unique random
+ * payloads, a train repeating one random payload, and a low entropy
+ * train, in that order.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: json deduplication results if successful, NULL otherwise
+ */
+char* dedup_probing(struct server_config *configs)
+{
+    struct train_record *records[3];
+    for (int k = 0; k < 3; k++) {
+        if ((records[k] = create_train_record(configs->udp_train_size)) == NULL) {
+            return NULL;
+        }
+    }
+
+    struct udp_counters before, errors;
+    get_udp_counters(&before);
+    if (receive_trains(configs->udp_sock, records, 3, configs->udp_train_size,
+                        configs->udp_timeout * 1000, configs->udp_timeout_ms, 1,
+                        configs->busy_poll > 0) < 0) {
+        return NULL;
+    }
+    udp_errors_since(&before, &errors);
+    LOGP("Deduplication trains received.\n");
+
+    struct dedup_result result;
+    estimate_dedup(records[0], records[1], records[2], &result);
+    result.local_drops = count_drops(records, 3, &errors);
+    result.in_errors = errors.in_errors;
+    result.rcvbuf_errors = errors.rcvbuf_errors;
+
+    if (configs->ratio_threshold > 0) {
+        result.compressed = result.compression_ratio > configs->ratio_threshold;
+        result.deduplicated = result.dedup_ratio > configs->ratio_threshold;
     } else {
-        result = "No compression detected.";
+        double unique_delta = train_duration_milli(records[0]);
+        result.compressed = unique_delta - train_duration_milli(records[2]) > configs->threshold;
+        result.deduplicated = unique_delta - train_duration_milli(records[1]) > configs->threshold;
     }
 
-    // free memory
-    free(my_addr);
-    free(recv_addr);
-    free(payload);
+    for (int k = 0; k < 3; k++) {
+        free_train_record(records[k]);
+    }
+
+    return dedup_to_json(&result);
+}
+
+/**
+ * Multi-flow probing phase. Every flow sends its low and high entropy
+ * trains at the same time from its own source port, which may hash
+ * onto a path of its own. Each flow is judged on its own and the
+ * results are combined.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: json flow results if successful, NULL otherwise
+ */
+char* flows_probing(struct server_config *configs)
+{
+    int count = 2 * configs->flows;
+    struct train_record *records[2 * MAX_FLOWS];
+    for (int k = 0; k < count; k++) {
+        if ((records[k] = create_train_record(configs->udp_train_size)) == NULL) {
+            return NULL;
+        }
+    }
+
+    struct udp_counters before, errors;
+    get_udp_counters(&before);
+    if (receive_trains(configs->udp_sock, records, 2, configs->udp_train_size,
+                        configs->udp_timeout * 1000, configs->udp_timeout_ms, configs->flows,
+                        configs->busy_poll > 0) < 0) {
+        return NULL;
+    }
+    udp_errors_since(&before, &errors);
+    LOGP("Flow trains received.\n");
+
+    struct flow_result result;
+    memset(&result, 0, sizeof(result));
+    result.count = configs->flows;
+    result.local_drops = count_drops(records, count, &errors);
+    result.in_errors = errors.in_errors;
+    result.rcvbuf_errors = errors.rcvbuf_errors;
+    for (int i = 0; i < configs->flows; i++) {
+        analyze_trains(records[2 * i], records[2 * i + 1], configs->threshold,
+                        configs->ratio_threshold, &result.flows[i]);
+        result.flows[i].busy_poll = configs->busy_poll > 0;
+    }
+    combine_flows(&result);
+
+    for (int k = 0; k < count; k++) {
+        free_train_record(records[k]);
+    }
+
+    return flows_to_json(&result);
+}
+
+/**
+ * Receives one bulk transfer over a new connection on the listening
+ * socket. The client may take up to the inter measurement gap plus
+ * udp_timeout seconds to connect, after that the transfer ends when
+ * the client closes its side or stalls for udp_timeout_ms.
+ *
+ * configs: pointer to server_config struct
+ * stats: pointer to tcp_stats struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int receive_bulk(struct server_config *configs, struct tcp_stats *stats)
+{
+    init_tcp_stats(stats);
+    int wait_ms = configs->inter_measurement_ms + configs->udp_timeout * 1000;
+    if (add_timeout_opt_milli(configs->listen_sock, wait_ms) < 0) {
+        return -1;
+    }
+    int sock;
+    if ((sock = accept_connection(configs->listen_sock)) < 0) {
+        return -1;
+    }
+    if (add_timeout_opt_milli(sock, configs->udp_timeout_ms) < 0) {
+        return -1;
+    }
 
-    // close socket
-    if (close(udp_sock) < 0) {
-        perror("Error closing udp socket");
+    char *buf = malloc(TCP_CHUNK);
+    if (buf == NULL) {
+        perror("Error mallocing receive buffer");
+        return -1;
+    }
+
+    struct tcp_sampler sampler;
+    init_tcp_sampler(&sampler, sock, false);
+    struct timeval first, last;
+    int bytes;
+    while ((bytes = recv(sock, buf, TCP_CHUNK, 0)) > 0) {
+        gettimeofday(&last, NULL);
+        if (stats->bytes == 0) {
+            first = last;
+        }
+        stats->bytes += bytes;
+    }
+    free(buf);
+    if (bytes < 0) {
+        if (errno != EAGAIN) {
+            perror("Error receiving bulk transfer");
+            return -1;
+        }
+        LOGP("Transfer timeout.\n");
+    }
+
+    if (stats->bytes > 0) {
+        stats->duration = time_diff_micro(last, first) / 1000;
+    }
+    if (finish_tcp_stats(&sampler, stats) < 0) {
+        return -1;
+    }
+    LOG("Bulk transfer of %ld bytes received in %.3fms.\n", stats->bytes, stats->duration);
+
+    if (close(sock) < 0) {
+        perror("Error closing bulk socket");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * TCP probing phase. Receives a low and a high entropy bulk transfer
+ * and compares their goodput. The client adds the sender side stats.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: json tcp results if successful, NULL otherwise
+ */
+char* tcp_probing(struct server_config *configs)
+{
+    struct tcp_result result;
+    memset(&result, 0, sizeof(result));
+    init_tcp_stats(&result.low_sender);
+    init_tcp_stats(&result.high_sender);
+
+    if (receive_bulk(configs, &result.low) < 0) {
+        return NULL;
+    }
+    LOGP("Low entropy transfer received.\n");
+    if (receive_bulk(configs, &result.high) < 0) {
         return NULL;
     }
+    LOGP("High entropy transfer received.\n");
 
-    return result;
+    analyze_tcp(&result, configs->threshold, configs->ratio_threshold);
+    return tcp_to_json(&result);
+}
+
+/**
+ * Sends a low and a high entropy train back to the client, separated
+ * by the inter measurement gap. The ids are numbered on from the low
+ * to the high train, like pipelined trains, so the client can tell
+ * them apart.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_reverse_trains(struct server_config *configs)
+{
+    int n = configs->udp_train_size;
+    for (int k = 0; k < 2; k++) {
+        if (k > 0) {
+            sleep_milli(configs->inter_measurement_ms);
+        }
+
+        char *train = create_entropy_train(k * n, n, configs->udp_payload_size, k == 0 ? 0 : 8);
+        if (train == NULL) {
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            char *payload = train + (size_t) i * configs->udp_payload_size;
+            if (send_packet(configs->udp_sock, payload, configs->udp_payload_size,
+                            &configs->client_addr) < 0) {
+                free(train);
+                return -1;
+            }
+        }
+        free(train);
+        LOG("Reverse %s entropy train sent.\n", k == 0 ? "low" : "high");
+    }
+
+    return 1;
+}
+
+/**
+ * Thread process sending the reverse trains while the main thread
+ * receives the client's
+ *
+ * arg: void pointer (preferably pointer to server_config struct)
+ *
+ * returns: NULL if successful, non-NULL otherwise
+ */
+void* reverse_routine(void *arg)
+{
+    if (send_reverse_trains((struct server_config *) arg) < 0) {
+        return arg;
+    }
+    return NULL;
 }
 
 /**
@@ -226,62 +871,229 @@ int post_probing(uint16_t listen_port, char *msg)
         return -1;
     }
 
-    if (bind_and_listen(tcp_sock, listen_port) < 0) {
-        return -1;
+    int client_sock = -1;
+    int status = -1;
+    if (bind_and_listen(tcp_sock, listen_port) >= 0
+            && (client_sock = accept_connection(tcp_sock)) >= 0) {
+        // send compression results
+        status = send_stream(client_sock, msg);
     }
 
-    int client_sock;
-    if ((client_sock = accept_connection(tcp_sock)) < 0) {
-        return -1;
+    if (status > 0) {
+        LOGP("Compression status sent, closing TCP connection.\n");
     }
-
-    // send compression results
-    if (send_stream(client_sock, msg) < 0) {
-        return -1;
-    }
-
-    LOGP("Compression status sent, closing TCP connection.\n");
     if (close(tcp_sock) < 0) {
         perror("Error closing tcp socket");
-        return -1;
+        status = -1;
     }
-    if (close(client_sock) < 0) {
+    if (client_sock >= 0 && close(client_sock) < 0) {
         perror("Error closing client socket");
-        return -1;
+        status = -1;
     }
 
-    return 1;
+    return status;
 }
 
-int main(int argc, char *argv[])
+/**
+ * Sets up a server_config struct with no sockets open
+ *
+ * configs: server_config struct to set up
+ */
+void init_session(struct server_config *configs)
 {
-    // check that port is provided
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s port\n", argv[0]);
-        return EXIT_FAILURE;
+    memset(configs, 0, sizeof(struct server_config));
+    configs->udp_sock = -1;
+    configs->listen_sock = -1;
+    configs->client_sock = -1;
+    configs->aggregator.map_fd = -1;
+    configs->aggregator.prog_fd = -1;
+    configs->aggregator.link_fd = -1;
+}
+
+/**
+ * Closes every socket a round left open, whether it got through or
+ * failed part way, so the next round can bind the same ports again.
+ * Detaches the xdp program too, which would otherwise keep dropping
+ * the trains of later rounds.
+ *
+ * configs: pointer to server_config struct
+ *
+ * returns: 1 if successful, -1 if a socket failed to close
+ */
+int close_session(struct server_config *configs)
+{
+    detach_aggregator(&configs->aggregator);
+    int status = 1;
+    int *socks[3] = { &configs->udp_sock, &configs->listen_sock, &configs->client_sock };
+    for (int i = 0; i < 3; i++) {
+        if (*socks[i] >= 0 && close(*socks[i]) < 0) {
+            perror("Error closing socket");
+            status = -1;
+        }
+        *socks[i] = -1;
     }
+    return status;
+}
 
-    uint16_t listen_port = atoi(argv[1]);
+/**
+ * Receives the client's trains, or its bulk transfers, as the mode
+ * asks for
+ *
+ * configs: pointer to server_config struct, after pre-probing
+ *
+ * returns: json results if successful, NULL otherwise
+ */
+char* receive_session(struct server_config *configs)
+{
+    if (configs->mode == MODE_SWEEP) {
+        return sweep_probing(configs);
+    } else if (configs->mode == MODE_DEDUP) {
+        return dedup_probing(configs);
+    } else if (configs->mode == MODE_TCP) {
+        return tcp_probing(configs);
+    } else if (configs->flows > 1) {
+        return flows_probing(configs);
+    } else if (configs->xdp_interface != NULL) {
+        return aggregate_probing(configs);
+    }
+    return probing(configs);
+}
 
-    // ---- pre probing phase ----
-    struct server_config *configs;
-    if ((configs = pre_probing(listen_port)) == NULL) {
-        return EXIT_FAILURE;
+/**
+ * Thread process receiving on the cpu given by receiver_cpu
+ *
+ * arg: void pointer (preferably pointer to server_config struct)
+ *
+ * returns: json results if successful, NULL otherwise
+ */
+void* receiver_routine(void *arg)
+{
+    struct server_config *configs = (struct server_config *) arg;
+    if (set_thread_realtime(configs->receiver_cpu, false) < 0) {
+        return NULL;
     }
+    return receive_session(configs);
+}
 
-    // ---- probing phase ----
-    char *results;
-    if ((results = probing(configs)) == NULL) {
-        return EXIT_FAILURE;
+/**
+ * Probing phase of a round. Sends the reverse trains of a
+ * bidirectional session alongside or after the client's trains, and
+ * waits for the reverse thread whatever happened to the receiving.
+ *
+ * configs: pointer to server_config struct, after pre-probing
+ *
+ * returns: json results if successful, NULL otherwise
+ */
+char* probe_session(struct server_config *configs)
+{
+    // after the handshake, whose echoes must stay one per datagram
+    if (configs->udp_gro && configs->mode != MODE_TCP && add_gro_opt(configs->udp_sock) < 0) {
+        return NULL;
+    }
+
+    // reverse trains overlap the client's, the path is full duplex
+    pthread_t reverse_thread;
+    if (configs->bidirectional == 1) {
+        if (set_df_opt(configs->udp_sock) < 0) {
+            return NULL;
+        }
+        if (pthread_create(&reverse_thread, NULL, reverse_routine, configs) != 0) {
+            perror("Error creating reverse thread");
+            return NULL;
+        }
+    }
+
+    // a spinning receiver needs a core of its own, on a thread of its
+    // own so the pinning ends with the round
+    char *results = NULL;
+    if (configs->receiver_cpu < 0) {
+        results = receive_session(configs);
+    } else {
+        pthread_t receiver_thread;
+        if (pthread_create(&receiver_thread, NULL, receiver_routine, configs) != 0) {
+            perror("Error creating receiver thread");
+        } else {
+            pthread_join(receiver_thread, (void **) &results);
+        }
+    }
+
+    void *reverse_status = NULL;
+    if (configs->bidirectional == 1) {
+        pthread_join(reverse_thread, &reverse_status);
+    } else if (configs->bidirectional == 2 && results != NULL) {
+        // half duplex path, the reverse trains follow the client's
+        if (set_df_opt(configs->udp_sock) < 0 || send_reverse_trains(configs) < 0) {
+            reverse_status = configs;
+        }
+    }
+    if (reverse_status != NULL) {
+        fprintf(stderr, "Error sending reverse trains\n");
+        free(results);
+        results = NULL;
+    }
+
+    return results;
+}
+
+/**
+ * Runs one round of compression detection
+ *
+ * listen_port: port to listen on
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int run_round(uint16_t listen_port)
+{
+    struct server_config *configs = malloc(sizeof(struct server_config));
+    if (configs == NULL) {
+        perror("Error mallocing server config");
+        return -1;
+    }
+    init_session(configs);
+
+    // ---- pre probing and probing phase ----
+    char *results = NULL;
+    if (pre_probing(listen_port, configs) > 0) {
+        results = probe_session(configs);
+    }
+
+    // close sockets, also on failure so the next round can bind again
+    int status = close_session(configs);
+    free(configs);
+    if (results == NULL || status < 0) {
+        free(results);
+        return -1;
     }
 
     // ---- post probing phase ----
-    if (post_probing(listen_port, results) < 0) {
+    status = post_probing(listen_port, results);
+    free(results);
+
+    return status;
+}
+
+int main(int argc, char *argv[])
+{
+    // check that port is provided
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s port [-d]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    // free config structure data
-    free(configs);
+    uint16_t listen_port = atoi(argv[1]);
+
+    // daemon mode keeps serving rounds, the client carries its
+    // calibrated path estimate from one round to the next
+    bool daemon_mode = argc > 2 && strcmp(argv[2], "-d") == 0;
+
+    do {
+        if (run_round(listen_port) < 0) {
+            if (!daemon_mode) {
+                return EXIT_FAILURE;
+            }
+            sleep(1); // back off before serving the next round
+        }
+    } while (daemon_mode);
 
     return EXIT_SUCCESS;
 }
@@ -1,7 +1,7 @@
 /**
  * @file
  *
- * Contains ip and tcp header helper functions.
+ * Contains ip, tcp, and udp header helper functions.
  */
 
 #include <stdio.h>
@@ -10,13 +10,14 @@
 #include <string.h>
 
 #include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
 #include <netinet/tcp.h>
+#include <netinet/udp.h>
 
+#include "checksum.h"
+#include "headers.h"
 #include "logger.h"
 
-#define IP4_HDRLEN 20
-#define TCP_HDRLEN 20
-
 struct pseudo_header {
     uint32_t source_address;
     uint32_t dest_address;
@@ -25,47 +26,15 @@ struct pseudo_header {
     uint16_t tcp_length;
 };
 
-/**
- * Calculates IP/TCP header checksums
- *
- * buf: bytes to checksum
- * size: size of bytes to checksum
- *
- * returns: header checksum
- *
- * source: https://github.com/MaxXor/raw-sockets-example
- */
-uint16_t checksum(const char *buf, uint32_t size)
-{
-    uint32_t sum = 0, i;
-
-    // accumulate checksum
-    for (i = 0; i < size - 1; i += 2) {
-        uint16_t word16 = *(uint16_t *) &buf[i];
-        sum += word16;
-    }
-
-    // handle odd-sized case
-    if (size & 1) {
-        uint16_t word16 = (unsigned char) buf[i];
-        sum += word16;
-    }
-
-    // fold to get the ones-complement result
-    while (sum >> 16) sum = (sum & 0xFFFF) + (sum >> 16);
-
-    // invert to get the negative in ones-complement arithmetic
-    return ~sum;
-}
-
 /**
  * Fills in IP header for raw socket
  *
  * iphdr: ip struct to fill
  * src_addr: sockaddr_in struct containing source ip address
  * dst_addr: sockaddr_in struct containing source destination address
+ * ttl: time to live
  */
-void fill_in_iphdr(struct ip* iphdr, struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr)
+void fill_in_iphdr(struct ip* iphdr, struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr, int ttl)
 {
     iphdr->ip_v = 4;                                 // version (4 bits)
     iphdr->ip_hl = IP4_HDRLEN / sizeof(uint32_t);    // header length (4 bits)
@@ -84,7 +53,7 @@ void fill_in_iphdr(struct ip* iphdr, struct sockaddr_in *src_addr, struct sockad
                         + (ip_flags[2] << 13)
                         +  ip_flags[3]);
 
-    iphdr->ip_ttl = 255;        // time to live (8 bits)
+    iphdr->ip_ttl = ttl;        // time to live (8 bits)
     iphdr->ip_p = IPPROTO_TCP;  // protocol (8 bits)
     iphdr->ip_sum = 0;          // header checksum, first set to 0 (16 bits)
 
@@ -134,59 +103,310 @@ void fill_in_tcphdr(struct tcphdr* tcphdr, struct sockaddr_in *src_addr, struct
 }
 
 /**
- * Creates a SYN packet by filling in both IP and TCP headers, and creates
- * a pseudo-header for the TCP checksum. Note: packet is constructed to not
- * have a payload. Length is intended to be 40 bytes.
+ * Updates a checksum for a 16 bit word of the checksummed data that
+ * changed, without summing the data again (RFC 1624, eqn. 3). All
+ * values are in network byte order.
  *
+ * sum: checksum as stored in the header
+ * old_word: previous value of the word
+ * new_word: new value of the word
+ *
+ * returns: updated checksum
+ */
+static uint16_t update_checksum(uint16_t sum, uint16_t old_word, uint16_t new_word)
+{
+    // HC' = ~(~HC + ~m + m')
+    uint32_t acc = (uint16_t) ~sum + (uint16_t) ~old_word + new_word;
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    acc = (acc & 0xFFFF) + (acc >> 16);
+    return ~acc;
+}
+
+/**
+ * Builds a SYN template by filling in both IP and TCP headers, and
+ * computes the checksums over a pseudo-header once. Probes are then
+ * stamped from the template with stamp_syn(). Note: the packet has no
+ * payload, so it is SYN_LEN bytes long.
+ *
+ * tmpl: syn_template struct to fill
  * src_addr: sockaddr_in struct containing source address
  * dst_addr: sockaddr_in struct containing destination address
- * len: length of packet
- *
- * returns: char pointer to packet if successful, NULL otherwise
  */
-char* create_syn_packet(struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr, int len)
+void init_syn_template(struct syn_template *tmpl, struct sockaddr_in *src_addr,
+                        struct sockaddr_in *dst_addr)
 {
-    // datagram to represent the packet
-    char *datagram = malloc(len);
-    if (datagram == NULL) {
-        perror("Error mallocing syn packet");
-        return NULL;
-    }
-    memset(datagram, 0, len);
+    memset(tmpl->packet, 0, SYN_LEN);
 
     // required structs for IP and TCP header
-    struct ip *iphdr = (struct ip*) datagram;
-    struct tcphdr *tcphdr = (struct tcphdr*) (datagram + sizeof(struct ip));
+    struct ip *iphdr = (struct ip*) tmpl->packet;
+    struct tcphdr *tcphdr = (struct tcphdr*) (tmpl->packet + IP4_HDRLEN);
 
     // fill in headers
-    fill_in_iphdr(iphdr, src_addr, dst_addr);
+    fill_in_iphdr(iphdr, src_addr, dst_addr, 255);
     fill_in_tcphdr(tcphdr, src_addr, dst_addr);
+    tcphdr->th_seq = 0;
 
     struct pseudo_header psh;
     psh.source_address = src_addr->sin_addr.s_addr;
     psh.dest_address = dst_addr->sin_addr.s_addr;
     psh.reserved = 0;
     psh.protocol = IPPROTO_TCP;
-    psh.tcp_length = htons(sizeof(struct tcphdr));
+    psh.tcp_length = htons(TCP_HDRLEN);
 
     // pseudo header + tcp header + data = checksum
-    int psize = sizeof(struct pseudo_header) + sizeof(struct tcphdr);
-
-    // fill pseudo packet
-    char* pseudogram = malloc(psize);
-    if (pseudogram == NULL) {
-        perror("Error mallocing pseudogram");
-        return NULL;
-    }
+    char pseudogram[sizeof(struct pseudo_header) + TCP_HDRLEN];
     memcpy(pseudogram, (char*) &psh, sizeof(struct pseudo_header));
-    memcpy(pseudogram + sizeof(struct pseudo_header), tcphdr, sizeof(struct tcphdr));
+    memcpy(pseudogram + sizeof(struct pseudo_header), tcphdr, TCP_HDRLEN);
 
     // calculate and store checksums
-    tcphdr->th_sum = checksum((const char*) pseudogram, psize);
-    iphdr->ip_sum = checksum((const char*) datagram, sizeof(struct ip));
+    tcphdr->th_sum = checksum((const char*) pseudogram, sizeof(pseudogram));
+    iphdr->ip_sum = checksum((const char*) tmpl->packet, IP4_HDRLEN);
+
+    LOGP("Successfully generated template checksums.\n");
+}
+
+/**
+ * Stamps a SYN probe from a template into a caller provided frame. The
+ * destination port, sequence number and TTL are patched in and the
+ * checksums updated incrementally, so no allocation or full checksum
+ * is needed per probe.
+ *
+ * tmpl: pointer to syn_template struct
+ * frame: SYN_LEN bytes to fill
+ * dst_port: destination port, host byte order
+ * seq: sequence number, host byte order
+ * ttl: time to live
+ */
+void stamp_syn(struct syn_template *tmpl, char *frame, uint16_t dst_port, uint32_t seq, int ttl)
+{
+    memcpy(frame, tmpl->packet, SYN_LEN);
+    struct ip *iphdr = (struct ip*) frame;
+    struct tcphdr *tcphdr = (struct tcphdr*) (frame + IP4_HDRLEN);
+
+    // ttl shares a 16 bit word with the protocol
+    uint16_t old_word, new_word;
+    memcpy(&old_word, &iphdr->ip_ttl, sizeof(uint16_t));
+    iphdr->ip_ttl = ttl;
+    memcpy(&new_word, &iphdr->ip_ttl, sizeof(uint16_t));
+    iphdr->ip_sum = update_checksum(iphdr->ip_sum, old_word, new_word);
+
+    uint16_t port = htons(dst_port);
+    uint16_t sum = update_checksum(tcphdr->th_sum, tcphdr->th_dport, port);
+    tcphdr->th_dport = port;
+
+    // sequence number is two 16 bit words, the template's are zero
+    uint32_t seq_n = htonl(seq);
+    uint16_t seq_words[2];
+    memcpy(seq_words, &seq_n, sizeof(seq_words));
+    sum = update_checksum(sum, 0, seq_words[0]);
+    sum = update_checksum(sum, 0, seq_words[1]);
+    tcphdr->th_seq = seq_n;
+    tcphdr->th_sum = sum;
+}
+
+/**
+ * Patches the source port of a stamped SYN, for probes that need a
+ * 4-tuple of their own
+ *
+ * frame: SYN_LEN bytes stamped by stamp_syn()
+ * src_port: source port, host byte order
+ */
+void set_syn_source_port(char *frame, uint16_t src_port)
+{
+    struct tcphdr *tcphdr = (struct tcphdr*) (frame + IP4_HDRLEN);
+    uint16_t port = htons(src_port);
+    tcphdr->th_sum = update_checksum(tcphdr->th_sum, tcphdr->th_sport, port);
+    tcphdr->th_sport = port;
+}
+
+/**
+ * Builds the RST that tears down the half-open connection a SYN opened
+ * once the SYN-ACK came back, so the server does not keep retransmitting
+ * it. The RST reuses the SYN's addresses, ports and ttl with the
+ * sequence number the SYN-ACK acknowledged.
+ *
+ * syn: SYN_LEN bytes stamped by stamp_syn()
+ * frame: SYN_LEN bytes to fill
+ */
+void stamp_rst(const char *syn, char *frame)
+{
+    memcpy(frame, syn, SYN_LEN);
+    struct tcphdr *tcphdr = (struct tcphdr*) (frame + IP4_HDRLEN);
+
+    uint16_t old_words[2], new_words[2];
+    memcpy(old_words, &tcphdr->th_seq, sizeof(old_words));
+    tcphdr->th_seq = htonl(ntohl(tcphdr->th_seq) + 1);
+    memcpy(new_words, &tcphdr->th_seq, sizeof(new_words));
+    uint16_t sum = update_checksum(tcphdr->th_sum, old_words[0], new_words[0]);
+    sum = update_checksum(sum, old_words[1], new_words[1]);
+
+    // flags share a 16 bit word with the data offset
+    uint16_t old_word, new_word;
+    char *offset_flags = (char*) &tcphdr->th_flags - 1;
+    memcpy(&old_word, offset_flags, sizeof(uint16_t));
+    tcphdr->th_flags = TH_RST;
+    memcpy(&new_word, offset_flags, sizeof(uint16_t));
+    tcphdr->th_sum = update_checksum(sum, old_word, new_word);
+}
+
+/**
+ * Builds a UDP template: IPv4 and UDP headers for datagrams carrying
+ * payload_len bytes, with the DF bit set like the UDP socket does. The
+ * part of the UDP checksum that does not depend on the payload is
+ * summed once here.
+ *
+ * tmpl: udp_template struct to fill
+ * src_addr: sockaddr_in struct containing source address and port
+ * dst_addr: sockaddr_in struct containing destination address and port
+ * payload_len: payload bytes of every datagram
+ * ttl: time to live
+ */
+void init_udp_template(struct udp_template *tmpl, struct sockaddr_in *src_addr,
+                        struct sockaddr_in *dst_addr, int payload_len, int ttl)
+{
+    memset(tmpl->header, 0, UDP_FRAME_HDRLEN);
+    tmpl->payload_len = payload_len;
+
+    struct ip *iphdr = (struct ip*) tmpl->header;
+    struct udphdr *udphdr = (struct udphdr*) (tmpl->header + IP4_HDRLEN);
+
+    fill_in_iphdr(iphdr, src_addr, dst_addr, ttl);
+    iphdr->ip_p = IPPROTO_UDP;
+    iphdr->ip_len = htons(UDP_FRAME_HDRLEN + payload_len);
+    iphdr->ip_off = htons(IP_DF);
+    iphdr->ip_sum = checksum((const char*) iphdr, IP4_HDRLEN);
+
+    udphdr->uh_sport = src_addr->sin_port;
+    udphdr->uh_dport = dst_addr->sin_port;
+    udphdr->uh_ulen = htons(UDP_HDRLEN + payload_len);
+    udphdr->uh_sum = 0;
+
+    struct pseudo_header psh;
+    psh.source_address = src_addr->sin_addr.s_addr;
+    psh.dest_address = dst_addr->sin_addr.s_addr;
+    psh.reserved = 0;
+    psh.protocol = IPPROTO_UDP;
+    psh.tcp_length = udphdr->uh_ulen;
+
+    char pseudogram[sizeof(struct pseudo_header) + UDP_HDRLEN];
+    memcpy(pseudogram, (char*) &psh, sizeof(struct pseudo_header));
+    memcpy(pseudogram + sizeof(struct pseudo_header), udphdr, UDP_HDRLEN);
+
+    // keep the sum uncomplemented so the payload sum can be added
+    tmpl->header_sum = (uint16_t) ~checksum((const char*) pseudogram, sizeof(pseudogram));
 
-    free(pseudogram);
+    LOGP("Successfully generated udp template checksums.\n");
+}
+
+/**
+ * Stamps a UDP frame from a template into a caller provided frame of
+ * UDP_FRAME_HDRLEN + payload_len bytes. The IP id is patched in with
+ * an incremental checksum update and only the payload is summed for
+ * the UDP checksum.
+ *
+ * tmpl: pointer to udp_template struct
+ * frame: frame to fill
+ * payload: payload_len bytes of payload
+ * ip_id: IP id of the frame, host byte order
+ */
+void stamp_udp(struct udp_template *tmpl, char *frame, const char *payload, uint16_t ip_id)
+{
+    memcpy(frame, tmpl->header, UDP_FRAME_HDRLEN);
+    memcpy(frame + UDP_FRAME_HDRLEN, payload, tmpl->payload_len);
+    struct ip *iphdr = (struct ip*) frame;
+    struct udphdr *udphdr = (struct udphdr*) (frame + IP4_HDRLEN);
+
+    uint16_t id = htons(ip_id);
+    iphdr->ip_sum = update_checksum(iphdr->ip_sum, iphdr->ip_id, id);
+    iphdr->ip_id = id;
+
+    uint32_t sum = tmpl->header_sum + (uint16_t) ~checksum(payload, tmpl->payload_len);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    uint16_t udp_sum = ~sum;
+
+    // zero means no checksum in UDP, all ones is the same value
+    udphdr->uh_sum = udp_sum == 0 ? 0xFFFF : udp_sum;
+}
+
+/**
+ * Parses a packet from a raw socket and checks whether it answers one
+ * of our probes. A closed port answers a SYN with a RST acknowledging
+ * seq + 1, an open port with a SYN-ACK acknowledging the same. A
+ * router where the probe expired sends an ICMP time exceeded quoting
+ * the probe's IP header and the first 8 bytes of its TCP header,
+ * which holds the ports and the sequence number. UDP probes
+ * are matched by their quoted ports alone, and a UDP probe reaching a
+ * closed port of the destination is answered with port unreachable.
+ *
+ * buf: packet including the IP header
+ * len: length of packet
+ * reply: probe_reply struct to fill
+ *
+ * returns: reply_kind value
+ */
+int parse_reply(char *buf, int len, struct probe_reply *reply)
+{
+    memset(reply, 0, sizeof(struct probe_reply));
+    if (len < IP4_HDRLEN) {
+        return REPLY_NONE;
+    }
+
+    struct ip *iphdr = (struct ip*) buf;
+    int ip_len = iphdr->ip_hl * 4;
+    reply->from = iphdr->ip_src;
+
+    if (iphdr->ip_p == IPPROTO_TCP) {
+        if (len < ip_len + TCP_HDRLEN) {
+            return REPLY_NONE;
+        }
+        struct tcphdr *tcphdr = (struct tcphdr*) (buf + ip_len);
+        if (tcphdr->th_flags & TH_RST) {
+            reply->kind = REPLY_RST;
+        } else if ((tcphdr->th_flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+            reply->kind = REPLY_SYNACK;
+        } else {
+            return REPLY_NONE;
+        }
+        reply->port = ntohs(tcphdr->th_sport);
+        reply->local_port = ntohs(tcphdr->th_dport);
+        reply->seq = ntohl(tcphdr->th_ack) - 1;
+        reply->protocol = IPPROTO_TCP;
+    } else if (iphdr->ip_p == IPPROTO_ICMP) {
+        if (len < ip_len + ICMP_MINLEN + IP4_HDRLEN) {
+            return REPLY_NONE;
+        }
+        struct icmp *icmphdr = (struct icmp*) (buf + ip_len);
+        int kind;
+        if (icmphdr->icmp_type == ICMP_TIMXCEED) {
+            kind = REPLY_TIME_EXCEEDED;
+        } else if (icmphdr->icmp_type == ICMP_UNREACH && icmphdr->icmp_code == ICMP_UNREACH_PORT) {
+            kind = REPLY_UNREACHABLE;
+        } else {
+            return REPLY_NONE;
+        }
+
+        // quoted probe
+        struct ip *quoted = (struct ip*) (buf + ip_len + ICMP_MINLEN);
+        int quoted_len = quoted->ip_hl * 4;
+        if (len < ip_len + ICMP_MINLEN + quoted_len + 8) {
+            return REPLY_NONE;
+        }
+        char *transport = (char*) quoted + quoted_len;
+        if (quoted->ip_p == IPPROTO_TCP) {
+            struct tcphdr *tcphdr = (struct tcphdr*) transport;
+            reply->port = ntohs(tcphdr->th_dport);
+            reply->local_port = ntohs(tcphdr->th_sport);
+            reply->seq = ntohl(tcphdr->th_seq);
+        } else if (quoted->ip_p == IPPROTO_UDP) {
+            struct udphdr *udphdr = (struct udphdr*) transport;
+            reply->port = ntohs(udphdr->uh_dport);
+            reply->local_port = ntohs(udphdr->uh_sport);
+        } else {
+            return REPLY_NONE;
+        }
+        reply->protocol = quoted->ip_p;
+        reply->kind = kind;
+    }
 
-    LOGP("Successfully generated checksums.\n");
-    return datagram;
+    return reply->kind;
 }
@@ -1,15 +1,56 @@
 /**
  * @file
  *
- * Defines ip and tcp header helper functions.
+ * Defines ip, tcp, and udp header helper functions.
  */
 
 #ifndef _HEADERS_H_
 #define _HEADERS_H_
 
+#include <stdint.h>
+#include <netinet/in.h>
+
 #define IP4_HDRLEN 20
 #define TCP_HDRLEN 20
+#define UDP_HDRLEN 8
+#define SYN_LEN (IP4_HDRLEN + TCP_HDRLEN)
+#define UDP_FRAME_HDRLEN (IP4_HDRLEN + UDP_HDRLEN)
+
+enum reply_kind {
+    REPLY_NONE,             // not a reply to a probe
+    REPLY_RST,              // tcp rst from a closed port
+    REPLY_TIME_EXCEEDED,    // icmp time exceeded from the hop where the probe expired
+    REPLY_UNREACHABLE,      // icmp port unreachable from the destination
+    REPLY_SYNACK,           // tcp syn-ack from an open port
+};
+
+struct probe_reply {
+    int kind;               // reply_kind value
+    int protocol;           // IPPROTO_TCP or IPPROTO_UDP probe
+    uint16_t port;          // destination port of the probe
+    uint16_t local_port;    // source port of the probe
+    uint32_t seq;           // sequence number of the probe, 0 for udp
+    struct in_addr from;    // address that sent the reply
+};
+
+struct syn_template {
+    char packet[SYN_LEN];   // SYN with ttl 255 and sequence number 0, checksums filled in
+};
+
+struct udp_template {
+    char header[UDP_FRAME_HDRLEN];  // IPv4 and UDP headers with id 0 and no udp checksum
+    int payload_len;
+    uint16_t header_sum;            // one's complement sum of pseudo header and udp header
+};
 
-char* create_syn_packet(struct sockaddr_in *src_addr, struct sockaddr_in *dst_addr, int len);
+void init_syn_template(struct syn_template *tmpl, struct sockaddr_in *src_addr,
+                        struct sockaddr_in *dst_addr);
+void stamp_syn(struct syn_template *tmpl, char *frame, uint16_t dst_port, uint32_t seq, int ttl);
+void set_syn_source_port(char *frame, uint16_t src_port);
+void stamp_rst(const char *syn, char *frame);
+void init_udp_template(struct udp_template *tmpl, struct sockaddr_in *src_addr,
+                        struct sockaddr_in *dst_addr, int payload_len, int ttl);
+void stamp_udp(struct udp_template *tmpl, char *frame, const char *payload, uint16_t ip_id);
+int parse_reply(char *buf, int len, struct probe_reply *reply);
 
 #endif
@@ -0,0 +1,501 @@
+/**
+ * @file
+ *
+ * Contains the multi-target scanner of the standalone application.
+ * Trains to many targets are in flight at once from one raw socket and
+ * one UDP socket. While one target pauses between its trains or waits
+ * for its RSTs, trains to the others go out, paced by a global rate
+ * cap. A socket filter lets only RSTs to our SYN port through, and the
+ * replies are handed to the target they came from, whose state machine
+ * moves from idle through the low and high entropy trains to done.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "analysis.h"
+#include "headers.h"
+#include "scan.h"
+#include "sockets.h"
+#include "util.h"
+#include "logger.h"
+
+#define RECV_BUFFER 1024
+#define SCAN_POLL_INTERVAL 10   // ms between checks of the target states
+
+// probes bracketing the trains of a target
+enum scan_slot {
+    LOW_HEAD,
+    LOW_TAIL,
+    HIGH_HEAD,
+    HIGH_TAIL,
+    SCAN_SLOTS
+};
+
+enum target_state {
+    TARGET_IDLE,        // waiting for the rate cap to send the low entropy train
+    TARGET_LOW_SENT,    // pausing before the high entropy train
+    TARGET_HIGH_SENT,   // waiting for the RSTs
+    TARGET_DONE,
+};
+
+struct target {
+    char address[ROUTER_LEN];
+    struct in_addr addr;
+    struct sockaddr_in syn_addrs[2];    // head and tail ports
+    struct sockaddr_in udp_addr;
+    char frames[SCAN_SLOTS][SYN_LEN];   // SYNs, stamped from the target's template
+    uint32_t seqs[SCAN_SLOTS];
+    bool answered[SCAN_SLOTS];
+    struct timeval reply_times[SCAN_SLOTS];
+    int state;                          // target_state value
+    struct timeval next;                // when the state times out
+};
+
+struct scanner {
+    struct scan_config *configs;
+    int raw_sock;
+    int udp_sock;
+    struct sockaddr_in *src_addr;       // client address and SYN port
+    char *trains[2];                    // low and high entropy payloads
+    struct target *active[MAX_SCAN_PARALLEL];
+    int active_count;
+    struct timeval send_allowed;        // earliest start of the next train
+    double train_micro;                 // time a train takes at the rate cap
+    bool json;
+};
+
+/**
+ * Reads the target list, one IPv4 address per line. Blank lines and
+ * lines starting with # are skipped.
+ *
+ * filename: path of the target list
+ * targets: filled with a malloced array of addresses
+ *
+ * returns: number of targets, -1 if the list could not be read
+ */
+int read_targets(char *filename, char (**targets)[ROUTER_LEN])
+{
+    struct stat buf;
+    if (stat(filename, &buf) < 0) {
+        perror("Error retrieving target list info");
+        return -1;
+    }
+    char *contents = read_file(filename, buf.st_size);
+    if (contents == NULL) {
+        return -1;
+    }
+    char *terminated = realloc(contents, buf.st_size + 1);
+    if (terminated == NULL) {
+        perror("Error reallocing target list");
+        free(contents);
+        return -1;
+    }
+    contents = terminated;
+    contents[buf.st_size] = '\0';
+
+    int count = 0;
+    int size = 64;
+    *targets = malloc(size * ROUTER_LEN);
+    if (*targets == NULL) {
+        perror("Error mallocing targets");
+        free(contents);
+        return -1;
+    }
+
+    char *saveptr;
+    for (char *line = strtok_r(contents, "\n", &saveptr); line != NULL;
+            line = strtok_r(NULL, "\n", &saveptr)) {
+        line += strspn(line, " \t");
+        line[strcspn(line, " \t\r#")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+
+        struct in_addr addr;
+        if (inet_pton(AF_INET, line, &addr) != 1) {
+            fprintf(stderr, "Skipping invalid target %s\n", line);
+            continue;
+        }
+        if (count == size) {
+            size *= 2;
+            char (*grown)[ROUTER_LEN] = realloc(*targets, size * ROUTER_LEN);
+            if (grown == NULL) {
+                perror("Error reallocing targets");
+                free(*targets);
+                free(contents);
+                return -1;
+            }
+            *targets = grown;
+        }
+        inet_ntop(AF_INET, &addr, (*targets)[count++], ROUTER_LEN);
+    }
+
+    free(contents);
+    return count;
+}
+
+/**
+ * Sets up a target and stamps its SYNs
+ *
+ * sc: pointer to scanner struct
+ * address: dotted decimal address of the target
+ *
+ * returns: pointer to target struct if successful, NULL otherwise
+ */
+struct target* create_target(struct scanner *sc, char *address)
+{
+    struct scan_config *configs = sc->configs;
+    struct target *t = calloc(1, sizeof(struct target));
+    if (t == NULL) {
+        perror("Error mallocing target");
+        return NULL;
+    }
+    strcpy(t->address, address);
+    inet_pton(AF_INET, address, &t->addr);
+
+    uint16_t ports[2] = { configs->tcp_head_dest, configs->tcp_tail_dest };
+    for (int i = 0; i < 2; i++) {
+        t->syn_addrs[i].sin_family = AF_INET;
+        t->syn_addrs[i].sin_addr = t->addr;
+        t->syn_addrs[i].sin_port = htons(ports[i]);
+    }
+    t->udp_addr = t->syn_addrs[0];
+    t->udp_addr.sin_port = htons(configs->udp_dest_port);
+
+    struct syn_template tmpl;
+    init_syn_template(&tmpl, sc->src_addr, &t->syn_addrs[0]);
+    for (int slot = 0; slot < SCAN_SLOTS; slot++) {
+        bool head = slot == LOW_HEAD || slot == HIGH_HEAD;
+        t->seqs[slot] = rand();
+        stamp_syn(&tmpl, t->frames[slot], head ? configs->tcp_head_dest : configs->tcp_tail_dest,
+                    t->seqs[slot], 255);
+    }
+
+    t->state = TARGET_IDLE;
+    return t;
+}
+
+/**
+ * Sends a target's head SYN, a train, and its tail SYN, and charges
+ * the train to the rate cap
+ *
+ * sc: pointer to scanner struct
+ * t: pointer to target struct
+ * high_entropy: send the high entropy train instead of the low entropy one
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_target_train(struct scanner *sc, struct target *t, bool high_entropy)
+{
+    struct scan_config *configs = sc->configs;
+    int head = high_entropy ? HIGH_HEAD : LOW_HEAD;
+    int tail = high_entropy ? HIGH_TAIL : LOW_TAIL;
+    char *train = sc->trains[high_entropy ? 1 : 0];
+
+    send_packet(sc->raw_sock, t->frames[head], SYN_LEN, &t->syn_addrs[0]);
+    for (int i = 0; i < configs->udp_train_size; i++) {
+        char *payload = train + (size_t) i * configs->udp_payload_size;
+        if (send_packet(sc->udp_sock, payload, configs->udp_payload_size, &t->udp_addr) < 0) {
+            return -1;
+        }
+    }
+    send_packet(sc->raw_sock, t->frames[tail], SYN_LEN, &t->syn_addrs[1]);
+
+    // a token bucket of one train, trains go out at line rate but
+    // no faster than the cap on average
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    if (time_diff_micro(sc->send_allowed, now) < 0) {
+        sc->send_allowed = now;
+    }
+    long usec = sc->send_allowed.tv_usec + (long) sc->train_micro;
+    sc->send_allowed.tv_sec += usec / 1000000;
+    sc->send_allowed.tv_usec = usec % 1000000;
+
+    LOG("%s entropy train sent to %s.\n", high_entropy ? "High" : "Low", t->address);
+    return 1;
+}
+
+/**
+ * Hands a reply to the active target it came from
+ *
+ * sc: pointer to scanner struct
+ * reply: pointer to parsed probe_reply struct
+ * stamp: arrival time of the reply
+ */
+void dispatch_reply(struct scanner *sc, struct probe_reply *reply, struct timeval stamp)
+{
+    if (reply->kind != REPLY_RST || reply->local_port != sc->configs->tcp_port) {
+        return;
+    }
+
+    for (int i = 0; i < sc->active_count; i++) {
+        struct target *t = sc->active[i];
+        if (t->addr.s_addr != reply->from.s_addr) {
+            continue;
+        }
+        for (int slot = 0; slot < SCAN_SLOTS; slot++) {
+            bool head = slot == LOW_HEAD || slot == HIGH_HEAD;
+            uint16_t port = head ? sc->configs->tcp_head_dest : sc->configs->tcp_tail_dest;
+            if (!t->answered[slot] && reply->port == port && reply->seq == t->seqs[slot]) {
+                t->answered[slot] = true;
+                t->reply_times[slot] = stamp;
+                LOG("RST for %s port %d received.\n", t->address, port);
+            }
+        }
+        return;
+    }
+}
+
+/**
+ * Turns a finished target's replies into a result and writes its record
+ *
+ * sc: pointer to scanner struct
+ * t: pointer to target struct
+ */
+void report_target(struct scanner *sc, struct target *t)
+{
+    struct scan_config *configs = sc->configs;
+    struct compression_result result;
+    init_result(&result);
+
+    bool answered = true;
+    for (int slot = 0; slot < SCAN_SLOTS; slot++) {
+        answered = answered && t->answered[slot];
+    }
+    if (answered) {
+        result.valid = true;
+        result.low_delta = time_diff_micro(t->reply_times[LOW_TAIL], t->reply_times[LOW_HEAD]) / 1000;
+        result.high_delta = time_diff_micro(t->reply_times[HIGH_TAIL], t->reply_times[HIGH_HEAD]) / 1000;
+        result.low_bytes = (long) configs->udp_train_size * configs->udp_payload_size;
+        result.high_bytes = result.low_bytes;
+        judge_deltas(&result, configs->threshold, configs->ratio_threshold);
+    }
+
+    if (sc->json) {
+        char *text = result_to_json(&result);
+        if (text != NULL) {
+            printf("{\"target\":\"%s\",\"result\":%s}\n", t->address, text);
+            free(text);
+        }
+    } else if (result.valid) {
+        printf("%s: %s Low entropy: %.3fms, high entropy: %.3fms\n", t->address,
+                result_message(&result), result.low_delta, result.high_delta);
+    } else {
+        printf("%s: %s\n", t->address, result_message(&result));
+    }
+    // records stream out as targets finish
+    fflush(stdout);
+}
+
+/**
+ * Moves every active target on whose state is due, and retires the
+ * finished ones
+ *
+ * sc: pointer to scanner struct
+ *
+ * returns: number of targets finished, -1 if sending failed
+ */
+int step_targets(struct scanner *sc)
+{
+    struct scan_config *configs = sc->configs;
+    int finished = 0;
+
+    for (int i = 0; i < sc->active_count; i++) {
+        struct target *t = sc->active[i];
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        bool due = time_diff_micro(now, t->next) >= 0;
+        bool may_send = time_diff_micro(now, sc->send_allowed) >= 0;
+
+        if (t->state == TARGET_IDLE && may_send) {
+            if (send_target_train(sc, t, false) < 0) {
+                return -1;
+            }
+            t->state = TARGET_LOW_SENT;
+            gettimeofday(&t->next, NULL);
+            t->next.tv_sec += configs->inter_measurement_time;
+        } else if (t->state == TARGET_LOW_SENT && due && may_send) {
+            if (send_target_train(sc, t, true) < 0) {
+                return -1;
+            }
+            t->state = TARGET_HIGH_SENT;
+            gettimeofday(&t->next, NULL);
+            t->next.tv_sec += configs->rst_timeout;
+        } else if (t->state == TARGET_HIGH_SENT) {
+            bool answered = true;
+            for (int slot = 0; slot < SCAN_SLOTS; slot++) {
+                answered = answered && t->answered[slot];
+            }
+            if (answered || due) {
+                t->state = TARGET_DONE;
+            }
+        }
+
+        if (t->state == TARGET_DONE) {
+            report_target(sc, t);
+            free(t);
+            sc->active[i--] = sc->active[--sc->active_count];
+            finished++;
+        }
+    }
+
+    return finished;
+}
+
+/**
+ * Reads every queued reply from the raw socket
+ *
+ * sc: pointer to scanner struct
+ */
+void drain_replies(struct scanner *sc)
+{
+    char buf[RECV_BUFFER];
+    struct timeval stamp;
+    struct probe_reply reply;
+    int len;
+    while ((len = receive_datagram_stamped(sc->raw_sock, buf, RECV_BUFFER, &stamp)) >= 0) {
+        parse_reply(buf, len, &reply);
+        dispatch_reply(sc, &reply, stamp);
+    }
+}
+
+/**
+ * Opens the sockets shared by all targets and builds the train payloads
+ *
+ * sc: pointer to scanner struct
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int open_scanner(struct scanner *sc)
+{
+    struct scan_config *configs = sc->configs;
+
+    // kernel timestamps, since replies queue while trains go out
+    if ((sc->raw_sock = create_raw_socket()) < 0
+            || add_timestamp_opt(sc->raw_sock) < 0
+            || attach_rst_filter(sc->raw_sock, configs->tcp_port) < 0) {
+        return -1;
+    }
+    if (fcntl(sc->raw_sock, F_SETFL, O_NONBLOCK) < 0) {
+        perror("Error making raw socket non-blocking");
+        return -1;
+    }
+
+    struct sockaddr_in *udp_addr;
+    if ((udp_addr = set_addr_struct(INADDR_ANY, configs->udp_source_port)) == NULL) {
+        return -1;
+    }
+    if ((sc->udp_sock = create_udp_socket()) < 0
+            || set_df_opt(sc->udp_sock) < 0
+            || add_ttl_opt(sc->udp_sock, configs->udp_ttl) < 0
+            || bind_port(sc->udp_sock, udp_addr) < 0) {
+        free(udp_addr);
+        return -1;
+    }
+    free(udp_addr);
+
+    if ((sc->src_addr = set_addr_struct(configs->client_ip, configs->tcp_port)) == NULL) {
+        return -1;
+    }
+
+    // every target gets the same payloads
+    for (int e = 0; e < 2; e++) {
+        sc->trains[e] = create_entropy_train(0, configs->udp_train_size, configs->udp_payload_size,
+                                                e == 0 ? 0 : 8);
+        if (sc->trains[e] == NULL) {
+            return -1;
+        }
+    }
+
+    // ip and udp headers count against the cap
+    double bits = 8.0 * configs->udp_train_size * (configs->udp_payload_size + UDP_FRAME_HDRLEN);
+    sc->train_micro = configs->rate > 0 ? bits / configs->rate : 0;
+    gettimeofday(&sc->send_allowed, NULL);
+
+    return 1;
+}
+
+/**
+ * Measures every target of the list, parallel targets at a time, and
+ * writes one record per target as it finishes
+ *
+ * configs: pointer to scan_config struct
+ * json: write the records as json lines
+ *
+ * returns: number of targets scanned, -1 if the scan failed
+ */
+int run_scan(struct scan_config *configs, bool json)
+{
+    char (*addresses)[ROUTER_LEN];
+    int count = read_targets(configs->targets, &addresses);
+    if (count < 0) {
+        return -1;
+    }
+    LOG("Scanning %d targets.\n", count);
+
+    struct scanner sc;
+    memset(&sc, 0, sizeof(struct scanner));
+    sc.configs = configs;
+    sc.json = json;
+    if (open_scanner(&sc) < 0) {
+        free(addresses);
+        return -1;
+    }
+
+    int next = 0;
+    int done = 0;
+    int status = count;
+    struct pollfd fds = { .fd = sc.raw_sock, .events = POLLIN };
+    while (done < count) {
+        while (sc.active_count < configs->parallel && next < count) {
+            struct target *t = create_target(&sc, addresses[next++]);
+            if (t == NULL) {
+                status = -1;
+                break;
+            }
+            sc.active[sc.active_count++] = t;
+        }
+        if (status < 0) {
+            break;
+        }
+
+        int finished = step_targets(&sc);
+        if (finished < 0) {
+            status = -1;
+            break;
+        }
+        done += finished;
+
+        if (poll(&fds, 1, SCAN_POLL_INTERVAL) < 0 && errno != EINTR) {
+            perror("Error polling raw socket");
+            status = -1;
+            break;
+        }
+        drain_replies(&sc);
+    }
+
+    for (int i = 0; i < sc.active_count; i++) {
+        free(sc.active[i]);
+    }
+    free(addresses);
+    free(sc.src_addr);
+    free(sc.trains[0]);
+    free(sc.trains[1]);
+    close(sc.raw_sock);
+    close(sc.udp_sock);
+
+    return status;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file
+ *
+ * Defines the multi-target standalone scanner.
+ */
+
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define MAX_SCAN_PARALLEL 64    // targets measured at once
+
+struct scan_config {
+    char *client_ip;
+    char *targets;              // file with one target address per line
+    uint16_t tcp_port;          // source port of the SYNs
+    uint16_t tcp_head_dest;
+    uint16_t tcp_tail_dest;
+    uint16_t udp_source_port;
+    uint16_t udp_dest_port;
+    int udp_payload_size;
+    int udp_train_size;
+    int udp_ttl;
+    int inter_measurement_time; // s between the low and high entropy train of a target
+    int rst_timeout;            // s a target gets to answer after its high entropy train
+    int threshold;
+    double ratio_threshold;
+    int parallel;               // targets measured at once
+    double rate;                // cap on the train send rate over all targets (Mbit/s), 0 for none
+};
+
+int run_scan(struct scan_config *configs, bool json);
+
+#endif
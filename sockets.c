@@ -4,6 +4,8 @@
  * Contains tcp, udp, and raw socket helper functions.
  */
 
+#define _GNU_SOURCE     // recvmmsg
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -11,13 +13,17 @@
 #include <errno.h>
 
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <linux/filter.h>
+#include <linux/tcp.h>
 
+#include "sockets.h"
 #include "logger.h"
 
-#define RECV_BUFFER 1024
-
 /**
  * Creates a sockaddr_in struct for the given ip and port numbers
  *
@@ -75,6 +81,22 @@ int create_raw_socket()
     return sockfd;
 }
 
+/**
+ * Creates raw socket for receiving ICMP messages
+ *
+ * returns: raw socket file descriptor if successful, -1 otherwise
+ */
+int create_icmp_socket()
+{
+    int sockfd;
+    if ((sockfd = socket(PF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
+        perror("Error creating icmp socket");
+        return -1;
+    }
+
+    return sockfd;
+}
+
 /**
  * Adds timeout option to socket
  *
@@ -96,6 +118,254 @@ int add_timeout_opt(int sockfd, int wait_time)
     return sockfd;
 }
 
+/**
+ * Adds timeout option to socket with millisecond granularity
+ *
+ * sockfd: socket file descriptor
+ * wait_milli: timeout time in milliseconds
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_timeout_opt_milli(int sockfd, int wait_milli)
+{
+    struct timeval timeout;
+    timeout.tv_sec = wait_milli / 1000;
+    timeout.tv_usec = (wait_milli % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) == -1) {
+        perror("Cannot add receive timeout");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Adds send timeout option to socket with millisecond granularity,
+ * which also bounds how long connect() waits for the handshake
+ *
+ * sockfd: socket file descriptor
+ * wait_milli: timeout time in milliseconds
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_send_timeout_opt_milli(int sockfd, int wait_milli)
+{
+    struct timeval timeout;
+    timeout.tv_sec = wait_milli / 1000;
+    timeout.tv_usec = (wait_milli % 1000) * 1000;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) == -1) {
+        perror("Cannot add send timeout");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Adds receive timestamp option to socket, so the kernel stamps
+ * each datagram when it arrives rather than when it is read
+ *
+ * sockfd: socket file descriptor
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_timestamp_opt(int sockfd)
+{
+    const int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) < 0) {
+        perror("Cannot add timestamp option");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Adds the receive queue overflow option to socket, so every datagram
+ * comes with the number of datagrams the socket has dropped so far,
+ * see receive_datagram_meta
+ *
+ * sockfd: socket file descriptor
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_drop_count_opt(int sockfd)
+{
+    const int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on)) < 0) {
+        perror("Cannot add drop count option");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Adds the UDP GRO option to socket, so the kernel may coalesce
+ * datagrams of one flow into a single read, see
+ * receive_datagram_meta
+ *
+ * sockfd: udp socket file descriptor
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_gro_opt(int sockfd)
+{
+    const int on = 1;
+    if (setsockopt(sockfd, IPPROTO_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        perror("Cannot add udp gro option");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Adds busy polling to socket. Reads then poll the device queue for up
+ * to usecs before they sleep, and with SO_PREFER_BUSY_POLL the device
+ * leaves its interrupts off while the socket keeps polling. Polling
+ * longer than net.core.busy_read needs CAP_NET_ADMIN.
+ *
+ * sockfd: socket file descriptor
+ * usecs: microseconds to poll for
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int add_busy_poll_opt(int sockfd, int usecs)
+{
+    const int on = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0) {
+        perror("Cannot add busy poll option");
+        return -1;
+    }
+    if (setsockopt(sockfd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on)) < 0) {
+        perror("Cannot add prefer busy poll option");
+        return -1;
+    }
+
+    return sockfd;
+}
+
+/**
+ * Sizes the receive buffer of a socket to queue a number of datagrams.
+ * Each queued datagram is charged its whole skb, which for a 1000 byte
+ * payload comes to about 2.4KB, more than the kernel's doubling of the
+ * size covers. SO_RCVBUFFORCE goes past net.core.rmem_max but needs
+ * CAP_NET_ADMIN, without it the size is capped.
+ *
+ * sockfd: socket file descriptor
+ * datagrams: datagrams the buffer should hold
+ * payload_size: payload bytes per datagram
+ *
+ * returns: receive buffer size the kernel settled on if successful, -1 otherwise
+ */
+int set_receive_buffer(int sockfd, int datagrams, int payload_size)
+{
+    int bytes = datagrams * (payload_size + DATAGRAM_OVERHEAD);
+    if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) < 0
+            && setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes)) < 0) {
+        perror("Cannot set receive buffer size");
+        return -1;
+    }
+
+    int size;
+    socklen_t len = sizeof(size);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0) {
+        perror("Cannot get receive buffer size");
+        return -1;
+    }
+    if (size < 2 * bytes) {
+        LOG("Receive buffer capped at %d bytes, raise net.core.rmem_max to fit %d datagrams.\n",
+            size / 2, datagrams);
+    }
+
+    return size;
+}
+
+/**
+ * Reads the udp error counters of the network namespace from
+ * /proc/net/snmp. They cover every udp socket of the namespace.
+ *
+ * counters: pointer to udp_counters struct to fill, -1 where unknown
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int get_udp_counters(struct udp_counters *counters)
+{
+    counters->in_errors = -1;
+    counters->rcvbuf_errors = -1;
+    FILE *snmp = fopen("/proc/net/snmp", "r");
+    if (snmp == NULL) {
+        perror("Error opening /proc/net/snmp");
+        return -1;
+    }
+
+    // a header line names the fields, the next line holds the values
+    char header[512];
+    char values[512];
+    int status = -1;
+    while (fgets(header, sizeof(header), snmp) != NULL) {
+        if (strncmp(header, "Udp:", 4) != 0) {
+            continue;
+        }
+        if (fgets(values, sizeof(values), snmp) == NULL) {
+            break;
+        }
+        char *header_save, *values_save;
+        char *name = strtok_r(header, " \n", &header_save);
+        char *value = strtok_r(values, " \n", &values_save);
+        while (name != NULL && value != NULL) {
+            if (strcmp(name, "InErrors") == 0) {
+                counters->in_errors = atol(value);
+            } else if (strcmp(name, "RcvbufErrors") == 0) {
+                counters->rcvbuf_errors = atol(value);
+            }
+            name = strtok_r(NULL, " \n", &header_save);
+            value = strtok_r(NULL, " \n", &values_save);
+        }
+        status = counters->in_errors >= 0 && counters->rcvbuf_errors >= 0 ? 1 : -1;
+        break;
+    }
+    fclose(snmp);
+
+    if (status < 0) {
+        fprintf(stderr, "No udp counters in /proc/net/snmp\n");
+    }
+    return status;
+}
+
+/**
+ * Attaches a socket filter to a raw TCP socket that only lets RSTs to
+ * the given port through, so the kernel drops every other TCP segment
+ * before it is queued on the socket
+ *
+ * sockfd: raw socket file descriptor
+ * port: local port the RSTs are sent to
+ *
+ * returns: socket file descriptor if successful, -1 otherwise
+ */
+int attach_rst_filter(int sockfd, uint16_t port)
+{
+    // raw sockets see the packet from the IP header on
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),             // x = IP header length
+        BPF_STMT(BPF_LD | BPF_H | BPF_IND, 2),              // TCP destination port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 3),
+        BPF_STMT(BPF_LD | BPF_B | BPF_IND, 13),             // TCP flags
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x04, 0, 1),   // RST
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog prog = { .len = sizeof(code) / sizeof(code[0]), .filter = code };
+
+    if (setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0) {
+        perror("Cannot attach rst filter");
+        return -1;
+    }
+
+    return sockfd;
+}
+
 /**
  * Adds dont fragment bit option to socket
  *
@@ -291,6 +561,170 @@ char* receive_stream(int sockfd)
     return buf;
 }
 
+/**
+ * Receives data stream across tcp connection until the peer
+ * closes it, for messages that may not fit in RECV_BUFFER
+ *
+ * sockfd: tcp socket file descriptor
+ *
+ * returns: char pointer to received data if successful, NULL otherwise
+ */
+char* receive_stream_all(int sockfd)
+{
+    int size = RECV_BUFFER;
+    int len = 0;
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        perror("Error mallocing buf");
+        return NULL;
+    }
+
+    int bytes_received;
+    while ((bytes_received = recv(sockfd, buf + len, size - len - 1, 0)) > 0) {
+        len += bytes_received;
+        if (len == size - 1) {
+            char *grown = realloc(buf, size * 2);
+            if (grown == NULL) {
+                perror("Error reallocing buf");
+                free(buf);
+                return NULL;
+            }
+            buf = grown;
+            size *= 2;
+        }
+    }
+    if (bytes_received < 0) {
+        perror("Error receiving bytes");
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/**
+ * Sends a message across a tcp connection, prefixed with its length
+ * so the peer can tell when it has all of it
+ *
+ * sockfd: tcp socket file descriptor
+ * msg: null terminated message
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int send_message(int sockfd, char *msg)
+{
+    uint32_t len = strlen(msg);
+    uint32_t prefix = htonl(len);
+    char *parts[2] = { (char *) &prefix, msg };
+    uint32_t sizes[2] = { sizeof(prefix), len };
+    for (int i = 0; i < 2; i++) {
+        uint32_t sent = 0;
+        while (sent < sizes[i]) {
+            int bytes = send(sockfd, parts[i] + sent, sizes[i] - sent, 0);
+            if (bytes < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("Error sending message");
+                return -1;
+            }
+            sent += bytes;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Reads exactly size bytes from a tcp connection
+ *
+ * sockfd: tcp socket file descriptor
+ * buf: buffer of at least size bytes
+ * size: number of bytes to read
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+static int receive_exact(int sockfd, char *buf, uint32_t size)
+{
+    uint32_t len = 0;
+    while (len < size) {
+        int bytes = recv(sockfd, buf + len, size - len, 0);
+        if (bytes < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error receiving bytes");
+            return -1;
+        }
+        if (bytes == 0) {
+            fprintf(stderr, "Connection closed in the middle of a message\n");
+            return -1;
+        }
+        len += bytes;
+    }
+    return 1;
+}
+
+/**
+ * Receives a message sent with send_message
+ *
+ * sockfd: tcp socket file descriptor
+ *
+ * returns: null terminated message if successful, NULL otherwise
+ */
+char* receive_message(int sockfd)
+{
+    uint32_t prefix;
+    if (receive_exact(sockfd, (char *) &prefix, sizeof(prefix)) < 0) {
+        return NULL;
+    }
+    uint32_t len = ntohl(prefix);
+    if (len > MAX_MESSAGE) {
+        fprintf(stderr, "Message of %u bytes is over the %d byte limit\n", len, MAX_MESSAGE);
+        return NULL;
+    }
+
+    char *buf = malloc(len + 1);
+    if (buf == NULL) {
+        perror("Error mallocing buf");
+        return NULL;
+    }
+    if (receive_exact(sockfd, buf, len) < 0) {
+        free(buf);
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    return buf;
+}
+
+/**
+ * Reads the kernel's view of a tcp connection. The delivery rate
+ * needs Linux 4.9 and stays 0 until the sender has a sample.
+ *
+ * sockfd: connected tcp socket file descriptor
+ * sample: pointer to tcp_sample struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int get_tcp_sample(int sockfd, struct tcp_sample *sample)
+{
+    struct tcp_info info;
+    memset(&info, 0, sizeof(info));
+    socklen_t len = sizeof(info);
+    if (getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) {
+        perror("Cannot read tcp info");
+        return -1;
+    }
+
+    sample->delivery_rate = (double) info.tcpi_delivery_rate;
+    sample->rtt = info.tcpi_rtt / 1000.0;
+    sample->rcv_rtt = info.tcpi_rcv_rtt / 1000.0;
+    sample->retransmits = info.tcpi_total_retrans;
+    return 1;
+}
+
 // ------------------- UDP Specific Functions ------------------- //
 
 /**
@@ -389,3 +823,228 @@ char* receive_packet(int sockfd, struct sockaddr_in *sin)
 
     return buf;
 }
+
+/**
+ * Receives a datagram along with its kernel arrival timestamp, see
+ * add_timestamp_opt. Falls back to the current time if the kernel
+ * did not stamp the datagram.
+ *
+ * sockfd: socket file descriptor
+ * buf: buffer to fill
+ * size: size of the buffer
+ * stamp: filled with the arrival time
+ *
+ * returns: number of bytes received if successful, -1 otherwise
+ */
+int receive_datagram_stamped(int sockfd, char *buf, int size, struct timeval *stamp)
+{
+    char control[CMSG_SPACE(sizeof(struct timeval))];
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int bytes_received;
+    if ((bytes_received = recvmsg(sockfd, &msg, 0)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        perror("Error receiving packet");
+        return -1;
+    }
+
+    gettimeofday(stamp, NULL);
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(stamp, CMSG_DATA(cmsg), sizeof(struct timeval));
+        }
+    }
+
+    return bytes_received;
+}
+
+/**
+ * Fills a datagram_meta struct from the control messages of a read,
+ * all but the read time
+ *
+ * msg: pointer to msghdr struct of the read
+ * bytes_received: bytes the read returned
+ * meta: pointer to datagram_meta struct to fill
+ */
+static void parse_datagram_meta(struct msghdr *msg, int bytes_received, struct datagram_meta *meta)
+{
+    // the kernel leaves the count out while it is zero
+    meta->drops = 0;
+    meta->segment_size = bytes_received;
+    meta->stamped = false;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&meta->drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+        } else if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&meta->segment_size, CMSG_DATA(cmsg), sizeof(int));
+        } else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMP) {
+            memcpy(&meta->stamp, CMSG_DATA(cmsg), sizeof(struct timeval));
+            meta->stamped = true;
+        }
+    }
+    if (meta->segment_size <= 0) {
+        meta->segment_size = bytes_received;
+    }
+}
+
+/**
+ * Receives a datagram into a caller provided buffer, along with what
+ * the kernel reports about it: the socket's drop count, see
+ * add_drop_count_opt, taken when the datagram is queued so it covers
+ * the drops before it, the arrival time, see add_timestamp_opt, and
+ * with UDP GRO the size of the datagrams the read holds back to back,
+ * the last one possibly shorter. A buffer of GRO_BUFFER bytes fits
+ * any such read.
+ *
+ * sockfd: socket file descriptor
+ * buf: buffer to fill
+ * size: size of buffer
+ * sin: pointer to sockaddr_in struct to be filled
+ * meta: pointer to datagram_meta struct to fill
+ * flags: recvmsg flags, MSG_DONTWAIT to return right away
+ *
+ * returns: number of bytes received if successful, -1 otherwise
+ */
+int receive_datagram_meta(int sockfd, char *buf, int size, struct sockaddr_in *sin,
+                          struct datagram_meta *meta, int flags)
+{
+    char control[META_CONTROL];
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = sin;
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int bytes_received;
+    if ((bytes_received = recvmsg(sockfd, &msg, flags)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        perror("Error receiving packet");
+        return -1;
+    }
+    gettimeofday(&meta->read, NULL);
+    parse_datagram_meta(&msg, bytes_received, meta);
+
+    return bytes_received;
+}
+
+/**
+ * Allocates the buffers of a datagram batch
+ *
+ * batch: pointer to datagram_batch struct
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int init_datagram_batch(struct datagram_batch *batch)
+{
+    batch->count = 0;
+    batch->bufs = malloc((size_t) RECV_BATCH * GRO_BUFFER);
+    if (batch->bufs == NULL) {
+        perror("Error mallocing datagram batch");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Frees the buffers of a datagram batch
+ *
+ * batch: pointer to datagram_batch struct
+ */
+void free_datagram_batch(struct datagram_batch *batch)
+{
+    free(batch->bufs);
+    batch->bufs = NULL;
+    batch->count = 0;
+}
+
+/**
+ * Receives up to RECV_BATCH datagrams with one recvmmsg, each with
+ * the metadata receive_datagram_meta reports. A blocking read waits
+ * for the first datagram only and takes whatever else is queued. A
+ * busy read spins on non-blocking reads instead of sleeping until one
+ * arrives, so datagrams are read as soon as they are queued, and gives
+ * up once the socket's receive timeout, see add_timeout_opt, has
+ * passed. It only looks at the clock every SPIN_CHECKS empty reads.
+ *
+ * sockfd: socket file descriptor
+ * batch: pointer to datagram_batch struct to fill, see init_datagram_batch
+ * busy: spin rather than sleep
+ *
+ * returns: number of datagrams received if successful, -1 with errno EAGAIN on timeout, -1 otherwise
+ */
+int receive_datagram_batch(int sockfd, struct datagram_batch *batch, bool busy)
+{
+    struct iovec iovs[RECV_BATCH];
+    struct mmsghdr msgs[RECV_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int i = 0; i < RECV_BATCH; i++) {
+        iovs[i].iov_base = batch->bufs + (size_t) i * GRO_BUFFER;
+        iovs[i].iov_len = GRO_BUFFER;
+        msgs[i].msg_hdr.msg_name = &batch->addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = batch->control[i];
+        msgs[i].msg_hdr.msg_controllen = META_CONTROL;
+    }
+
+    batch->count = 0;
+    int received = recvmmsg(sockfd, msgs, RECV_BATCH, busy ? MSG_DONTWAIT : MSG_WAITFORONE, NULL);
+    if (received < 0 && busy && errno == EAGAIN) {
+        // the queue is empty, only now look up how long to spin
+        struct timeval timeout;
+        socklen_t len = sizeof(timeout);
+        if (getsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, &len) < 0) {
+            perror("Cannot get receive timeout");
+            return -1;
+        }
+        struct timeval start, now;
+        gettimeofday(&start, NULL);
+        bool forever = timeout.tv_sec == 0 && timeout.tv_usec == 0;
+        double limit = timeout.tv_sec * 1000000.0 + timeout.tv_usec;
+
+        int polls = 0;
+        while ((received = recvmmsg(sockfd, msgs, RECV_BATCH, MSG_DONTWAIT, NULL)) < 0
+                && errno == EAGAIN) {
+            if (forever || ++polls < SPIN_CHECKS) {
+                continue;
+            }
+            polls = 0;
+            gettimeofday(&now, NULL);
+            if ((now.tv_sec - start.tv_sec) * 1000000.0 + (now.tv_usec - start.tv_usec) >= limit) {
+                errno = EAGAIN;
+                return -1;
+            }
+        }
+    }
+    if (received < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Error receiving packets");
+        }
+        return -1;
+    }
+
+    struct timeval read;
+    gettimeofday(&read, NULL);
+    for (int i = 0; i < received; i++) {
+        batch->lengths[i] = msgs[i].msg_len;
+        batch->metas[i].read = read;
+        parse_datagram_meta(&msgs[i].msg_hdr, msgs[i].msg_len, &batch->metas[i]);
+    }
+    batch->count = received;
+    return received;
+}
@@ -8,12 +8,64 @@
 #define _SOCKETS_H_
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 #define RECV_BUFFER 1024
+#define GRO_BUFFER 65536   // largest datagram UDP GRO coalesces into
+#define MAX_MESSAGE 1048576     // largest length prefixed message accepted
+#define RECV_BATCH 16       // datagrams a batched read takes at once
+#define SPIN_CHECKS 256     // empty polls between two looks at the clock while spinning
+#define DATAGRAM_OVERHEAD 512     // bytes of skb bookkeeping charged to a queued datagram, on top of the kernel's doubling
+
+struct tcp_sample {
+    double delivery_rate;   // sender's latest delivery rate (bytes/s), 0 if none
+    double rtt;             // smoothed rtt (ms)
+    double rcv_rtt;         // receiver's rtt estimate (ms), 0 if none
+    int retransmits;        // segments retransmitted over the connection
+};
+
+struct udp_counters {
+    long in_errors;         // datagrams the namespace failed to deliver
+    long rcvbuf_errors;     // of those, datagrams dropped on full receive buffers
+};
+
+struct datagram_meta {
+    uint32_t drops;         // datagrams the socket dropped so far, see add_drop_count_opt
+    int segment_size;       // size of the datagrams a UDP GRO read holds, the read size if one
+    struct timeval stamp;   // kernel arrival time, see add_timestamp_opt
+    bool stamped;           // false if the kernel did not stamp the datagram
+    struct timeval read;    // when the read returned
+};
+
+// control messages receive_datagram_meta asks for
+#define META_CONTROL (CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(int)) \
+                      + CMSG_SPACE(sizeof(struct timeval)))
+
+struct datagram_batch {
+    int count;                  // datagrams the latest read returned
+    char *bufs;                 // RECV_BATCH buffers of GRO_BUFFER bytes
+    int lengths[RECV_BATCH];
+    struct sockaddr_in addrs[RECV_BATCH];
+    struct datagram_meta metas[RECV_BATCH];
+    char control[RECV_BATCH][META_CONTROL];
+};
 
 struct sockaddr_in* set_addr_struct(char* ip, uint16_t port);
 int create_raw_socket();
+int create_icmp_socket();
 int add_timeout_opt(int sockfd, int wait_time);
+int add_timeout_opt_milli(int sockfd, int wait_milli);
+int add_send_timeout_opt_milli(int sockfd, int wait_milli);
+int add_timestamp_opt(int sockfd);
+int add_drop_count_opt(int sockfd);
+int add_gro_opt(int sockfd);
+int add_busy_poll_opt(int sockfd, int usecs);
+int set_receive_buffer(int sockfd, int datagrams, int payload_size);
+int get_udp_counters(struct udp_counters *counters);
+int attach_rst_filter(int sockfd, uint16_t port);
 int set_df_opt(int sockfd);
 int add_ttl_opt(int sockfd, int ttl);
 int create_tcp_socket();
@@ -22,9 +74,19 @@ int bind_and_listen(int sockfd, uint16_t port);
 int accept_connection(int sockfd);
 int send_stream(int sockfd, char *msg);
 char* receive_stream(int sockfd);
+char* receive_stream_all(int sockfd);
+int send_message(int sockfd, char *msg);
+char* receive_message(int sockfd);
+int get_tcp_sample(int sockfd, struct tcp_sample *sample);
 int create_udp_socket();
 int bind_port(int sockfd, struct sockaddr_in *sin);
 int send_packet(int sockfd, char *packet, int packet_size, struct sockaddr_in *sin);
 char* receive_packet(int sockfd, struct sockaddr_in *sin);
+int receive_datagram_stamped(int sockfd, char *buf, int size, struct timeval *stamp);
+int receive_datagram_meta(int sockfd, char *buf, int size, struct sockaddr_in *sin,
+                          struct datagram_meta *meta, int flags);
+int init_datagram_batch(struct datagram_batch *batch);
+void free_datagram_batch(struct datagram_batch *batch);
+int receive_datagram_batch(int sockfd, struct datagram_batch *batch, bool busy);
 
 #endif
@@ -4,10 +4,25 @@
  * Contains compression detection helper functions.
  */
 
+#define _GNU_SOURCE     // cpu affinity and per thread resource usage
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+
+#include "cJSON.h"
+#include "util.h"
 
 /**
  * Reads in file
@@ -63,6 +78,44 @@ void set_packet_id(char *payload, int id)
     }
 }
 
+/**
+ * Tags a packet with the flow it belongs to, for trains sent over
+ * several source ports at once
+ *
+ * payload: pointer to char array of packet
+ * flow: flow index, below 256
+ */
+void set_flow_tag(char *payload, int flow)
+{
+    payload[FLOW_TAG_OFFSET] = (char) flow;
+}
+
+/**
+ * Gets the flow a packet was tagged with
+ *
+ * payload: pointer to char array of packet
+ *
+ * returns: flow index
+ */
+int get_flow_tag(char *payload)
+{
+    return (uint8_t) payload[FLOW_TAG_OFFSET];
+}
+
+/**
+ * Tags a packet with the train it belongs to and the magic that lets
+ * the xdp program tell it from other datagrams to the port
+ *
+ * payload: pointer to char array of packet, at least TRAIN_TAG_SIZE bytes
+ * train: train index, below 256
+ */
+void set_train_tag(char *payload, int train)
+{
+    uint32_t magic = htonl(TRAIN_MAGIC);
+    payload[TRAIN_TAG_OFFSET] = (char) train;
+    memcpy(payload + TRAIN_MAGIC_OFFSET, &magic, sizeof(magic));
+}
+
 /**
  * Creates low entropy payload
  *
@@ -137,6 +190,351 @@ double time_diff_sec(struct timeval tv1, struct timeval tv2)
     return tv1_sec - tv2_sec;
 }
 
+/**
+ * Finds the difference in microseconds between two timeval structs (tv1 - tv2)
+ *
+ * tv1: struct timeval
+ * tv2: sturct timeval
+ *
+ * returns: double
+ */
+double time_diff_micro(struct timeval tv1, struct timeval tv2)
+{
+    double tv1_micro = (tv1.tv_sec * 1000000.0) + tv1.tv_usec;
+    double tv2_micro = (tv2.tv_sec * 1000000.0) + tv2.tv_usec;
+    return tv1_micro - tv2_micro;
+}
+
+/**
+ * Sleeps for the given number of milliseconds
+ *
+ * milli: time to sleep in milliseconds, negative values do not sleep
+ */
+void sleep_milli(int milli)
+{
+    if (milli < 0) {
+        milli = 0;
+    }
+    struct timespec ts;
+    ts.tv_sec = milli / 1000;
+    ts.tv_nsec = (milli % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) < 0) {
+        // interrupted, sleep for the remaining time
+        if (errno != EINTR) {
+            perror("Error sleeping");
+            return;
+        }
+    }
+}
+
+/**
+ * Pins the calling thread to a cpu and, if asked, moves it to the
+ * SCHED_FIFO real time class, so other tasks cannot preempt it in
+ * the middle of a train. SCHED_FIFO needs CAP_SYS_NICE.
+ *
+ * cpu: cpu to pin the thread to, -1 to leave its affinity alone
+ * fifo: switch the thread to SCHED_FIFO at RT_PRIORITY
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int set_thread_realtime(int cpu, bool fifo)
+{
+    if (cpu >= CPU_SETSIZE) {
+        fprintf(stderr, "No cpu %d\n", cpu);
+        return -1;
+    }
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Cannot pin thread to cpu %d: %s\n", cpu, strerror(err));
+            return -1;
+        }
+    }
+
+    if (fifo) {
+        struct sched_param param = { .sched_priority = RT_PRIORITY };
+        int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+        if (err != 0) {
+            fprintf(stderr, "Cannot switch thread to SCHED_FIFO: %s\n", strerror(err));
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Locks the process' current and future pages into memory, so
+ * sending never waits on a page fault
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int lock_memory()
+{
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        perror("Cannot lock memory");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Counts the times the calling thread was preempted
+ *
+ * returns: involuntary context switches of the thread so far, -1 if unknown
+ */
+long involuntary_switches()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) < 0) {
+        return -1;
+    }
+    return usage.ru_nivcsw;
+}
+
+/**
+ * Gets an optional integer config value, the config file stores all
+ * values as strings
+ *
+ * root: parsed json config
+ * key: name of the config key
+ * default_value: value to use when the key is not present
+ *
+ * returns: config value if present, default_value otherwise
+ */
+int get_config_int(cJSON *root, char *key, int default_value)
+{
+    cJSON *item = cJSON_GetObjectItem(root, key);
+    if (item == NULL || item->valuestring == NULL) {
+        return default_value;
+    }
+    return atoi(item->valuestring);
+}
+
+/**
+ * Gets an optional string config value
+ *
+ * root: parsed json config, which keeps owning the string
+ * key: name of the config key
+ * default_value: value to use when the key is not present
+ *
+ * returns: config value if present, default_value otherwise
+ */
+char* get_config_string(cJSON *root, char *key, char *default_value)
+{
+    cJSON *item = cJSON_GetObjectItem(root, key);
+    if (item == NULL || item->valuestring == NULL) {
+        return default_value;
+    }
+    return item->valuestring;
+}
+
+/**
+ * Gets an optional floating point config value
+ *
+ * root: parsed json config
+ * key: name of the config key
+ * default_value: value to use when the key is not present
+ *
+ * returns: config value if present, default_value otherwise
+ */
+double get_config_double(cJSON *root, char *key, double default_value)
+{
+    cJSON *item = cJSON_GetObjectItem(root, key);
+    if (item == NULL || item->valuestring == NULL) {
+        return default_value;
+    }
+    return atof(item->valuestring);
+}
+
+/**
+ * Gets the probing mode from the config, "detect" if not present
+ *
+ * root: parsed json config
+ *
+ * returns: probe_mode value, -1 if the mode is unknown
+ */
+int get_config_mode(cJSON *root)
+{
+    cJSON *item = cJSON_GetObjectItem(root, "mode");
+    if (item == NULL || item->valuestring == NULL || strcmp(item->valuestring, "detect") == 0) {
+        return MODE_DETECT;
+    }
+    if (strcmp(item->valuestring, "sweep") == 0) {
+        return MODE_SWEEP;
+    }
+    if (strcmp(item->valuestring, "dedup") == 0) {
+        return MODE_DEDUP;
+    }
+    if (strcmp(item->valuestring, "localize") == 0) {
+        return MODE_LOCALIZE;
+    }
+    if (strcmp(item->valuestring, "scan") == 0) {
+        return MODE_SCAN;
+    }
+    if (strcmp(item->valuestring, "tcp") == 0) {
+        return MODE_TCP;
+    }
+    fprintf(stderr, "Unknown mode: %s\n", item->valuestring);
+    return -1;
+}
+
+/**
+ * Parses a comma separated list of integers, e.g. "0,2,4,6,8"
+ *
+ * text: list to parse
+ * values: array to fill
+ * max: size of values array
+ *
+ * returns: number of values parsed, -1 if the list does not fit
+ */
+int parse_int_list(char *text, int *values, int max)
+{
+    int count = 0;
+    char *end;
+    while (*text != '\0') {
+        if (count == max) {
+            return -1;
+        }
+        values[count++] = strtol(text, &end, 10);
+        if (end == text) {
+            return -1;
+        }
+        text = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+}
+
+/**
+ * Gets the entropy levels of a sweep from the config, "0,2,4,6,8"
+ * if not present
+ *
+ * root: parsed json config
+ * levels: array of MAX_ENTROPY_LEVELS to fill
+ *
+ * returns: number of levels if successful, -1 otherwise
+ */
+int get_config_levels(cJSON *root, int *levels)
+{
+    char *text = "0,2,4,6,8";
+    cJSON *item = cJSON_GetObjectItem(root, "entropy_levels");
+    if (item != NULL && item->valuestring != NULL) {
+        text = item->valuestring;
+    }
+
+    int count = parse_int_list(text, levels, MAX_ENTROPY_LEVELS);
+    for (int i = 0; i < count; i++) {
+        if (levels[i] < 0 || levels[i] > 8) {
+            count = -1;
+        }
+    }
+    if (count <= 0) {
+        fprintf(stderr, "Invalid entropy levels: %s\n", text);
+        return -1;
+    }
+    return count;
+}
+
+/**
+ * Seeds the xorshift generator from the clock, so payloads differ
+ * from one run to the next and cannot be served from a cache
+ *
+ * returns: non-zero seed
+ */
+uint32_t random_seed()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint32_t seed = (uint32_t) (now.tv_sec * 1000003u) ^ (uint32_t) now.tv_usec;
+    return seed != 0 ? seed : 2463534242u;
+}
+
+/**
+ * Fills a buffer with bytes drawn uniformly from an alphabet of
+ * 2^bits symbols, giving an entropy of bits per byte
+ *
+ * buf: buffer to fill
+ * size: size of buffer
+ * bits: entropy in bits per byte (0 to 8)
+ * state: xorshift random state, must not be 0
+ */
+void fill_entropy(char *buf, int size, int bits, uint32_t *state)
+{
+    uint32_t mask = (1u << bits) - 1;
+    uint32_t x = *state;
+    for (int i = 0; i < size; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = (char) (x & mask);
+    }
+    *state = x;
+}
+
+/**
+ * Creates all payloads of a train at the given entropy in one buffer,
+ * payload i starts at i * payload_size and has id first_id + i. Every
+ * payload gets its own random bytes, which also differ between runs.
+ *
+ * first_id: id of the first packet
+ * train_size: number of payloads
+ * payload_size: size of each payload
+ * bits: entropy in bits per byte (0 to 8)
+ *
+ * returns: char pointer to payloads if successful, NULL otherwise
+ */
+char* create_entropy_train(int first_id, int train_size, int payload_size, int bits)
+{
+    char *train = malloc((size_t) train_size * payload_size);
+    if (train == NULL) {
+        perror("Error mallocing train");
+        return NULL;
+    }
+
+    uint32_t state = random_seed();
+    for (int i = 0; i < train_size; i++) {
+        char *payload = train + (size_t) i * payload_size;
+        fill_entropy(payload, payload_size, bits, &state);
+        set_packet_id(payload, first_id + i);
+    }
+
+    return train;
+}
+
+/**
+ * Creates all payloads of a train that repeats a single random
+ * payload, only the ids differ. Laid out like create_entropy_train().
+ *
+ * first_id: id of the first packet
+ * train_size: number of payloads
+ * payload_size: size of each payload
+ *
+ * returns: char pointer to payloads if successful, NULL otherwise
+ */
+char* create_repeated_train(int first_id, int train_size, int payload_size)
+{
+    char *train = malloc((size_t) train_size * payload_size);
+    if (train == NULL) {
+        perror("Error mallocing train");
+        return NULL;
+    }
+
+    uint32_t state = random_seed();
+    fill_entropy(train, payload_size, 8, &state);
+    for (int i = 0; i < train_size; i++) {
+        char *payload = train + (size_t) i * payload_size;
+        if (i > 0) {
+            memcpy(payload, train, payload_size);
+        }
+        set_packet_id(payload, first_id + i);
+    }
+
+    return train;
+}
+
 /**
  * Prints the binary representation of a packet, 4 bytes a row
  *
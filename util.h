@@ -7,12 +7,52 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "cJSON.h"
+
+#define MAX_ENTROPY_LEVELS 9    // 0 to 8 bits per byte
+#define FLOW_TAG_OFFSET 2       // payload byte after the id that tags the flow
+#define TRAIN_TAG_OFFSET 3      // payload byte after the flow tag that numbers the train
+#define TRAIN_MAGIC_OFFSET 4    // payload bytes marking a train tagged for the xdp program
+#define TRAIN_MAGIC 0x43445450  // "CDTP", in network byte order
+#define TRAIN_TAG_SIZE 8        // payload bytes up to the end of the magic
+#define RT_PRIORITY 50          // SCHED_FIFO priority of real time threads
+
+enum probe_mode {
+    MODE_DETECT,    // low and high entropy train
+    MODE_SWEEP,     // trains at graded entropy levels
+    MODE_DEDUP,     // unique, repeated, and low entropy trains
+    MODE_LOCALIZE,  // find the hop that compresses
+    MODE_SCAN,      // detect on many targets at once, standalone only
+    MODE_TCP,       // low and high entropy tcp bulk transfers, cooperative only
+};
+
 char* read_file(char *filename, int size);
 void set_packet_id(char *payload, int id);
+void set_flow_tag(char *payload, int flow);
+int get_flow_tag(char *payload);
+void set_train_tag(char *payload, int train);
 char* create_low_entropy_payload(int id, int payload_size);
 char* create_high_entropy_payload(int id, int payload_size);
 double time_diff_milli(struct timeval tv1, struct timeval tv2);
 double time_diff_sec(struct timeval tv1, struct timeval tv2);
+double time_diff_micro(struct timeval tv1, struct timeval tv2);
+void sleep_milli(int milli);
+int set_thread_realtime(int cpu, bool fifo);
+int lock_memory();
+long involuntary_switches();
+int get_config_int(cJSON *root, char *key, int default_value);
+double get_config_double(cJSON *root, char *key, double default_value);
+char* get_config_string(cJSON *root, char *key, char *default_value);
+int get_config_mode(cJSON *root);
+int parse_int_list(char *text, int *values, int max);
+int get_config_levels(cJSON *root, int *levels);
+uint32_t random_seed();
+void fill_entropy(char *buf, int size, int bits, uint32_t *state);
+char* create_entropy_train(int first_id, int train_size, int payload_size, int bits);
+char* create_repeated_train(int first_id, int train_size, int payload_size);
 void print_packet(char* packet, int size);
 
 #endif
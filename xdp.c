@@ -0,0 +1,292 @@
+/**
+ * @file
+ *
+ * Contains the XDP program that aggregates probe trains in the kernel,
+ * and its loader. The program is assembled by hand and loaded with the
+ * bpf() system call, like the classic socket filters, so the server
+ * needs neither a BPF compiler nor libbpf. It takes the UDP datagrams
+ * to the probing port that carry the train magic, adds them to their
+ * train's entry of an array map and drops them, everything else is
+ * passed on to the stack.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/syscall.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+
+#include "xdp.h"
+#include "util.h"
+#include "logger.h"
+
+#define MAX_INSNS 64
+#define VERIFIER_LOG 65536
+
+// frame offsets, for an ethernet header and an ip header without options
+#define IP_OFF ETH_HLEN
+#define UDP_OFF (IP_OFF + 20)
+#define PAYLOAD_OFF (UDP_OFF + 8)
+#define FRAME_HEADER (PAYLOAD_OFF + TRAIN_TAG_SIZE)
+
+#define TO_PASS 0x7FFF      // jump offset resolved to the pass branch
+
+#define INSN(c, d, s, o, i) \
+    ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define LDX(size, dst, src, off) INSN(BPF_LDX | BPF_MEM | (size), dst, src, off, 0)
+#define STX(size, dst, src, off) INSN(BPF_STX | BPF_MEM | (size), dst, src, off, 0)
+#define ATOMIC(dst, src, off, op) INSN(BPF_STX | BPF_ATOMIC | BPF_DW, dst, src, off, op)
+#define ALU_IMM(op, dst, imm) INSN(BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm)
+#define ALU_REG(op, dst, src) INSN(BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0)
+#define SWAP16(dst) INSN(BPF_ALU | BPF_END | BPF_TO_BE, dst, 0, 0, 16)
+#define JMP32_IMM(op, dst, imm, off) INSN(BPF_JMP32 | (op) | BPF_K, dst, 0, off, imm)
+#define JMP_IMM(op, dst, imm, off) INSN(BPF_JMP | (op) | BPF_K, dst, 0, off, imm)
+#define JMP_REG(op, dst, src, off) INSN(BPF_JMP | (op) | BPF_X, dst, src, off, 0)
+#define CALL(fn) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, fn)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+
+/**
+ * Issues a bpf() system call
+ *
+ * cmd: BPF_* command
+ * attr: pointer to bpf_attr union of the command
+ *
+ * returns: result of the call, -1 with errno set on failure
+ */
+static int bpf(int cmd, union bpf_attr *attr)
+{
+    return syscall(SYS_bpf, cmd, attr, sizeof(*attr));
+}
+
+/**
+ * Assembles the aggregation program. Time stamps come from
+ * bpf_ktime_get_ns(), on CLOCK_MONOTONIC. The first arrival is set
+ * with a compare and exchange and the counts are atomic adds, so
+ * packets of a train handled on several cpus at once are all counted.
+ * The last arrival is a plain store, which packets processed out of
+ * order may leave slightly early.
+ *
+ * insns: array of MAX_INSNS instructions to fill
+ * map_fd: aggregate map file descriptor
+ * port: udp port the trains are sent to
+ *
+ * returns: number of instructions
+ */
+static int assemble(struct bpf_insn *insns, int map_fd, uint16_t port)
+{
+    int n = 0;
+    // r2 = data, r3 = data_end
+    insns[n++] = LDX(BPF_W, BPF_REG_2, BPF_REG_1, offsetof(struct xdp_md, data));
+    insns[n++] = LDX(BPF_W, BPF_REG_3, BPF_REG_1, offsetof(struct xdp_md, data_end));
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_4, BPF_REG_2);
+    insns[n++] = ALU_IMM(BPF_ADD, BPF_REG_4, FRAME_HEADER);
+    insns[n++] = JMP_REG(BPF_JGT, BPF_REG_4, BPF_REG_3, TO_PASS);                 // too short
+    insns[n++] = LDX(BPF_H, BPF_REG_5, BPF_REG_2, 12);                              // ether type
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, htons(ETH_P_IP), TO_PASS);
+    insns[n++] = LDX(BPF_B, BPF_REG_5, BPF_REG_2, IP_OFF);                          // version, header length
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, 0x45, TO_PASS);
+    insns[n++] = LDX(BPF_H, BPF_REG_5, BPF_REG_2, IP_OFF + 6);                      // fragment flags, offset
+    insns[n++] = ALU_IMM(BPF_AND, BPF_REG_5, htons(IP_MF | IP_OFFMASK));
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, 0, TO_PASS);
+    insns[n++] = LDX(BPF_B, BPF_REG_5, BPF_REG_2, IP_OFF + 9);                      // protocol
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, IPPROTO_UDP, TO_PASS);
+    insns[n++] = LDX(BPF_H, BPF_REG_5, BPF_REG_2, UDP_OFF + 2);                     // destination port
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, htons(port), TO_PASS);
+    insns[n++] = LDX(BPF_W, BPF_REG_5, BPF_REG_2, PAYLOAD_OFF + TRAIN_MAGIC_OFFSET);
+    insns[n++] = JMP32_IMM(BPF_JNE, BPF_REG_5, htonl(TRAIN_MAGIC), TO_PASS);
+    insns[n++] = LDX(BPF_B, BPF_REG_9, BPF_REG_2, PAYLOAD_OFF + TRAIN_TAG_OFFSET);  // r9 = train
+    insns[n++] = JMP32_IMM(BPF_JGE, BPF_REG_9, AGGREGATE_TRAINS, TO_PASS);
+    insns[n++] = LDX(BPF_H, BPF_REG_7, BPF_REG_2, UDP_OFF + 4);                     // r7 = payload bytes
+    insns[n++] = SWAP16(BPF_REG_7);
+    insns[n++] = ALU_IMM(BPF_SUB, BPF_REG_7, 8);
+    insns[n++] = LDX(BPF_H, BPF_REG_8, BPF_REG_2, PAYLOAD_OFF);                     // r8 = packet id
+    insns[n++] = SWAP16(BPF_REG_8);
+    insns[n++] = ALU_IMM(BPF_AND, BPF_REG_8, 0xFFFF);   // the verifier loses the bound on a swap
+
+    // r6 = map_lookup_elem(map, &train)
+    insns[n++] = STX(BPF_W, BPF_REG_10, BPF_REG_9, -4);
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_2, BPF_REG_10);
+    insns[n++] = ALU_IMM(BPF_ADD, BPF_REG_2, -4);
+    insns[n++] = INSN(BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, map_fd);
+    insns[n++] = INSN(0, 0, 0, 0, 0);
+    insns[n++] = CALL(BPF_FUNC_map_lookup_elem);
+    insns[n++] = JMP_IMM(BPF_JEQ, BPF_REG_0, 0, TO_PASS);
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_6, BPF_REG_0);
+
+    // first arrival if unset, last arrival
+    insns[n++] = CALL(BPF_FUNC_ktime_get_ns);
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_1, BPF_REG_0);
+    insns[n++] = ALU_IMM(BPF_MOV, BPF_REG_0, 0);
+    insns[n++] = ATOMIC(BPF_REG_6, BPF_REG_1, offsetof(struct train_aggregate, first), BPF_CMPXCHG);
+    insns[n++] = STX(BPF_DW, BPF_REG_6, BPF_REG_1, offsetof(struct train_aggregate, last));
+    insns[n++] = JMP_IMM(BPF_JNE, BPF_REG_0, 0, 1);
+    insns[n++] = STX(BPF_DW, BPF_REG_6, BPF_REG_7, offsetof(struct train_aggregate, first_bytes));
+
+    // counts
+    insns[n++] = ALU_IMM(BPF_MOV, BPF_REG_1, 1);
+    insns[n++] = ATOMIC(BPF_REG_6, BPF_REG_1, offsetof(struct train_aggregate, packets), BPF_ADD);
+    insns[n++] = ATOMIC(BPF_REG_6, BPF_REG_7, offsetof(struct train_aggregate, bytes), BPF_ADD);
+
+    // ids[id / 64] |= 1 << id % 64
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_3, BPF_REG_8);
+    insns[n++] = ALU_IMM(BPF_RSH, BPF_REG_3, 6);
+    insns[n++] = ALU_IMM(BPF_LSH, BPF_REG_3, 3);
+    insns[n++] = ALU_REG(BPF_ADD, BPF_REG_3, BPF_REG_6);
+    insns[n++] = ALU_REG(BPF_MOV, BPF_REG_4, BPF_REG_8);
+    insns[n++] = ALU_IMM(BPF_AND, BPF_REG_4, 63);
+    insns[n++] = ALU_IMM(BPF_MOV, BPF_REG_5, 1);
+    insns[n++] = ALU_REG(BPF_LSH, BPF_REG_5, BPF_REG_4);
+    insns[n++] = ATOMIC(BPF_REG_3, BPF_REG_5, offsetof(struct train_aggregate, ids), BPF_OR);
+
+    insns[n++] = ALU_IMM(BPF_MOV, BPF_REG_0, XDP_DROP);
+    insns[n++] = EXIT();
+    int pass = n;
+    insns[n++] = ALU_IMM(BPF_MOV, BPF_REG_0, XDP_PASS);
+    insns[n++] = EXIT();
+
+    for (int i = 0; i < pass; i++) {
+        if (insns[i].off == TO_PASS) {
+            insns[i].off = pass - i - 1;
+        }
+    }
+    return n;
+}
+
+/**
+ * Loads the aggregation program and attaches it to an interface with
+ * a bpf link, in native mode where the driver supports XDP and in
+ * generic mode otherwise. Closing the link detaches it, also when the
+ * server exits. Needs kernel 5.12 or later, for the atomic operations.
+ *
+ * aggregator: pointer to xdp_aggregator struct to fill
+ * ifname: interface the trains arrive on
+ * port: udp port the trains are sent to
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int attach_aggregator(struct xdp_aggregator *aggregator, char *ifname, uint16_t port)
+{
+    aggregator->map_fd = -1;
+    aggregator->prog_fd = -1;
+    aggregator->link_fd = -1;
+
+    unsigned int ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        perror("Error finding the xdp interface");
+        return -1;
+    }
+
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_type = BPF_MAP_TYPE_ARRAY;
+    attr.key_size = sizeof(uint32_t);
+    attr.value_size = sizeof(struct train_aggregate);
+    attr.max_entries = AGGREGATE_TRAINS;
+    if ((aggregator->map_fd = bpf(BPF_MAP_CREATE, &attr)) < 0) {
+        perror("Error creating the aggregate map");
+        return -1;
+    }
+
+    struct bpf_insn insns[MAX_INSNS];
+    int count = assemble(insns, aggregator->map_fd, port);
+    memset(&attr, 0, sizeof(attr));
+    attr.prog_type = BPF_PROG_TYPE_XDP;
+    attr.insns = (uintptr_t) insns;
+    attr.insn_cnt = count;
+    attr.license = (uintptr_t) "GPL";
+    if ((aggregator->prog_fd = bpf(BPF_PROG_LOAD, &attr)) < 0) {
+        perror("Error loading the xdp program");
+        // load again for the verifier's reasons
+        char *log = malloc(VERIFIER_LOG);
+        if (log != NULL) {
+            attr.log_buf = (uintptr_t) log;
+            attr.log_size = VERIFIER_LOG;
+            attr.log_level = 1;
+            log[0] = '\0';
+            bpf(BPF_PROG_LOAD, &attr);
+            fprintf(stderr, "%s", log);
+            free(log);
+        }
+        detach_aggregator(aggregator);
+        return -1;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = aggregator->prog_fd;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    if ((aggregator->link_fd = bpf(BPF_LINK_CREATE, &attr)) < 0) {
+        perror("Error attaching the xdp program");
+        detach_aggregator(aggregator);
+        return -1;
+    }
+
+    LOG("Aggregating trains to port %d on %s.\n", port, ifname);
+    return 1;
+}
+
+/**
+ * Reads the aggregate of a train from the map
+ *
+ * aggregator: pointer to attached xdp_aggregator struct
+ * train: train index, below AGGREGATE_TRAINS
+ * aggregate: pointer to train_aggregate struct to fill
+ *
+ * returns: 1 if successful, -1 otherwise
+ */
+int read_aggregate(struct xdp_aggregator *aggregator, int train, struct train_aggregate *aggregate)
+{
+    uint32_t key = train;
+    union bpf_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = aggregator->map_fd;
+    attr.key = (uintptr_t) &key;
+    attr.value = (uintptr_t) aggregate;
+    if (bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0) {
+        perror("Error reading a train aggregate");
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * Counts the distinct ids of a train, duplicates are counted once
+ *
+ * aggregate: pointer to train_aggregate struct
+ *
+ * returns: number of ids seen
+ */
+int count_ids(struct train_aggregate *aggregate)
+{
+    int count = 0;
+    for (int i = 0; i < AGGREGATE_ID_WORDS; i++) {
+        count += __builtin_popcountll(aggregate->ids[i]);
+    }
+    return count;
+}
+
+/**
+ * Detaches the program and frees the map
+ *
+ * aggregator: pointer to xdp_aggregator struct
+ */
+void detach_aggregator(struct xdp_aggregator *aggregator)
+{
+    int *fds[3] = { &aggregator->link_fd, &aggregator->prog_fd, &aggregator->map_fd };
+    for (int i = 0; i < 3; i++) {
+        if (*fds[i] >= 0) {
+            close(*fds[i]);
+            *fds[i] = -1;
+        }
+    }
+}
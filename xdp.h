@@ -0,0 +1,36 @@
+/**
+ * @file
+ *
+ * Defines the XDP program that aggregates probe trains in the kernel.
+ */
+
+#ifndef _XDP_H_
+#define _XDP_H_
+
+#include <stdint.h>
+
+#define AGGREGATE_TRAINS 2          // trains the program keeps aggregates for
+#define AGGREGATE_ID_WORDS 1024     // 64 bit words of the id bitmap, a bit per 16 bit id
+
+// map value, laid out as the program writes it
+struct train_aggregate {
+    uint64_t first;         // CLOCK_MONOTONIC ns of the first packet, 0 before it
+    uint64_t last;          // CLOCK_MONOTONIC ns of the latest packet
+    uint64_t packets;       // packets seen, duplicates included
+    uint64_t bytes;         // udp payload bytes seen
+    uint64_t first_bytes;   // udp payload bytes of the first packet
+    uint64_t ids[AGGREGATE_ID_WORDS];
+};
+
+struct xdp_aggregator {
+    int map_fd;
+    int prog_fd;
+    int link_fd;
+};
+
+int attach_aggregator(struct xdp_aggregator *aggregator, char *ifname, uint16_t port);
+int read_aggregate(struct xdp_aggregator *aggregator, int train, struct train_aggregate *aggregate);
+int count_ids(struct train_aggregate *aggregate);
+void detach_aggregator(struct xdp_aggregator *aggregator);
+
+#endif